@@ -67,9 +67,15 @@ end
 message "=== Checking Ruby features ===\n"
 
 have_header("ruby/io.h")
+have_func("rb_integer_pack")
 have_func("rb_big_pack")
 have_func("rb_enumeratorize")
 have_func("rb_str_encode")
+have_func("rb_time_timespec")
+have_func("rb_time_timespec_new")
+have_func("rb_enc_interned_str")
+have_func("rb_str_to_interned_str")
+have_func("rb_hash_new_capa")
 
 message "=== Checking platform features ===\n"
 
@@ -82,7 +82,7 @@ typedef struct krypt_asn1_object_st {
     size_t bytes_len;
 } krypt_asn1_object;
 
-typedef int (*krypt_asn1_decoder)(VALUE self, uint8_t *bytes, size_t len, VALUE *out);
+typedef int (*krypt_asn1_decoder)(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out);
 typedef int (*krypt_asn1_encoder)(VALUE self, VALUE value, uint8_t **out, size_t *len);
 typedef int (*krypt_asn1_validator)(VALUE, VALUE);
 
@@ -90,11 +90,21 @@ typedef struct krypt_asn1_codec_st {
     krypt_asn1_encoder encoder;
     krypt_asn1_decoder decoder;
     krypt_asn1_validator validator;
+    VALUE handler; /* Ruby-level codec object, 0 for native codecs */
 } krypt_asn1_codec;
 
 extern krypt_asn1_codec KRYPT_DEFAULT_CODEC;
 extern krypt_asn1_codec krypt_asn1_codecs[];
 
+int krypt_asn1_codec_register(int tag_class, int tag, krypt_asn1_codec *codec);
+int krypt_asn1_codec_register_handler(int tag_class, int tag, VALUE handler);
+krypt_asn1_codec *krypt_asn1_codec_for(int tag_class, int tag);
+int krypt_asn1_codec_decode(krypt_asn1_codec *codec, VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out);
+int krypt_asn1_codec_encode(krypt_asn1_codec *codec, VALUE self, VALUE value, uint8_t **out, size_t *len);
+int krypt_asn1_codec_validate(krypt_asn1_codec *codec, VALUE self, VALUE value);
+int krypt_asn1_encode_bit_string(int unused_bits, VALUE value, uint8_t **out, size_t *len);
+int krypt_asn1_decode_bit_string(uint8_t *bytes, size_t len, int flags, int *unused_bits, VALUE *out);
+
 krypt_asn1_header *krypt_asn1_header_new(void);
 void krypt_asn1_header_free(krypt_asn1_header *header);
 krypt_asn1_object *krypt_asn1_object_new(krypt_asn1_header *header);
@@ -106,6 +116,7 @@ int krypt_asn1_tag_class_for_id(ID tag_class);
 int krypt_asn1_next_header(binyo_instream *in, krypt_asn1_header **out);
 int krypt_asn1_skip_value(binyo_instream *in, krypt_asn1_header *last);
 int krypt_asn1_get_value(binyo_instream *in, krypt_asn1_header *last, uint8_t **out, size_t *outlen);
+int krypt_asn1_decode_header_flags(binyo_instream *in, krypt_asn1_header *header, int flags, VALUE *out);
 binyo_instream *krypt_asn1_get_value_stream(binyo_instream *in, krypt_asn1_header *last, int values_only);
 
 int krypt_asn1_header_encode(binyo_outstream *out, krypt_asn1_header *header);
@@ -113,5 +124,22 @@ int krypt_asn1_object_encode(binyo_outstream *out, krypt_asn1_object *object);
 
 int krypt_asn1_cmp_set_of(uint8_t *s1, size_t len1, uint8_t *s2, size_t len2, int *result);
 
+int krypt_asn1_encode_object_id_arcs(VALUE arcs, uint8_t **out, size_t *outlen);
+int krypt_asn1_decode_object_id_arcs(uint8_t *bytes, size_t len, VALUE *out);
+
+int krypt_asn1_utf16be_to_utf8(uint8_t *bytes, size_t len, VALUE *out);
+int krypt_asn1_utf32be_to_utf8(uint8_t *bytes, size_t len, VALUE *out);
+int krypt_asn1_utf8_to_utf16be(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen);
+int krypt_asn1_utf8_to_utf32be(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen);
+int krypt_asn1_check_charset(int tag, uint8_t *bytes, size_t len);
+int krypt_asn1_check_utf8(uint8_t *bytes, size_t len);
+
+VALUE krypt_asn1_raw_integer_new(uint8_t *bytes, size_t len);
+int krypt_asn1_is_raw_integer(VALUE value);
+void krypt_asn1_raw_integer_get_der(VALUE value, uint8_t **out, size_t *outlen);
+
+void Init_krypt_asn1_codec(void);
+void Init_krypt_asn1_raw_integer(void);
+
 #endif /* _KRYPT_ASN1_INTERNAL_H_ */
 
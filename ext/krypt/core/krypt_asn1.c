@@ -58,8 +58,12 @@ ID sKrypt_TC_UNIVERSAL, sKrypt_TC_APPLICATION, sKrypt_TC_CONTEXT_SPECIFIC, sKryp
 ID sKrypt_TC_EXPLICIT, sKrypt_TC_IMPLICIT;
 
 ID sKrypt_IV_TAG, sKrypt_IV_TAG_CLASS, sKrypt_IV_INF_LEN, sKrypt_IV_UNUSED_BITS;
+ID sKrypt_IV_FRACTIONAL_SECONDS;
 ID sKrypt_IV_VALUE;
 
+static ID sKrypt_ID_RAW_INTEGERS, sKrypt_ID_EPOCH_TIMES, sKrypt_ID_STRICT, sKrypt_ID_INTERN_STRINGS;
+static ID sKrypt_ID_LAZY_COLLECTIONS, sKrypt_ID_CACHE_ELEMENTS, sKrypt_ID_PLAIN_ELEMENTS;
+
 typedef struct krypt_asn1_info_st {
     const char *name;
     VALUE *klass;
@@ -114,17 +118,16 @@ struct krypt_asn1_data_st {
     krypt_asn1_update_cb update_cb;
     krypt_asn1_codec *codec;
     int flags;
+    int decode_flags;
     int default_tag;
 }; 
 
 static krypt_asn1_codec *
 int_codec_for(krypt_asn1_object *object)
 {
-    krypt_asn1_codec *codec = NULL;
-    int tag = object->header->tag;
+    krypt_asn1_codec *codec;
 
-    if (tag < 31 && object->header->tag_class == TAG_CLASS_UNIVERSAL)
-	codec = &krypt_asn1_codecs[tag];
+    codec = krypt_asn1_codec_for(object->header->tag_class, object->header->tag);
     if (!codec)
 	codec = &KRYPT_DEFAULT_CODEC;
 
@@ -141,6 +144,7 @@ int_asn1_data_new(krypt_asn1_object *object)
     ret->update_cb = NULL;
     ret->codec = int_codec_for(object);
     ret->flags = ASN1DATA_DECODED; /* only overwritten by parsed values */
+    ret->decode_flags = 0;
     ret->default_tag = -1;
     return ret;
 }
@@ -230,6 +234,34 @@ int_handle_class_specifics(VALUE self, krypt_asn1_header *header)
     }
 }
 
+/**
+ * Returns the class that a value with the given tag is decoded to. Universal
+ * tags must not be larger than 30.
+ */
+VALUE
+krypt_asn1_class_for(int tag, int tag_class, int is_constructed)
+{
+    if (tag_class == TAG_CLASS_UNIVERSAL && krypt_asn1_infos[tag].klass)
+	return *(krypt_asn1_infos[tag].klass);
+    return is_constructed ? cKryptASN1Constructive : cKryptASN1Data;
+}
+
+/**
+ * Returns the universal tag that values of +klass+ are decoded from, or -1
+ * if +klass+ is not the class of a universal tag.
+ */
+int
+krypt_asn1_universal_tag_for(VALUE klass)
+{
+    int i;
+
+    for (i=0; i < krypt_asn1_infos_size; ++i) {
+	if (krypt_asn1_infos[i].klass && *(krypt_asn1_infos[i].klass) == klass)
+	    return i;
+    }
+    return -1;
+}
+
 static VALUE
 int_determine_class_and_default_tag(krypt_asn1_data *data)
 {
@@ -240,23 +272,15 @@ int_determine_class_and_default_tag(krypt_asn1_data *data)
 	    krypt_error_add("Universal tag too large: %d", header->tag);
 	    return Qnil;
 	}
-	if (!krypt_asn1_infos[header->tag].klass) {
-	    if (header->is_constructed)
-		return cKryptASN1Constructive;
-	    else
-		return cKryptASN1Data;
-	}
-	data->default_tag = header->tag;
-	return *(krypt_asn1_infos[header->tag].klass);
-    }
-    else {
-	return header->is_constructed ? cKryptASN1Constructive : cKryptASN1Data;
+	if (krypt_asn1_infos[header->tag].klass)
+	    data->default_tag = header->tag;
     }
+    return krypt_asn1_class_for(header->tag, header->tag_class, header->is_constructed);
 }
 
 /* This initializer is used with freshly parsed values */
 static VALUE
-krypt_asn1_data_new(binyo_instream *in, krypt_asn1_header *header)
+krypt_asn1_data_new(binyo_instream *in, krypt_asn1_header *header, int decode_flags)
 {
     VALUE obj;
     VALUE klass;
@@ -272,6 +296,7 @@ krypt_asn1_data_new(binyo_instream *in, krypt_asn1_header *header)
     encoding = krypt_asn1_object_new_value(header, value, value_len);
     data = int_asn1_data_new(encoding);
     int_asn1_data_set_decoded(data, 0);
+    data->decode_flags = decode_flags;
     klass = int_determine_class_and_default_tag(data);
     if (NIL_P(klass)) goto error;
     int_asn1_data_set(klass, obj, data);
@@ -426,7 +451,7 @@ int_asn1_default_initialize(VALUE self,
 
     /* Override default behavior to support tag classes other than UNIVERSAL */
     if (default_tag <= 30) {
-	data->codec = &krypt_asn1_codecs[default_tag];
+	data->codec = krypt_asn1_codec_for(TAG_CLASS_UNIVERSAL, default_tag);
 	data->default_tag = default_tag;
     }
 
@@ -1163,7 +1188,7 @@ int_asn1_cons_value_decode(VALUE self, krypt_asn1_data *data, VALUE *out)
     in = binyo_instream_new_bytes(object->bytes, object->bytes_len);
     
     while ((ret = krypt_asn1_next_header(in, &header)) == KRYPT_OK) {
-	if (!(cur = krypt_asn1_data_new(in, header))) {
+	if (!(cur = krypt_asn1_data_new(in, header, data->decode_flags))) {
 	    goto error;
 	}
 	rb_ary_push(*out, cur);
@@ -1410,7 +1435,7 @@ int_asn1_prim_value_decode(VALUE self, krypt_asn1_data *data, VALUE *out)
     krypt_asn1_object *object;
 
     object = data->object;
-    return data->codec->decoder(self, object->bytes, object->bytes_len, out);
+    return krypt_asn1_codec_decode(data->codec, self, object->bytes, object->bytes_len, data->decode_flags, out);
 }
 
 static int
@@ -1428,8 +1453,8 @@ int_asn1_prim_encode_to(VALUE self, binyo_outstream *out, VALUE value, krypt_asn
 	}
     }
 
-    if (data->codec->validator(self, value) == KRYPT_ERR) return KRYPT_ERR;
-    if (data->codec->encoder(self, value, &object->bytes, &object->bytes_len) == KRYPT_ERR) return KRYPT_ERR;
+    if (krypt_asn1_codec_validate(data->codec, self, value) == KRYPT_ERR) return KRYPT_ERR;
+    if (krypt_asn1_codec_encode(data->codec, self, value, &object->bytes, &object->bytes_len) == KRYPT_ERR) return KRYPT_ERR;
     object->header->length = object->bytes_len;
     if (krypt_asn1_object_encode(out, object) == KRYPT_ERR) return KRYPT_ERR;
 
@@ -1456,19 +1481,214 @@ krypt_asn1_bit_string_get_unused_bits(VALUE self)
     return rb_ivar_get(self, sKrypt_IV_UNUSED_BITS);
 }
 
+static int
+int_bit_string_has_unused_bits(VALUE self)
+{
+    VALUE unused_bits = rb_ivar_get(self, sKrypt_IV_UNUSED_BITS);
+    return !NIL_P(unused_bits) && NUM2INT(unused_bits) != 0;
+}
+
+/*
+ * call-seq:
+ *    bit_string.decode_contents([opts]) -> ASN1Data
+ *    octet_string.decode_contents([opts]) -> ASN1Data
+ *
+ * * +opts+: Decoding options, see ASN1.decode.
+ *
+ * Decodes the DER value encapsulated in a BIT STRING or OCTET STRING, such
+ * as the subjectPublicKey of a SubjectPublicKeyInfo or an X.509 extension
+ * value. Parsed values are decoded directly from their content octets
+ * without creating the intermediate String returned by +value+.
+ */
+static VALUE
+krypt_asn1_data_decode_contents(int argc, VALUE *argv, VALUE self)
+{
+    krypt_asn1_data *data;
+    krypt_asn1_object *object;
+    VALUE opts = Qnil, ret, value = Qnil;
+    int tag, result;
+
+    rb_scan_args(argc, argv, "01", &opts);
+    int_asn1_data_get(self, data);
+    object = data->object;
+    tag = rb_obj_is_kind_of(self, cKryptASN1BitString) ? TAGS_BIT_STRING : TAGS_OCTET_STRING;
+
+    if (object->bytes) {
+	result = krypt_asn1_decode_encapsulated(tag, object->bytes, object->bytes_len, krypt_asn1_decode_flags_for(opts), &ret);
+    }
+    else {
+	value = krypt_asn1_data_get_value(self);
+	StringValue(value);
+	if (tag == TAGS_BIT_STRING && int_bit_string_has_unused_bits(self))
+	    rb_raise(eKryptASN1Error, "BIT STRING with unused bits cannot encapsulate a value");
+	result = krypt_asn1_decode_encapsulated(TAGS_OCTET_STRING, (uint8_t *) RSTRING_PTR(value), RSTRING_LEN(value), krypt_asn1_decode_flags_for(opts), &ret);
+	RB_GC_GUARD(value);
+    }
+    if (result != KRYPT_OK)
+	krypt_error_raise(eKryptASN1Error, "Error while decoding contents");
+    return ret;
+}
+
+/**
+ * Enables or disables fractional seconds for GeneralizedTime encodings.
+ * If set, a +Time+ value with sub-second precision is encoded with its
+ * fraction, without trailing zeros as required by DER. Changing the setting
+ * invalidates the cached encoding of a parsed value.
+ */
+static VALUE
+krypt_asn1_generalized_time_set_fractional_seconds(VALUE self, VALUE fractional)
+{
+    VALUE value = krypt_asn1_data_get_value(self);
+
+    rb_ivar_set(self, sKrypt_IV_FRACTIONAL_SECONDS, RTEST(fractional) ? Qtrue : Qfalse);
+    krypt_asn1_data_set_value(self, value);
+    return fractional;
+}
+
+static VALUE
+krypt_asn1_generalized_time_get_fractional_seconds(VALUE self)
+{
+    return RTEST(rb_attr_get(self, sKrypt_IV_FRACTIONAL_SECONDS)) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    ObjectId.from_arcs(arcs) -> ObjectId
+ *
+ * * +arcs+: an +Array+ of non-negative +Integer+s, e.g. [1, 2, 840, 113549]
+ *
+ * Creates an ObjectId directly from its arcs. The encoding is computed
+ * right away, the dotted +String+ +value+ is only built when requested.
+ */
+static VALUE
+krypt_asn1_object_id_from_arcs(VALUE klass, VALUE arcs)
+{
+    VALUE obj;
+    krypt_asn1_data *data;
+    krypt_asn1_object *object;
+    uint8_t *bytes;
+    size_t len;
+
+    Check_Type(arcs, T_ARRAY);
+    if (krypt_asn1_encode_object_id_arcs(arcs, &bytes, &len) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Error while encoding OBJECT IDENTIFIER");
+
+    obj = rb_obj_alloc(klass);
+    obj = int_asn1_default_initialize(obj,
+	    			      Qnil,
+				      INT2NUM(TAGS_OBJECT_ID),
+				      TAGS_OBJECT_ID,
+				      ID2SYM(sKrypt_TC_UNIVERSAL));
+    int_asn1_data_get(obj, data);
+    object = data->object;
+    object->bytes = bytes;
+    object->bytes_len = len;
+    object->header->length = len;
+    int_asn1_data_set_decoded(data, 0);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *    oid.arcs -> Array
+ *
+ * Returns the arcs of this ObjectId as an +Array+ of +Integer+s. For
+ * parsed values the arcs are read from the encoding directly.
+ */
+static VALUE
+krypt_asn1_object_id_get_arcs(VALUE self)
+{
+    krypt_asn1_data *data;
+    krypt_asn1_object *object;
+    VALUE ret;
+    uint8_t *bytes;
+    size_t len;
+    int result;
+
+    int_asn1_data_get(self, data);
+    object = data->object;
+
+    if (object->bytes) {
+	if (krypt_asn1_decode_object_id_arcs(object->bytes, object->bytes_len, &ret) == KRYPT_ERR)
+	    krypt_error_raise(eKryptASN1Error, "Error while decoding OBJECT IDENTIFIER");
+	return ret;
+    }
+
+    if (krypt_asn1_codec_encode(data->codec, self, krypt_asn1_data_get_value(self), &bytes, &len) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Error while encoding OBJECT IDENTIFIER");
+    result = krypt_asn1_decode_object_id_arcs(bytes, len, &ret);
+    xfree(bytes);
+    if (result == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Error while decoding OBJECT IDENTIFIER");
+    return ret;
+}
+
 /* End ASN1Primitive methods */
 
+/**
+ * Translates the options +Hash+ accepted by the decode methods into
+ * KRYPT_ASN1_DECODE_* flags.
+ *
+ * @param opts	An options +Hash+ or nil
+ * @return	The corresponding flags, 0 if no option was set
+ */
+int
+krypt_asn1_decode_flags_for(VALUE opts)
+{
+    int flags = 0;
+
+    if (NIL_P(opts)) return 0;
+    Check_Type(opts, T_HASH);
+    if (RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_RAW_INTEGERS))))
+	flags |= KRYPT_ASN1_DECODE_RAW_INTEGER;
+    if (RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_EPOCH_TIMES))))
+	flags |= KRYPT_ASN1_DECODE_EPOCH_TIME;
+    if (RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_STRICT))))
+	flags |= KRYPT_ASN1_DECODE_STRICT;
+    if (RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_INTERN_STRINGS))))
+	flags |= KRYPT_ASN1_DECODE_INTERN;
+    if (RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_LAZY_COLLECTIONS))))
+	flags |= KRYPT_ASN1_DECODE_LAZY;
+    if (rb_hash_aref(opts, ID2SYM(sKrypt_ID_CACHE_ELEMENTS)) == Qfalse)
+	flags |= KRYPT_ASN1_DECODE_NO_CACHE;
+    if (RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_PLAIN_ELEMENTS))))
+	flags |= KRYPT_ASN1_DECODE_PLAIN;
+    return flags;
+}
+
 int 
 krypt_asn1_decode_stream(binyo_instream *in, VALUE *out)
+{
+    return krypt_asn1_decode_stream_flags(in, 0, out);
+}
+
+/**
+ * Decodes the next value of +in+. +flags+ are a combination of
+ * KRYPT_ASN1_DECODE_* values, they are inherited by all nested values.
+ */
+int 
+krypt_asn1_decode_stream_flags(binyo_instream *in, int flags, VALUE *out)
 {
     krypt_asn1_header *header;
-    VALUE ret;
     int result;
 
     result = krypt_asn1_next_header(in, &header);
     if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR) return result;
+    return krypt_asn1_decode_header_flags(in, header, flags, out);
+}
+
+/**
+ * Decodes the value of +header+, which was the last header read from +in+.
+ * +header+ is owned by the decoded value afterwards, it is freed if
+ * decoding fails.
+ */
+int
+krypt_asn1_decode_header_flags(binyo_instream *in, krypt_asn1_header *header, int flags, VALUE *out)
+{
+    VALUE ret;
 
-    ret = krypt_asn1_data_new(in, header);
+    ret = krypt_asn1_data_new(in, header, flags);
     if (NIL_P(ret)) {
 	krypt_asn1_header_free(header);
 	return KRYPT_ERR;
@@ -1477,8 +1697,43 @@ krypt_asn1_decode_stream(binyo_instream *in, VALUE *out)
     return KRYPT_OK;
 }
 
+/**
+ * Decodes the DER value encapsulated in the content octets of a BIT STRING
+ * or OCTET STRING. The value is parsed directly from +bytes+, for BIT
+ * STRINGs these still include the leading unused bits octet. The value
+ * must span all of the content octets.
+ */
+int
+krypt_asn1_decode_encapsulated(int tag, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    binyo_instream *in;
+    uint8_t b;
+    int result;
+
+    if (tag == TAGS_BIT_STRING) {
+	if (len == 0 || bytes[0] != 0) {
+	    krypt_error_add("BIT STRING with unused bits cannot encapsulate a value");
+	    return KRYPT_ERR;
+	}
+	bytes++;
+	len--;
+    }
+    in = binyo_instream_new_bytes(bytes, len);
+    result = krypt_asn1_decode_stream_flags(in, flags, out);
+    if (result == KRYPT_OK && binyo_instream_read(in, &b, 1) != BINYO_IO_EOF) {
+	krypt_error_add("Data left that could not be parsed");
+	result = KRYPT_ERR;
+    }
+    binyo_instream_free(in);
+    if (result == KRYPT_ASN1_EOF) {
+	krypt_error_add("No encapsulated value found");
+	return KRYPT_ERR;
+    }
+    return result;
+}
+
 static VALUE
-int_asn1_fallback_decode(binyo_instream *in, binyo_instream *cache)
+int_asn1_fallback_decode(binyo_instream *in, binyo_instream *cache, int flags)
 {
     VALUE ret;
     uint8_t *lookahead = NULL;
@@ -1491,7 +1746,7 @@ int_asn1_fallback_decode(binyo_instream *in, binyo_instream *cache)
     binyo_instream_cache_free_wrapper(cache); /* do not use krypt_instream_free, would free in too */
     bytes = binyo_instream_new_bytes(lookahead, la_size);
     retry = binyo_instream_new_seq(bytes, in); /*chain cached bytes and original stream */
-    result = krypt_asn1_decode_stream(retry, &ret);
+    result = krypt_asn1_decode_stream_flags(retry, flags, &ret);
     if (lookahead)
 	xfree(lookahead);
     binyo_instream_free(retry);
@@ -1502,12 +1757,25 @@ int_asn1_fallback_decode(binyo_instream *in, binyo_instream *cache)
 
 /**
  * call-seq:
- *    ASN1.decode(src) -> ASN1Data
+ *    ASN1.decode(src, [opts]) -> ASN1Data
  *
  * * +src+: May either be a +String+ containing a DER-/PEM-encoded value, an
  *         IO-like object supporting IO#read and IO#seek or any arbitrary
  *         object that supports either a +to_der+ or a +to_pem+ method
  *         transforming it into a DER-/BER-encoded or PEM-encoded +String+.
+ * * +opts+: An optional +Hash+ of decoding options, they apply to the value
+ *           and all of its nested values:
+ *   * +:raw_integers+: if true, INTEGER and ENUMERATED values are returned
+ *     as RawInteger instead of +Integer+
+ *   * +:epoch_times+: if true, UTCTime and GeneralizedTime values are
+ *     returned as +Integer+ seconds since the epoch instead of +Time+
+ *   * +:strict+: if true, the values of NumericString, PrintableString,
+ *     IA5String and ISO64String (VisibleString) are checked against their
+ *     character sets and UTF8String values must be well-formed UTF-8.
+ *     Values violating these rules raise an error when they are decoded.
+ *   * +:intern_strings+: if true, String values of up to 64 bytes are
+ *     returned as frozen, deduplicated Strings. Repeated values such as
+ *     country codes or issuer names then share a single String instance.
  *
  * Decodes arbitrary DER- or PEM-encoded ASN.1 objects and returns an instance
  * (or a subclass) of ASN1Data.
@@ -1529,20 +1797,25 @@ int_asn1_fallback_decode(binyo_instream *in, binyo_instream *cache)
  *   puts int.value # => 1
  */
 static VALUE
-krypt_asn1_decode(VALUE self, VALUE obj)
+krypt_asn1_decode(int argc, VALUE *argv, VALUE self)
 {
     binyo_instream *in;
     binyo_instream *cache;
     binyo_instream *pem;
+    VALUE obj, opts = Qnil;
     VALUE ret;
+    int flags;
+
+    rb_scan_args(argc, argv, "11", &obj, &opts);
+    flags = krypt_asn1_decode_flags_for(opts);
 
     /* Try PEM first, if it fails, try as DER */
     in = krypt_instream_new_value_der(obj);
     cache = binyo_instream_new_cache(in);
     pem = krypt_instream_new_pem(cache);
-    if (krypt_asn1_decode_stream(pem, &ret) != KRYPT_OK) {
+    if (krypt_asn1_decode_stream_flags(pem, flags, &ret) != KRYPT_OK) {
 	krypt_instream_pem_free_wrapper(pem);
-	return int_asn1_fallback_decode(in, cache);
+	return int_asn1_fallback_decode(in, cache, flags);
     }
     binyo_instream_free(pem); /* also frees in */
     return ret;
@@ -1550,25 +1823,29 @@ krypt_asn1_decode(VALUE self, VALUE obj)
 
 /**
  * call-seq:
- *    ASN1.decode_der(der) -> ASN1Data
+ *    ASN1.decode_der(der, [opts]) -> ASN1Data
  *
  * * +der+: May either be a +String+ containing a DER-encoded value, an
  *         IO-like object supporting IO#read and IO#seek or any arbitrary
  *         object that supports a +to_der+ method transforming it into a
  *         DER-/BER-encoded +String+.
+ * * +opts+: Decoding options, see ASN1.decode.
  *
  * Decodes a DER-encoded ASN.1 object and returns an instance (or a subclass)
  * of ASN1Data. Can be used in the same way as +ASN1Data#decode+, except that
  * +decode_der+ explicitly assumes a DER-encoded source.
  */
 static VALUE
-krypt_asn1_decode_der(VALUE self, VALUE obj)
+krypt_asn1_decode_der(int argc, VALUE *argv, VALUE self)
 {
+    VALUE obj, opts = Qnil;
     VALUE ret;
     int result;
+    binyo_instream *in;
 
-    binyo_instream *in = krypt_instream_new_value_der(obj);
-    result = krypt_asn1_decode_stream(in, &ret);
+    rb_scan_args(argc, argv, "11", &obj, &opts);
+    in = krypt_instream_new_value_der(obj);
+    result = krypt_asn1_decode_stream_flags(in, krypt_asn1_decode_flags_for(opts), &ret);
     binyo_instream_free(in);
     if (result != KRYPT_OK)
 	krypt_error_raise(eKryptASN1Error, "Error while DER-decoding value");
@@ -1577,32 +1854,266 @@ krypt_asn1_decode_der(VALUE self, VALUE obj)
 
 /**
  * call-seq:
- *    ASN1.decode_pem(pem) -> ASN1Data
+ *    ASN1.decode_pem(pem, [opts]) -> ASN1Data
  *
  * * +pem+: May either be a +String+ containing a PEM-encoded value, an
  *         IO-like object supporting IO#read and IO#seek or any arbitrary
  *         object that supports a +to_pem+ method transforming it into a
  *         PEM-encoded +String+.
+ * * +opts+: Decoding options, see ASN1.decode.
  *
  * Decodes a PEM-encoded ASN.1 object and returns an instance (or a subclass)
  * of ASN1Data. Can be used in the same way as +ASN1Data#decode+, except that
  * +decode_pem+ explicitly assumes a PEM-encoded source.
  */
 static VALUE
-krypt_asn1_decode_pem(VALUE self, VALUE obj)
+krypt_asn1_decode_pem(int argc, VALUE *argv, VALUE self)
 {
+    VALUE obj, opts = Qnil;
     VALUE ret;
     int result;
-    
     binyo_instream *pem;
+
+    rb_scan_args(argc, argv, "11", &obj, &opts);
     pem = krypt_instream_new_pem(krypt_instream_new_value_pem(obj));
-    result = krypt_asn1_decode_stream(pem, &ret);
+    result = krypt_asn1_decode_stream_flags(pem, krypt_asn1_decode_flags_for(opts), &ret);
     binyo_instream_free(pem);
     if (result != KRYPT_OK)
 	krypt_error_raise(eKryptASN1Error, "Error while PEM-decoding value");
     return ret;
 }
 
+#define KRYPT_ASN1_TO_RUBY_MAX_DEPTH	64
+
+static int int_asn1_to_ruby_value(krypt_asn1_header *header, uint8_t *bytes, size_t len, int flags, int depth, VALUE *out);
+
+/*
+ * Appends the plain Ruby values of the encodings in +bytes+ to +ary+. Values
+ * of definite length are converted from +bytes+ in place. Once an infinite
+ * length value was read positions are no longer known and values are copied
+ * from then on. If +is_infinite+ is set, the closing EOC is skipped.
+ */
+static int
+int_asn1_to_ruby_elements(uint8_t *bytes, size_t len, int is_infinite, int flags, int depth, VALUE ary)
+{
+    binyo_instream *in;
+    krypt_asn1_header *header = NULL;
+    uint8_t *value;
+    size_t value_len, start, offset = 0;
+    int result, copied, slicing = 1;
+    VALUE cur;
+
+    in = binyo_instream_new_bytes(bytes, len);
+    while ((result = krypt_asn1_next_header(in, &header)) == KRYPT_OK) {
+	if (is_infinite && 
+	    header->tag == TAGS_END_OF_CONTENTS && 
+	    header->tag_class == TAG_CLASS_UNIVERSAL) {
+	    krypt_asn1_header_free(header);
+	    break;
+	}
+	if (slicing && !header->is_infinite) {
+	    start = offset + header->tag_len + header->length_len;
+	    if (start > len || header->length > len - start) {
+		krypt_error_add("Premature EOF detected");
+		goto error;
+	    }
+	    if (krypt_asn1_skip_value(in, header) == KRYPT_ERR) goto error;
+	    offset = start + header->length;
+	    value_len = header->length;
+	    value = value_len ? bytes + start : NULL;
+	    copied = 0;
+	}
+	else {
+	    slicing = 0;
+	    if (krypt_asn1_get_value(in, header, &value, &value_len) == KRYPT_ERR) goto error;
+	    copied = 1;
+	}
+
+	result = int_asn1_to_ruby_value(header, value, value_len, flags, depth, &cur);
+	if (copied && value) xfree(value);
+	krypt_asn1_header_free(header);
+	header = NULL;
+	if (result == KRYPT_ERR) goto error;
+	rb_ary_push(ary, cur);
+    }
+    if (result == KRYPT_ERR) goto error;
+
+    binyo_instream_free(in);
+    return KRYPT_OK;
+
+error:
+    if (header) krypt_asn1_header_free(header);
+    binyo_instream_free(in);
+    return KRYPT_ERR;
+}
+
+/*
+ * Converts the value described by +header+ and its content octets to a
+ * plain Ruby value: constructed values become Arrays of their elements,
+ * primitive values are decoded by the codec for their tag. BIT STRINGs lose
+ * their unused bits octet, they are represented by the remaining octets only.
+ */
+static int
+int_asn1_to_ruby_value(krypt_asn1_header *header, uint8_t *bytes, size_t len, int flags, int depth, VALUE *out)
+{
+    krypt_asn1_codec *codec;
+
+    /* same as decode, see int_determine_class_and_default_tag */
+    if (header->tag_class == TAG_CLASS_UNIVERSAL && header->tag > 30) {
+	krypt_error_add("Universal tag too large: %d", header->tag);
+	return KRYPT_ERR;
+    }
+    if (header->is_constructed) {
+	if (depth >= KRYPT_ASN1_TO_RUBY_MAX_DEPTH) {
+	    krypt_error_add("Values nested too deeply");
+	    return KRYPT_ERR;
+	}
+	*out = rb_ary_new();
+	if (!bytes) return KRYPT_OK;
+	return int_asn1_to_ruby_elements(bytes, len, header->is_infinite, flags, depth + 1, *out);
+    }
+
+    if (!(codec = krypt_asn1_codec_for(header->tag_class, header->tag)))
+	codec = &KRYPT_DEFAULT_CODEC;
+    if (codec == &krypt_asn1_codecs[TAGS_BIT_STRING]) {
+	if (len == 0 || bytes[0] > 7) {
+	    krypt_error_add("Invalid BIT STRING encoding");
+	    return KRYPT_ERR;
+	}
+	return krypt_asn1_codec_decode(&KRYPT_DEFAULT_CODEC, Qnil, bytes + 1, len - 1, flags, out);
+    }
+    return krypt_asn1_codec_decode(codec, Qnil, bytes, len, flags, out);
+}
+
+/*
+ * Reads the next value of +in+ and converts it to a plain Ruby value.
+ */
+static int
+int_asn1_to_ruby_stream(binyo_instream *in, int flags, VALUE *out)
+{
+    krypt_asn1_header *header;
+    uint8_t *value = NULL;
+    size_t value_len;
+    int result;
+
+    result = krypt_asn1_next_header(in, &header);
+    if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR) return result;
+
+    if (krypt_asn1_get_value(in, header, &value, &value_len) == KRYPT_ERR) {
+	krypt_asn1_header_free(header);
+	return KRYPT_ERR;
+    }
+    result = int_asn1_to_ruby_value(header, value, value_len, flags, 0, out);
+    if (value) xfree(value);
+    krypt_asn1_header_free(header);
+    return result;
+}
+
+/**
+ * call-seq:
+ *    ASN1.decode_to_ruby(der, [opts]) -> Array or Object
+ *
+ * * +der+: May either be a +String+ containing a DER-encoded value, an
+ *         IO-like object supporting IO#read and IO#seek or any arbitrary
+ *         object that supports a +to_der+ method transforming it into a
+ *         DER-/BER-encoded +String+.
+ * * +opts+: Decoding options for the primitive values, see ASN1.decode.
+ *
+ * Decodes a DER-encoded ASN.1 object directly to plain Ruby values, without
+ * creating any ASN1Data. Constructed values become (nested) Arrays of their
+ * elements, primitive values are decoded as their ASN1Data#value would be.
+ * Tags are not retained: tagged values are decoded like ASN1Data values
+ * with the same tag, an explicitly tagged value becomes an Array holding
+ * the inner value. BIT STRING values are returned without their unused bits.
+ *
+ * == Example
+ *   seq = Krypt::ASN1::Sequence.new([Krypt::ASN1::Integer.new(1),
+ *                                    Krypt::ASN1::Boolean.new(true)])
+ *   Krypt::ASN1.decode_to_ruby(seq.to_der) # => [1, true]
+ */
+static VALUE
+krypt_asn1_decode_to_ruby(int argc, VALUE *argv, VALUE self)
+{
+    VALUE obj, opts = Qnil;
+    VALUE ret;
+    int result;
+    binyo_instream *in;
+
+    rb_scan_args(argc, argv, "11", &obj, &opts);
+    in = krypt_instream_new_value_der(obj);
+    result = int_asn1_to_ruby_stream(in, krypt_asn1_decode_flags_for(opts), &ret);
+    binyo_instream_free(in);
+    if (result != KRYPT_OK)
+	krypt_error_raise(eKryptASN1Error, "Error while DER-decoding value");
+    return ret;
+}
+
+/*
+ * call-seq:
+ *    asn1.to_ruby -> Array or Object
+ *
+ * Returns the value of this ASN1Data as plain Ruby values, as
+ * ASN1.decode_to_ruby would return them for its encoding. Values that
+ * were parsed and not modified are converted from their encoding directly,
+ * no nested ASN1Data are created.
+ */
+static VALUE
+krypt_asn1_data_to_ruby(VALUE self)
+{
+    krypt_asn1_data *data;
+    krypt_asn1_object *object;
+    binyo_instream *in;
+    VALUE der, ret;
+    int result;
+
+    int_asn1_data_get(self, data);
+    object = data->object;
+
+    if (object->bytes && object->header->tag_bytes && object->header->length_bytes) {
+	result = int_asn1_to_ruby_value(object->header, object->bytes, object->bytes_len, data->decode_flags, 0, &ret);
+    }
+    else {
+	der = krypt_asn1_data_to_der(self);
+	in = binyo_instream_new_bytes((uint8_t *) RSTRING_PTR(der), RSTRING_LEN(der));
+	result = int_asn1_to_ruby_stream(in, data->decode_flags, &ret);
+	binyo_instream_free(in);
+	RB_GC_GUARD(der);
+    }
+    if (result != KRYPT_OK)
+	krypt_error_raise(eKryptASN1Error, "Error while converting value");
+    return ret;
+}
+
+/**
+ * call-seq:
+ *    ASN1.register_codec(tag, tag_class, codec) -> codec
+ *
+ * * +tag+: the tag number the codec is responsible for
+ * * +tag_class+: a +Symbol+ representing the tag class, e.g. +:APPLICATION+
+ * * +codec+: an object implementing +decode(bytes)+, returning the Ruby
+ *   value for the raw content octets, and +encode(value)+, returning the
+ *   content octets as a +String+. It may also implement +validate(value)+,
+ *   values are rejected when it returns false.
+ *
+ * Registers a codec for primitive values with the given tag and tag class.
+ * Decoded ASN1Data with a matching header use the codec for ASN1Data#value
+ * and for encoding. Registering a UNIVERSAL tag replaces the built-in codec
+ * for that type, also for template fields of that type. C extensions may
+ * register native codecs with +krypt_asn1_codec_register+ instead.
+ */
+static VALUE
+krypt_asn1_register_codec(VALUE self, VALUE vtag, VALUE vtag_class, VALUE codec)
+{
+    int tag_class;
+
+    int_validate_tag_and_class(vtag, vtag_class);
+    if ((tag_class = krypt_asn1_tag_class_for_id(SYM2ID(vtag_class))) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Cannot register codec");
+    if (krypt_asn1_codec_register_handler(tag_class, NUM2INT(vtag), codec) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Cannot register codec");
+    return codec;
+}
+
 /**
  * Returns an ID representing the Symbol that stands for the corresponding
  * tag class.
@@ -1680,9 +2191,18 @@ Init_krypt_asn1(void)
     sKrypt_IV_TAG_CLASS = rb_intern("@tag_class");
     sKrypt_IV_INF_LEN = rb_intern("@infinite_length");
     sKrypt_IV_UNUSED_BITS = rb_intern("@unused_bits");
+    sKrypt_IV_FRACTIONAL_SECONDS = rb_intern("@fractional_seconds");
 
     sKrypt_IV_VALUE = rb_intern("@value");
 
+    sKrypt_ID_RAW_INTEGERS = rb_intern("raw_integers");
+    sKrypt_ID_EPOCH_TIMES = rb_intern("epoch_times");
+    sKrypt_ID_STRICT = rb_intern("strict");
+    sKrypt_ID_INTERN_STRINGS = rb_intern("intern_strings");
+    sKrypt_ID_LAZY_COLLECTIONS = rb_intern("lazy_collections");
+    sKrypt_ID_CACHE_ELEMENTS = rb_intern("cache_elements");
+    sKrypt_ID_PLAIN_ELEMENTS = rb_intern("plain_elements");
+
     /*
      * Document-module: Krypt::ASN1
      *
@@ -1852,9 +2372,11 @@ Init_krypt_asn1(void)
 	rb_ary_store(ary, i, rb_str_new2(krypt_asn1_infos[i].name));
     }
 
-    rb_define_module_function(mKryptASN1, "decode", krypt_asn1_decode, 1);
-    rb_define_module_function(mKryptASN1, "decode_der", krypt_asn1_decode_der, 1);
-    rb_define_module_function(mKryptASN1, "decode_pem", krypt_asn1_decode_pem, 1);
+    rb_define_module_function(mKryptASN1, "decode", krypt_asn1_decode, -1);
+    rb_define_module_function(mKryptASN1, "decode_der", krypt_asn1_decode_der, -1);
+    rb_define_module_function(mKryptASN1, "decode_pem", krypt_asn1_decode_pem, -1);
+    rb_define_module_function(mKryptASN1, "decode_to_ruby", krypt_asn1_decode_to_ruby, -1);
+    rb_define_module_function(mKryptASN1, "register_codec", krypt_asn1_register_codec, 3);
 
     /* Document-class: Krypt::ASN1::ASN1Data
      *
@@ -1950,6 +2472,7 @@ Init_krypt_asn1(void)
     rb_define_method(cKryptASN1Data, "value", krypt_asn1_data_get_value, 0);
     rb_define_method(cKryptASN1Data, "value=", krypt_asn1_data_set_value, 1);
     rb_define_method(cKryptASN1Data, "to_der", krypt_asn1_data_to_der, 0);
+    rb_define_method(cKryptASN1Data, "to_ruby", krypt_asn1_data_to_ruby, 0);
     rb_define_method(cKryptASN1Data, "encode_to", krypt_asn1_data_encode_to, 1);
     rb_define_method(cKryptASN1Data, "<=>", krypt_asn1_data_cmp, 1);
 
@@ -1981,8 +2504,8 @@ Init_krypt_asn1(void)
      * * Krypt::ASN1::GraphicString   <=> +value+ is a +String+
      * * Krypt::ASN1::ISO64String     <=> +value+ is a +String+
      * * Krypt::ASN1::GeneralString   <=> +value+ is a +String+
-     * * Krypt::ASN1::UniversalString <=> +value+ is a +String+
-     * * Krypt::ASN1::BMPString       <=> +value+ is a +String+
+     * * Krypt::ASN1::UniversalString <=> +value+ is a +String+ (decoded to UTF-8)
+     * * Krypt::ASN1::BMPString       <=> +value+ is a +String+ (decoded to UTF-8)
      *
      * == Krypt::ASN1::BitString
      *
@@ -1992,6 +2515,13 @@ Init_krypt_asn1(void)
      * +unused_bits+ indicates the number of bits that are to be ignored in
      * the final octet of the +BitString+'s +value+.
      *
+     * == Krypt::ASN1::GeneralizedTime
+     *
+     * === Additional attribute
+     * +fractional_seconds+: if true, the sub-second part of a +Time+ value
+     * is encoded as well. Defaults to false, i.e. the value is truncated to
+     * whole seconds.
+     *
      * == Examples
      * With the Exception of Krypt::ASN1::EndOfContents and Krypt::ASN1::Null,
      * each Primitive class constructor takes at least one parameter, the
@@ -2100,7 +2630,15 @@ Init_krypt_asn1(void)
 
     rb_define_method(cKryptASN1BitString, "unused_bits", krypt_asn1_bit_string_get_unused_bits, 0);
     rb_define_method(cKryptASN1BitString, "unused_bits=", krypt_asn1_bit_string_set_unused_bits, 1);
+    rb_define_method(cKryptASN1BitString, "decode_contents", krypt_asn1_data_decode_contents, -1);
+    rb_define_method(cKryptASN1OctetString, "decode_contents", krypt_asn1_data_decode_contents, -1);
+    rb_define_method(cKryptASN1GeneralizedTime, "fractional_seconds", krypt_asn1_generalized_time_get_fractional_seconds, 0);
+    rb_define_method(cKryptASN1GeneralizedTime, "fractional_seconds=", krypt_asn1_generalized_time_set_fractional_seconds, 1);
+    rb_define_singleton_method(cKryptASN1ObjectId, "from_arcs", krypt_asn1_object_id_from_arcs, 1);
+    rb_define_method(cKryptASN1ObjectId, "arcs", krypt_asn1_object_id_get_arcs, 0);
    
+    Init_krypt_asn1_codec();
+    Init_krypt_asn1_raw_integer();
     Init_krypt_asn1_parser();
     Init_krypt_asn1_template();
     Init_krypt_instream_adapter();
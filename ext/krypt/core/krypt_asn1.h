@@ -56,6 +56,8 @@ extern VALUE cKryptASN1UTCTime, cKryptASN1GeneralizedTime;     		/* TIME
 /* CONSTRUCTIVE */
 extern VALUE cKryptASN1Sequence, cKryptASN1Set;
 
+extern VALUE cKryptASN1RawInteger;
+
 extern VALUE eKryptASN1Error;
 extern VALUE eKryptASN1ParseError;
 extern VALUE eKryptASN1SerializeError;
@@ -72,6 +74,7 @@ extern ID sKrypt_TC_EXPLICIT;
 extern ID sKrypt_TC_IMPLICIT;
 
 extern ID sKrypt_IV_TAG, sKrypt_IV_TAG_CLASS, sKrypt_IV_INF_LEN, sKrypt_IV_VALUE, sKrypt_IV_UNUSED_BITS;
+extern ID sKrypt_IV_FRACTIONAL_SECONDS;
 
 void Init_krypt_asn1(void);
 void Init_krypt_asn1_parser(void);
@@ -79,7 +82,25 @@ void Init_krypt_instream_adapter(void);
 void Init_krypt_pem(void);
 
 size_t krypt_asn1_encode_integer(long num, uint8_t **out);
+/* Flags that influence how primitive values are decoded */
+#define KRYPT_ASN1_DECODE_RAW_INTEGER	(1 << 0)
+#define KRYPT_ASN1_DECODE_EPOCH_TIME	(1 << 1)
+#define KRYPT_ASN1_DECODE_STRICT	(1 << 2)
+#define KRYPT_ASN1_DECODE_INTERN	(1 << 3)
+/* Flags that only apply to templates */
+#define KRYPT_ASN1_DECODE_LAZY		(1 << 4)
+#define KRYPT_ASN1_DECODE_NO_CACHE	(1 << 5)
+#define KRYPT_ASN1_DECODE_PLAIN		(1 << 6)
+
+/* String values up to this length are interned with KRYPT_ASN1_DECODE_INTERN */
+#define KRYPT_ASN1_INTERN_MAX_LEN	64
+
+int krypt_asn1_decode_flags_for(VALUE opts);
+VALUE krypt_asn1_class_for(int tag, int tag_class, int is_constructed);
+int krypt_asn1_universal_tag_for(VALUE klass);
 int krypt_asn1_decode_stream(binyo_instream *in, VALUE *out);
+int krypt_asn1_decode_stream_flags(binyo_instream *in, int flags, VALUE *out);
+int krypt_asn1_decode_encapsulated(int tag, uint8_t *bytes, size_t len, int flags, VALUE *out);
 
 VALUE krypt_instream_adapter_new(binyo_instream *in);
 
@@ -0,0 +1,445 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+
+/* 
+ * Transcoding between UTF-8 and the UTF-16BE (BMPString) and UTF-32BE
+ * (UniversalString) encodings. Runs of ASCII characters are detected and
+ * copied a machine word at a time, everything else is handled one code
+ * point at a time. Output buffers are sized for the worst case up front,
+ * so each conversion is a single pass without reallocations.
+ */
+
+static const uint8_t krypt_ascii_mask[8] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 };
+static const uint8_t krypt_ucs2_ascii_mask[8] = { 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80 };
+static const uint8_t krypt_ucs4_ascii_mask[8] = { 0xff, 0xff, 0xff, 0x80, 0xff, 0xff, 0xff, 0x80 };
+
+static uint64_t
+int_load_word(const uint8_t *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(uint64_t));
+    return w;
+}
+
+#define int_is_surrogate(cp)	((cp) >= 0xd800 && (cp) <= 0xdfff)
+
+static uint8_t *
+int_utf8_put(uint8_t *p, unsigned long cp)
+{
+    if (cp < 0x80) {
+	*p++ = (uint8_t) cp;
+    } else if (cp < 0x800) {
+	*p++ = 0xc0 | (uint8_t) (cp >> 6);
+	*p++ = 0x80 | (uint8_t) (cp & 0x3f);
+    } else if (cp < 0x10000) {
+	*p++ = 0xe0 | (uint8_t) (cp >> 12);
+	*p++ = 0x80 | (uint8_t) ((cp >> 6) & 0x3f);
+	*p++ = 0x80 | (uint8_t) (cp & 0x3f);
+    } else {
+	*p++ = 0xf0 | (uint8_t) (cp >> 18);
+	*p++ = 0x80 | (uint8_t) ((cp >> 12) & 0x3f);
+	*p++ = 0x80 | (uint8_t) ((cp >> 6) & 0x3f);
+	*p++ = 0x80 | (uint8_t) (cp & 0x3f);
+    }
+    return p;
+}
+
+/* Returns the number of bytes consumed or 0 if the sequence at +p+ is not
+ * well-formed UTF-8 (overlong forms, surrogates and values beyond
+ * U+10FFFF are rejected) */
+static size_t
+int_utf8_get(const uint8_t *p, const uint8_t *end, unsigned long *cp)
+{
+    uint8_t b = *p;
+    unsigned long c;
+    size_t n, i;
+
+    if (b < 0x80) {
+	*cp = b;
+	return 1;
+    }
+    if (b < 0xc2) return 0;
+    if (b < 0xe0) {
+	n = 2;
+	c = b & 0x1f;
+    } else if (b < 0xf0) {
+	n = 3;
+	c = b & 0x0f;
+    } else if (b < 0xf5) {
+	n = 4;
+	c = b & 0x07;
+    } else {
+	return 0;
+    }
+    if ((size_t) (end - p) < n) return 0;
+    for (i = 1; i < n; i++) {
+	if ((p[i] & 0xc0) != 0x80) return 0;
+	c = (c << 6) | (p[i] & 0x3f);
+    }
+    if ((n == 3 && c < 0x800) ||
+	(n == 4 && (c < 0x10000 || c > 0x10ffff)) ||
+	int_is_surrogate(c))
+	return 0;
+    *cp = c;
+    return n;
+}
+
+static VALUE
+int_utf8_str_finish(VALUE str, uint8_t *start, uint8_t *p)
+{
+    rb_str_set_len(str, p - start);
+    rb_enc_associate(str, rb_utf8_encoding());
+    return str;
+}
+
+/**
+ * Decodes UTF-16BE content octets (BMPString) into a UTF-8 +String+.
+ * Surrogate pairs are accepted, unpaired surrogates are not.
+ */
+int
+krypt_asn1_utf16be_to_utf8(uint8_t *bytes, size_t len, VALUE *out)
+{
+    VALUE str;
+    uint8_t *cur = bytes, *end = bytes + len, *start, *p;
+    uint64_t mask = int_load_word(krypt_ucs2_ascii_mask);
+    unsigned long cp, low;
+
+    if (len % 2) {
+	krypt_error_add("Length of UTF-16 value must be a multiple of 2: %ld", len);
+	return KRYPT_ERR;
+    }
+
+    /* at most 3 UTF-8 bytes per 2 input bytes */
+    str = rb_str_new(NULL, len / 2 * 3);
+    start = p = (uint8_t *) RSTRING_PTR(str);
+
+    while (cur < end) {
+	while (end - cur >= 8 && (int_load_word(cur) & mask) == 0) {
+	    p[0] = cur[1];
+	    p[1] = cur[3];
+	    p[2] = cur[5];
+	    p[3] = cur[7];
+	    p += 4;
+	    cur += 8;
+	}
+	if (cur == end) break;
+
+	cp = (cur[0] << 8) | cur[1];
+	cur += 2;
+	if (int_is_surrogate(cp)) {
+	    if (cp > 0xdbff || end - cur < 2) goto invalid;
+	    low = (cur[0] << 8) | cur[1];
+	    if (low < 0xdc00 || low > 0xdfff) goto invalid;
+	    cur += 2;
+	    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+	}
+	p = int_utf8_put(p, cp);
+    }
+
+    *out = int_utf8_str_finish(str, start, p);
+    return KRYPT_OK;
+
+invalid:
+    krypt_error_add("Invalid surrogate in UTF-16 value at offset %ld", (cur - bytes) - 2);
+    return KRYPT_ERR;
+}
+
+/**
+ * Decodes UTF-32BE content octets (UniversalString) into a UTF-8 +String+.
+ */
+int
+krypt_asn1_utf32be_to_utf8(uint8_t *bytes, size_t len, VALUE *out)
+{
+    VALUE str;
+    uint8_t *cur = bytes, *end = bytes + len, *start, *p;
+    uint64_t mask = int_load_word(krypt_ucs4_ascii_mask);
+    unsigned long cp;
+
+    if (len % 4) {
+	krypt_error_add("Length of UTF-32 value must be a multiple of 4: %ld", len);
+	return KRYPT_ERR;
+    }
+
+    /* at most 4 UTF-8 bytes per 4 input bytes */
+    str = rb_str_new(NULL, len);
+    start = p = (uint8_t *) RSTRING_PTR(str);
+
+    while (cur < end) {
+	while (end - cur >= 8 && (int_load_word(cur) & mask) == 0) {
+	    p[0] = cur[3];
+	    p[1] = cur[7];
+	    p += 2;
+	    cur += 8;
+	}
+	if (cur == end) break;
+
+	cp = ((unsigned long) cur[0] << 24) | (cur[1] << 16) | (cur[2] << 8) | cur[3];
+	if (cp > 0x10ffff || int_is_surrogate(cp)) {
+	    krypt_error_add("Invalid code point in UTF-32 value: 0x%lx", cp);
+	    return KRYPT_ERR;
+	}
+	cur += 4;
+	p = int_utf8_put(p, cp);
+    }
+
+    *out = int_utf8_str_finish(str, start, p);
+    return KRYPT_OK;
+}
+
+static int
+int_utf8_error(uint8_t *bytes, uint8_t *cur)
+{
+    krypt_error_add("Invalid UTF-8 sequence at offset %ld", cur - bytes);
+    return KRYPT_ERR;
+}
+
+/**
+ * Encodes UTF-8 bytes as UTF-16BE, code points beyond the BMP are written
+ * as surrogate pairs. The caller must free +*out+.
+ */
+int
+krypt_asn1_utf8_to_utf16be(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen)
+{
+    uint8_t *cur = bytes, *end = bytes + len, *ret, *p;
+    uint64_t mask = int_load_word(krypt_ascii_mask);
+    unsigned long cp;
+    size_t n;
+
+    if (len > SIZE_MAX / 2) {
+	krypt_error_add("String too long");
+	return KRYPT_ERR;
+    }
+    /* at most 2 output bytes per input byte */
+    ret = p = ALLOC_N(uint8_t, len * 2);
+
+    while (cur < end) {
+	while (end - cur >= 8 && (int_load_word(cur) & mask) == 0) {
+	    int i;
+	    for (i = 0; i < 8; i++) {
+		p[2 * i] = 0;
+		p[2 * i + 1] = cur[i];
+	    }
+	    p += 16;
+	    cur += 8;
+	}
+	if (cur == end) break;
+
+	if (!(n = int_utf8_get(cur, end, &cp))) {
+	    xfree(ret);
+	    return int_utf8_error(bytes, cur);
+	}
+	cur += n;
+	if (cp >= 0x10000) {
+	    unsigned long high, low;
+	    cp -= 0x10000;
+	    high = 0xd800 | (cp >> 10);
+	    low = 0xdc00 | (cp & 0x3ff);
+	    *p++ = (uint8_t) (high >> 8);
+	    *p++ = (uint8_t) (high & 0xff);
+	    *p++ = (uint8_t) (low >> 8);
+	    *p++ = (uint8_t) (low & 0xff);
+	} else {
+	    *p++ = (uint8_t) (cp >> 8);
+	    *p++ = (uint8_t) (cp & 0xff);
+	}
+    }
+
+    *out = ret;
+    *outlen = p - ret;
+    return KRYPT_OK;
+}
+
+/**
+ * Encodes UTF-8 bytes as UTF-32BE. The caller must free +*out+.
+ */
+int
+krypt_asn1_utf8_to_utf32be(uint8_t *bytes, size_t len, uint8_t **out, size_t *outlen)
+{
+    uint8_t *cur = bytes, *end = bytes + len, *ret, *p;
+    uint64_t mask = int_load_word(krypt_ascii_mask);
+    unsigned long cp;
+    size_t n;
+
+    if (len > SIZE_MAX / 4) {
+	krypt_error_add("String too long");
+	return KRYPT_ERR;
+    }
+    /* at most 4 output bytes per input byte */
+    ret = p = ALLOC_N(uint8_t, len * 4);
+
+    while (cur < end) {
+	while (end - cur >= 8 && (int_load_word(cur) & mask) == 0) {
+	    int i;
+	    memset(p, 0, 32);
+	    for (i = 0; i < 8; i++)
+		p[4 * i + 3] = cur[i];
+	    p += 32;
+	    cur += 8;
+	}
+	if (cur == end) break;
+
+	if (!(n = int_utf8_get(cur, end, &cp))) {
+	    xfree(ret);
+	    return int_utf8_error(bytes, cur);
+	}
+	cur += n;
+	*p++ = 0;
+	*p++ = (uint8_t) (cp >> 16);
+	*p++ = (uint8_t) ((cp >> 8) & 0xff);
+	*p++ = (uint8_t) (cp & 0xff);
+    }
+
+    *out = ret;
+    *outlen = p - ret;
+    return KRYPT_OK;
+}
+
+/* 
+ * Character set checks for the restricted string types. Whole words are
+ * tested against the permitted range first, only words containing a byte
+ * outside of it are examined byte by byte.
+ */
+
+#define KRYPT_ONES		0x0101010101010101ULL
+#define KRYPT_HIGHS		0x8080808080808080ULL
+/* true if any byte of x is < n, n <= 128 */
+#define int_word_has_less(x, n)	(((x) - KRYPT_ONES * (n)) & ~(x) & KRYPT_HIGHS)
+/* true if any byte of x is > n, n <= 127 */
+#define int_word_has_more(x, n)	((((x) + KRYPT_ONES * (127 - (n))) | (x)) & KRYPT_HIGHS)
+
+static int
+int_is_printable(uint8_t b)
+{
+    if ((b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || (b >= '0' && b <= '9'))
+	return 1;
+    switch (b) {
+	case ' ': case '\'': case '(': case ')': case '+': case ',':
+	case '-': case '.': case '/': case ':': case '=': case '?':
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+static int
+int_is_in_charset(int tag, uint8_t b)
+{
+    switch (tag) {
+	case TAGS_NUMERIC_STRING:
+	    return (b >= '0' && b <= '9') || b == ' ';
+	case TAGS_PRINTABLE_STRING:
+	    return int_is_printable(b);
+	case TAGS_IA5_STRING:
+	    return b < 0x80;
+	case TAGS_ISO64_STRING:
+	    return b >= 0x20 && b <= 0x7e;
+	default:
+	    return 0;
+    }
+}
+
+/* Whether all bytes of the word are certainly valid for the given type.
+ * PrintableString has no contiguous range, it is always checked bytewise. */
+static int
+int_word_in_charset(int tag, uint64_t w)
+{
+    switch (tag) {
+	case TAGS_NUMERIC_STRING:
+	    return !(int_word_has_less(w, '0') || int_word_has_more(w, '9'));
+	case TAGS_IA5_STRING:
+	    return !(w & KRYPT_HIGHS);
+	case TAGS_ISO64_STRING:
+	    return !(int_word_has_less(w, 0x20) || int_word_has_more(w, 0x7e));
+	default:
+	    return 0;
+    }
+}
+
+static const char *
+int_charset_name(int tag)
+{
+    switch (tag) {
+	case TAGS_NUMERIC_STRING: return "NUMERIC STRING";
+	case TAGS_PRINTABLE_STRING: return "PRINTABLE STRING";
+	case TAGS_IA5_STRING: return "IA5 STRING";
+	case TAGS_ISO64_STRING: return "ISO64 STRING";
+	default: return "STRING";
+    }
+}
+
+/**
+ * Checks that +bytes+ only contain characters permitted for the
+ * restricted string type identified by the universal +tag+, one of
+ * NumericString, PrintableString, IA5String and ISO64String (VisibleString).
+ *
+ * @return KRYPT_OK if all characters are valid, KRYPT_ERR otherwise
+ */
+int
+krypt_asn1_check_charset(int tag, uint8_t *bytes, size_t len)
+{
+    uint8_t *cur = bytes, *end = bytes + len, *word_end;
+
+    while (cur < end) {
+	while (end - cur >= 8 && int_word_in_charset(tag, int_load_word(cur)))
+	    cur += 8;
+	word_end = end - cur >= 8 ? cur + 8 : end;
+	for (; cur < word_end; cur++) {
+	    if (!int_is_in_charset(tag, *cur)) {
+		krypt_error_add("Invalid character 0x%02x at offset %ld in %s", *cur, cur - bytes, int_charset_name(tag));
+		return KRYPT_ERR;
+	    }
+	}
+    }
+    return KRYPT_OK;
+}
+
+/**
+ * Checks that +bytes+ are well-formed UTF-8 as defined by RFC 3629.
+ *
+ * @return KRYPT_OK if the bytes are valid UTF-8, KRYPT_ERR otherwise
+ */
+int
+krypt_asn1_check_utf8(uint8_t *bytes, size_t len)
+{
+    uint8_t *cur = bytes, *end = bytes + len;
+    unsigned long cp;
+    size_t n;
+
+    while (cur < end) {
+	while (end - cur >= 8 && !(int_load_word(cur) & KRYPT_HIGHS))
+	    cur += 8;
+	if (cur == end) break;
+	if (!(n = int_utf8_get(cur, end, &cp)))
+	    return int_utf8_error(bytes, cur);
+	cur += n;
+    }
+    return KRYPT_OK;
+}
@@ -53,13 +53,27 @@ int_asn1_encode_default(VALUE self, VALUE value, uint8_t **out, size_t *len)
     return KRYPT_OK;
 }
 
+static VALUE
+int_str_new(uint8_t *bytes, size_t len, int flags, rb_encoding *enc)
+{
+    VALUE str;
+
+    if (len == 0 || bytes == NULL) {
+	bytes = (uint8_t *) "";
+	len = 0;
+    }
+    if ((flags & KRYPT_ASN1_DECODE_INTERN) && len <= KRYPT_ASN1_INTERN_MAX_LEN)
+	return rb_enc_interned_str((const char *) bytes, len, enc);
+    str = rb_str_new((const char *) bytes, len);
+    if (enc != rb_ascii8bit_encoding())
+	rb_enc_associate(str, enc);
+    return str;
+}
+
 static int
-int_asn1_decode_default(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_default(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
-    if (len == 0 || bytes == NULL)
-	*out = rb_str_new2("");
-    else
-       	*out = rb_str_new((const char *)bytes, len);
+    *out = int_str_new(bytes, len, flags, rb_ascii8bit_encoding());
     return KRYPT_OK;
 }
 
@@ -81,11 +95,11 @@ static const size_t MAX_LONG_DIGITS = sizeof(long) * 2 * 1.21f + 1; /* times 2 -
 
 static int int_encode_object_id(uint8_t*, size_t, uint8_t **, size_t *);
 static int int_decode_object_id(uint8_t*, size_t, VALUE *);
-static int int_parse_utc_time(uint8_t *, size_t, VALUE *);
-static int int_parse_generalized_time(uint8_t *, size_t, VALUE *);
+static int int_parse_utc_time(uint8_t *, size_t, int, VALUE *);
+static int int_parse_generalized_time(uint8_t *, size_t, int, VALUE *);
 static int int_encode_utc_time(VALUE, uint8_t **, size_t *);
-static int int_encode_generalized_time(VALUE, uint8_t **, size_t *);
-static int int_decode_integer(uint8_t *, size_t, VALUE *);
+static int int_encode_generalized_time(VALUE, int, uint8_t **, size_t *);
+static long int_decode_integer_to_long(uint8_t *, size_t);
 
 #define sanity_check(b)		if (!b) return KRYPT_ERR;
 
@@ -98,7 +112,7 @@ int_asn1_encode_eoc(VALUE self, VALUE value, uint8_t **out, size_t *len)
 }
 
 static int
-int_asn1_decode_eoc(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_eoc(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
     if (len != 0) {
 	krypt_error_add("Invalid encoding for END OF CONTENTS found - must be empty");
@@ -131,7 +145,7 @@ int_asn1_encode_boolean(VALUE self, VALUE value, uint8_t **out, size_t *len)
 }
 
 static int
-int_asn1_decode_boolean(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_boolean(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
     uint8_t b;
 
@@ -163,6 +177,16 @@ int_asn1_encode_integer(VALUE self, VALUE value, uint8_t **out, size_t *len)
 {
     long num;
     
+    if (krypt_asn1_is_raw_integer(value)) {
+	uint8_t *bytes;
+	size_t l;
+
+	krypt_asn1_raw_integer_get_der(value, &bytes, &l);
+	*out = ALLOC_N(uint8_t, l);
+	memcpy(*out, bytes, l);
+	*len = l;
+	return KRYPT_OK;
+    }
     if (TYPE(value) == T_BIGNUM) {
 	if (krypt_asn1_encode_bignum(value, out, len) == KRYPT_ERR) {
 	    krypt_error_add("Error while encoding Bignum INTEGER");
@@ -177,7 +201,7 @@ int_asn1_encode_integer(VALUE self, VALUE value, uint8_t **out, size_t *len)
 }
 
 static int
-int_asn1_decode_integer(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_integer(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
     if (len == 0) {
 	krypt_error_add("Invalid zero length value for INTEGER found");
@@ -185,20 +209,20 @@ int_asn1_decode_integer(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
     }
     sanity_check(bytes);
 
-    /* Even if in the range of long, high numbers may already have to
-     * be represented as Bignums in Ruby. To be safe, call the Bignum
-     * decoder for all of these cases. */
-    if ((bytes[0] == 0x0 && len > sizeof(long)) ||
-	(bytes[0] != 0x0 && len >= sizeof(long))) {
-	if (krypt_asn1_decode_bignum(bytes, len, out) == KRYPT_ERR) {
-	   krypt_error_add("Error while decoding Bignum INTEGER");
-	   return KRYPT_ERR;
-	}
+    if (flags & KRYPT_ASN1_DECODE_RAW_INTEGER) {
+	*out = krypt_asn1_raw_integer_new(bytes, len);
+	return KRYPT_OK;
+    }
+
+    /* Anything that fits into a long is decoded inline, LONG2NUM takes
+     * care of values that still need to be represented as Bignums. */
+    if (len <= SIZEOF_LONG) {
+	*out = LONG2NUM(int_decode_integer_to_long(bytes, len));
 	return KRYPT_OK;
     }
 
-    if (int_decode_integer(bytes, len, out) == KRYPT_ERR) {
-	krypt_error_add("Error while decoding INTEGER");
+    if (krypt_asn1_decode_bignum(bytes, len, out) == KRYPT_ERR) {
+	krypt_error_add("Error while decoding Bignum INTEGER");
 	return KRYPT_ERR;
     }
     return KRYPT_OK;
@@ -207,7 +231,7 @@ int_asn1_decode_integer(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
 static int
 int_asn1_validate_integer(VALUE self, VALUE value)
 {
-    if (!(FIXNUM_P(value) || rb_obj_is_kind_of(value, rb_cBignum))) {
+    if (!(FIXNUM_P(value) || TYPE(value) == T_BIGNUM || krypt_asn1_is_raw_integer(value))) {
 	krypt_error_add("Value for INTEGER must be an integer number");
 	return KRYPT_ERR;
     }
@@ -216,14 +240,22 @@ int_asn1_validate_integer(VALUE self, VALUE value)
 
 #define int_check_unused_bits(b)	if ((b) < 0 || (b) > 7)	return KRYPT_ERR;
 
-static int
-int_asn1_encode_bit_string(VALUE self, VALUE value, uint8_t **out, size_t *len)
+/**
+ * Encodes the BIT STRING +value+ with +unused_bits+ for callers that
+ * keep the unused bits themselves instead of in an ASN1Data.
+ *
+ * @param unused_bits	The number of unused bits, 0 to 7
+ * @param value		The String value
+ * @param out		The encoded bytes
+ * @param len		The number of encoded bytes
+ * @return		KRYPT_OK or KRYPT_ERR
+ */
+int
+krypt_asn1_encode_bit_string(int unused_bits, VALUE value, uint8_t **out, size_t *len)
 {
-    int unused_bits;
     size_t l;
     uint8_t *bytes;
 
-    unused_bits = NUM2INT(rb_ivar_get(self, sKrypt_IV_UNUSED_BITS));
     int_check_unused_bits(unused_bits);
 
     StringValue(value);
@@ -240,18 +272,43 @@ int_asn1_encode_bit_string(VALUE self, VALUE value, uint8_t **out, size_t *len)
     return KRYPT_OK;
 }
 
-static int
-int_asn1_decode_bit_string(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+/**
+ * Decodes the BIT STRING +bytes+, the counterpart of
+ * krypt_asn1_encode_bit_string.
+ *
+ * @param bytes		The encoded value
+ * @param len		The length of +bytes+
+ * @param flags		The decode flags
+ * @param unused_bits	Receives the number of unused bits
+ * @param out		The decoded String
+ * @return		KRYPT_OK or KRYPT_ERR
+ */
+int
+krypt_asn1_decode_bit_string(uint8_t *bytes, size_t len, int flags, int *unused_bits, VALUE *out)
 {
-    int unused_bits;
-
     sanity_check(bytes);
-    unused_bits = bytes[0];
-    int_check_unused_bits(unused_bits);
-    if (int_asn1_decode_default(self, bytes + 1, len - 1, out) == KRYPT_ERR) {
+    int_check_unused_bits(bytes[0]);
+    if (int_asn1_decode_default(Qnil, bytes + 1, len - 1, flags, out) == KRYPT_ERR) {
 	krypt_error_add("Error while decoding BIT STRING");
 	return KRYPT_ERR;
     }
+    *unused_bits = bytes[0];
+    return KRYPT_OK;
+}
+
+static int
+int_asn1_encode_bit_string(VALUE self, VALUE value, uint8_t **out, size_t *len)
+{
+    return krypt_asn1_encode_bit_string(NUM2INT(rb_ivar_get(self, sKrypt_IV_UNUSED_BITS)), value, out, len);
+}
+
+static int
+int_asn1_decode_bit_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    int unused_bits;
+
+    if (krypt_asn1_decode_bit_string(bytes, len, flags, &unused_bits, out) == KRYPT_ERR)
+	return KRYPT_ERR;
     rb_ivar_set(self, sKrypt_IV_UNUSED_BITS, INT2NUM(unused_bits));
     return KRYPT_OK;
 }
@@ -275,7 +332,7 @@ int_asn1_encode_null(VALUE self, VALUE value, uint8_t **out, size_t *len)
 }
 
 static int
-int_asn1_decode_null(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_null(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
     if (len != 0) {
 	krypt_error_add("Invalid encoding for NULL value found - must be empty");
@@ -295,22 +352,64 @@ int_asn1_validate_null(VALUE self, VALUE value)
     return KRYPT_OK;
 }
 
+/* Maps dotted OBJECT IDENTIFIER Strings to their encoding. The same few
+ * OIDs tend to be encoded over and over again, so we keep what we have
+ * computed once instead of parsing the String every time. */
+static VALUE krypt_oid_cache;
+static int krypt_utf16be_index, krypt_utf32be_index;
+
+#define KRYPT_OID_CACHE_MAX 1024
+
+static int
+int_oid_cache_get(VALUE value, uint8_t **out, size_t *len)
+{
+    VALUE cached;
+    size_t l;
+    uint8_t *ret;
+
+    cached = rb_hash_lookup(krypt_oid_cache, value);
+    if (NIL_P(cached)) return 0;
+
+    l = RSTRING_LEN(cached);
+    ret = ALLOC_N(uint8_t, l);
+    memcpy(ret, RSTRING_PTR(cached), l);
+    *out = ret;
+    *len = l;
+    return 1;
+}
+
+static void
+int_oid_cache_put(VALUE value, uint8_t *bytes, size_t len)
+{
+    VALUE key, encoded;
+
+    if (RHASH_SIZE(krypt_oid_cache) >= KRYPT_OID_CACHE_MAX)
+	rb_hash_clear(krypt_oid_cache);
+    key = rb_str_new_frozen(value);
+    encoded = rb_str_new((const char *) bytes, len);
+    OBJ_FREEZE(encoded);
+    rb_hash_aset(krypt_oid_cache, key, encoded);
+}
+
 static int
 int_asn1_encode_object_id(VALUE self, VALUE value, uint8_t **out, size_t *len)
 {
     uint8_t *str;
 
     StringValue(value);
+    if (int_oid_cache_get(value, out, len)) return KRYPT_OK;
+
     str = (uint8_t *)RSTRING_PTR(value);
     if (int_encode_object_id(str, RSTRING_LEN(value), out, len) == KRYPT_ERR) {
 	krypt_error_add("Encoding OBJECT IDENTIFIER failed");
 	return KRYPT_ERR;
     }
+    int_oid_cache_put(value, *out, *len);
     return KRYPT_OK;
 }
 
 static int
-int_asn1_decode_object_id(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_object_id(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
     sanity_check(bytes);
     if (int_decode_object_id(bytes, len, out) == KRYPT_ERR) {
@@ -361,14 +460,140 @@ int_asn1_encode_utf8_string(VALUE self, VALUE value, uint8_t **out, size_t *len)
 }
 
 static int
-int_asn1_decode_utf8_string(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_utf8_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
-    if (int_asn1_decode_default(self, bytes, len, out) == KRYPT_ERR) {
+    if ((flags & KRYPT_ASN1_DECODE_STRICT) && krypt_asn1_check_utf8(bytes, len) == KRYPT_ERR) {
 	krypt_error_add("Decoding UTF8 STRING failed");
 	return KRYPT_ERR;
     }
-    /* TODO rb_protect */
-    rb_enc_associate(*out, rb_utf8_encoding());
+    *out = int_str_new(bytes, len, flags, rb_utf8_encoding());
+    return KRYPT_OK;
+}
+
+/* Restricted character set strings are only checked in strict mode */
+static int
+int_decode_restricted_string(int tag, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    if ((flags & KRYPT_ASN1_DECODE_STRICT) && krypt_asn1_check_charset(tag, bytes, len) == KRYPT_ERR)
+	return KRYPT_ERR;
+    return int_asn1_decode_default(Qnil, bytes, len, flags, out);
+}
+
+static int
+int_asn1_decode_numeric_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    return int_decode_restricted_string(TAGS_NUMERIC_STRING, bytes, len, flags, out);
+}
+
+static int
+int_asn1_decode_printable_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    return int_decode_restricted_string(TAGS_PRINTABLE_STRING, bytes, len, flags, out);
+}
+
+static int
+int_asn1_decode_ia5_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    return int_decode_restricted_string(TAGS_IA5_STRING, bytes, len, flags, out);
+}
+
+static int
+int_asn1_decode_iso64_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    return int_decode_restricted_string(TAGS_ISO64_STRING, bytes, len, flags, out);
+}
+
+#define int_intern_decoded(str, flags)						\
+do {										\
+    if (((flags) & KRYPT_ASN1_DECODE_INTERN) && RSTRING_LEN((str)) <= KRYPT_ASN1_INTERN_MAX_LEN)	\
+	(str) = rb_str_to_interned_str((str));					\
+} while (0)
+
+typedef int (*int_utf8_transcoder)(uint8_t *, size_t, uint8_t **, size_t *);
+
+/* Whether the failure caught by rb_protect may be reported as a krypt error.
+ * Anything but a StandardError (Interrupt, throw, break, ...) must propagate */
+static int
+int_is_standard_error(VALUE err)
+{
+    return RB_TYPE_P(err, T_OBJECT) && rb_obj_is_kind_of(err, rb_eStandardError);
+}
+
+static VALUE
+int_str_encode_utf8(VALUE value)
+{
+    return rb_str_encode(value, rb_enc_from_encoding(rb_utf8_encoding()), 0, Qnil);
+}
+
+/* Binary Strings and Strings that already carry the target encoding are
+ * taken as they are, anything else is transcoded from UTF-8 */
+static int
+int_encode_unicode_string(VALUE self, VALUE value, int encindex, int_utf8_transcoder transcode, uint8_t **out, size_t *len)
+{
+    int value_index, state = 0;
+
+    if (NIL_P(value)) {
+	*out = NULL;
+	*len = 0;
+	return KRYPT_OK;
+    }
+
+    StringValue(value);
+    value_index = rb_enc_get_index(value);
+    if (value_index == encindex || value_index == rb_ascii8bit_encindex())
+	return int_asn1_encode_default(self, value, out, len);
+    if (value_index != rb_utf8_encindex() && value_index != rb_usascii_encindex()) {
+	value = rb_protect(int_str_encode_utf8, value, &state);
+	if (state) {
+	    if (!int_is_standard_error(rb_errinfo()))
+		rb_jump_tag(state);
+	    rb_set_errinfo(Qnil);
+	    krypt_error_add("String cannot be converted to UTF-8");
+	    return KRYPT_ERR;
+	}
+    }
+    return transcode((uint8_t *) RSTRING_PTR(value), RSTRING_LEN(value), out, len);
+}
+
+static int
+int_asn1_encode_universal_string(VALUE self, VALUE value, uint8_t **out, size_t *len)
+{
+    if (int_encode_unicode_string(self, value, krypt_utf32be_index, krypt_asn1_utf8_to_utf32be, out, len) == KRYPT_ERR) {
+	krypt_error_add("Encoding UNIVERSAL STRING failed");
+	return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_asn1_decode_universal_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    if (krypt_asn1_utf32be_to_utf8(bytes, len, out) == KRYPT_ERR) {
+	krypt_error_add("Decoding UNIVERSAL STRING failed");
+	return KRYPT_ERR;
+    }
+    int_intern_decoded(*out, flags);
+    return KRYPT_OK;
+}
+
+static int
+int_asn1_encode_bmp_string(VALUE self, VALUE value, uint8_t **out, size_t *len)
+{
+    if (int_encode_unicode_string(self, value, krypt_utf16be_index, krypt_asn1_utf8_to_utf16be, out, len) == KRYPT_ERR) {
+	krypt_error_add("Encoding BMP STRING failed");
+	return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_asn1_decode_bmp_string(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    if (krypt_asn1_utf16be_to_utf8(bytes, len, out) == KRYPT_ERR) {
+	krypt_error_add("Decoding BMP STRING failed");
+	return KRYPT_ERR;
+    }
+    int_intern_decoded(*out, flags);
     return KRYPT_OK;
 }
 
@@ -383,10 +608,10 @@ int_asn1_encode_utc_time(VALUE self, VALUE value, uint8_t **out, size_t *len)
 }
 
 static int
-int_asn1_decode_utc_time(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_utc_time(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
     sanity_check(bytes);
-    if (int_parse_utc_time(bytes, len, out) == KRYPT_ERR) {
+    if (int_parse_utc_time(bytes, len, flags, out) == KRYPT_ERR) {
 	krypt_error_add("Decoding UTC TIME failed");
 	return KRYPT_ERR;
     }
@@ -414,7 +639,9 @@ int_asn1_validate_time(VALUE self, VALUE value)
 static int
 int_asn1_encode_generalized_time(VALUE self, VALUE value, uint8_t **out, size_t *len)
 {
-    if (int_encode_generalized_time(value, out, len) == KRYPT_ERR) {
+    int fractional = RTEST(rb_attr_get(self, sKrypt_IV_FRACTIONAL_SECONDS));
+
+    if (int_encode_generalized_time(value, fractional, out, len) == KRYPT_ERR) {
 	krypt_error_add("Encoding GENERALIZED TIME failed");
 	return KRYPT_ERR;
     }
@@ -422,10 +649,10 @@ int_asn1_encode_generalized_time(VALUE self, VALUE value, uint8_t **out, size_t
 }
 
 static int
-int_asn1_decode_generalized_time(VALUE self, uint8_t *bytes, size_t len, VALUE *out)
+int_asn1_decode_generalized_time(VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
 {
     sanity_check(bytes);
-    if (int_parse_generalized_time(bytes, len, out) == KRYPT_ERR) {
+    if (int_parse_generalized_time(bytes, len, flags, out) == KRYPT_ERR) {
 	krypt_error_add("Decoding GENERALIZED TIME failed");
 	return KRYPT_ERR;
     }
@@ -453,19 +680,19 @@ krypt_asn1_codec krypt_asn1_codecs[] = {
     { int_asn1_encode_default,		int_asn1_decode_default   	, int_asn1_validate_default 	},
     { int_asn1_encode_default,		int_asn1_decode_default   	, int_asn1_validate_default 	},
     { int_asn1_encode_default,		int_asn1_decode_default   	, int_asn1_validate_default 	},
-    { int_asn1_encode_default,		int_asn1_decode_default   	, int_asn1_validate_default 	},
-    { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default	},
+    { int_asn1_encode_default,		int_asn1_decode_numeric_string  , int_asn1_validate_default 	},
+    { int_asn1_encode_default,		int_asn1_decode_printable_string, int_asn1_validate_default 	},
     { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default  	},
     { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default	},
-    { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default 	},
+    { int_asn1_encode_default,		int_asn1_decode_ia5_string      , int_asn1_validate_default 	},
     { int_asn1_encode_utc_time,		int_asn1_decode_utc_time        , int_asn1_validate_time 	},
     { int_asn1_encode_generalized_time,	int_asn1_decode_generalized_time, int_asn1_validate_time 	},
     { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default 	},
-    { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default 	},
+    { int_asn1_encode_default,		int_asn1_decode_iso64_string    , int_asn1_validate_default 	},
     { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default	},
+    { int_asn1_encode_universal_string,	int_asn1_decode_universal_string, int_asn1_validate_default	},
     { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default 	},
-    { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default 	},
-    { int_asn1_encode_default,		int_asn1_decode_default    	, int_asn1_validate_default 	},
+    { int_asn1_encode_bmp_string,	int_asn1_decode_bmp_string      , int_asn1_validate_default 	},
 };
 
 #define int_check_offset(off)					\
@@ -523,9 +750,9 @@ do {							\
 static int
 int_write_long(binyo_byte_buffer *buf, long cur)
 {
-    int num_shifts, i, ret;
+    int num_shifts, i;
     uint8_t b;
-    uint8_t *bytes;
+    uint8_t bytes[(sizeof(long) * CHAR_BIT + CHAR_BIT_MINUS_ONE - 1) / CHAR_BIT_MINUS_ONE];
 
     if (cur == 0) {
 	b = 0x0;
@@ -537,7 +764,6 @@ int_write_long(binyo_byte_buffer *buf, long cur)
     }
 
     int_determine_num_shifts(num_shifts, cur, CHAR_BIT_MINUS_ONE);
-    bytes = ALLOC_N(uint8_t, num_shifts);
 
     for (i = num_shifts - 1; i >= 0; i--) {
 	b = cur & 0x7f;
@@ -549,12 +775,9 @@ int_write_long(binyo_byte_buffer *buf, long cur)
 
     if (binyo_buffer_write(buf, bytes, num_shifts) == BINYO_ERR) {
 	krypt_error_add("Writing to buffer failed");
-	ret = KRYPT_ERR;
-    } else {
-	ret = KRYPT_OK;
+	return KRYPT_ERR;
     }
-    xfree(bytes);
-    return ret;
+    return KRYPT_OK;
 } 
 
 #define int_check_first_sub_id(first)			\
@@ -602,6 +825,66 @@ error:
     return KRYPT_ERR;
 }
 
+static long
+int_get_arc(VALUE arcs, long i)
+{
+    VALUE arc = rb_ary_entry(arcs, i);
+    long ret;
+
+    if (!FIXNUM_P(arc)) {
+	krypt_error_add("OBJECT IDENTIFIER arcs must be non-negative Integers");
+	return KRYPT_ERR;
+    }
+    ret = FIX2LONG(arc);
+    if (ret < 0) {
+	krypt_error_add("OBJECT IDENTIFIER arcs must be non-negative Integers");
+	return KRYPT_ERR;
+    }
+    return ret;
+}
+
+/**
+ * Encodes an Array of Integer arcs as the value of an OBJECT IDENTIFIER
+ * without going through the dotted String representation.
+ *
+ * @param arcs		An Array of non-negative Integers, at least two
+ * @param out		On success, receives the newly allocated encoding
+ * @param outlen	On success, receives the length of the encoding
+ * @return		KRYPT_OK if successful, KRYPT_ERR otherwise
+ */
+int
+krypt_asn1_encode_object_id_arcs(VALUE arcs, uint8_t **out, size_t *outlen)
+{
+    long first, second, cur, i, size;
+    binyo_byte_buffer *buffer;
+
+    size = RARRAY_LEN(arcs);
+    if (size < 2) {
+	krypt_error_add("OBJECT IDENTIFIER must consist of at least two arcs");
+	return KRYPT_ERR;
+    }
+
+    buffer = binyo_buffer_new();
+    if ((first = int_get_arc(arcs, 0)) < 0) goto error;
+    int_check_first_sub_id(first);
+    if ((second = int_get_arc(arcs, 1)) < 0) goto error;
+    int_check_second_sub_id(second);
+
+    if (int_write_long(buffer, 40 * first + second) == KRYPT_ERR) goto error;
+
+    for (i = 2; i < size; i++) {
+	if ((cur = int_get_arc(arcs, i)) < 0) goto error;
+	if (int_write_long(buffer, cur) == KRYPT_ERR) goto error;
+    }
+
+    *outlen = binyo_buffer_get_bytes_free(buffer, out);
+    return KRYPT_OK;
+
+error:
+    binyo_buffer_free(buffer);
+    return KRYPT_ERR;
+}
+
 static long
 int_parse_sub_id(uint8_t* bytes, size_t len, size_t *offset)
 {
@@ -704,181 +987,360 @@ error:
     return KRYPT_ERR;
 }
 
-#define int_as_time_t(t, time)					\
-do {								\
-    int state = 0;						\
-    VALUE coerced;						\
-    long tmp;							\
-    coerced = rb_protect(rb_Integer, time, &state);   		\
-    if (state) {						\
-	krypt_error_add("Invalid Time argument");		\
-	return KRYPT_ERR;					\
-    }								\
-    tmp = (long) rb_protect((VALUE(*)_((VALUE)))rb_num2long, coerced, &state); \
-    if (state) {						\
-	krypt_error_add("Invalid Time argument");		\
-	return KRYPT_ERR;					\
-    }								\
-    if (tmp < 0) {						\
-	krypt_error_add("Negative Time value given");		\
-	return KRYPT_ERR;					\
-    }								\
-    (t) = (time_t) tmp;						\
-} while (0)
+/**
+ * Decodes the value of an OBJECT IDENTIFIER into an Array of Integer
+ * arcs without building the dotted String representation.
+ *
+ * @param bytes		The encoded OBJECT IDENTIFIER value
+ * @param len		The length of the encoding
+ * @param out		On success, receives the Array of arcs
+ * @return		KRYPT_OK if successful, KRYPT_ERR otherwise
+ */
+int
+krypt_asn1_decode_object_id_arcs(uint8_t *bytes, size_t len, VALUE *out)
+{
+    long cur, first, second;
+    size_t offset = 0;
+    VALUE ary;
 
-#define int_raw_time_to_cstring(bytes, len, out)		\
-do {								\
-    /* make sure input to sscanf is a zero-terminated string */ \
-    int i;							\
-    (out) = ALLOCA_N(char, (len) + 1);				\
-    for (i=0; i < (len) + 1; i++) {				\
-	(out)[i] = (char) (bytes)[i];				\
-    }								\
-    (out)[(len)] = '\0';					\
-} while (0)		
+    sanity_check(bytes);
 
-static int
-int_encode_utc_time(VALUE value, uint8_t **out, size_t *len)
-{
-    time_t time;
-    struct tm tm;
-    char *ret;
-    int r;
+    if ((cur = int_parse_sub_id(bytes, len, &offset)) < 0) {
+	krypt_error_add("Decoding OBJECT IDENTIFIER failed");
+	return KRYPT_ERR;
+    }
+    if (cur > 40 * 2 + 39) {
+	krypt_error_add("Illegal first octet, value too large");
+	return KRYPT_ERR;
+    }
+    int_set_first_sub_ids(cur, &first, &second);
 
-    int_as_time_t(time, value);
-    if (!(gmtime_r(&time, &tm))) return KRYPT_ERR;
+    ary = rb_ary_new();
+    rb_ary_push(ary, LONG2FIX(first));
+    rb_ary_push(ary, LONG2FIX(second));
 
-    ret = ALLOC_N(char, 20);
-    
-    r = snprintf(ret, 20, 
-	        "%02d%02d%02d%02d%02d%02dZ",
-	        tm.tm_year%100,
-	        tm.tm_mon+1,
-	        tm.tm_mday,
-	        tm.tm_hour,
-	        tm.tm_min,
-	        tm.tm_sec);
+    while ((cur = int_parse_sub_id(bytes, len, &offset)) >= 0) {
+	rb_ary_push(ary, LONG2NUM(cur));
+    }
+    if (cur == KRYPT_ERR) return KRYPT_ERR;
 
-    if (r > 20) {
-	krypt_error_add("Encoding into UTC format failed");
-	xfree(ret);
+    *out = ary;
+    return KRYPT_OK;
+}
+
+static VALUE
+int_time_coerce(VALUE time)
+{
+    return LL2NUM(NUM2LL(rb_Integer(time)));
+}
+
+/* Time values are read directly, anything else is coerced to Integer
+ * seconds since the epoch */
+static int
+int_time_get(VALUE time, long long *secs, long *nsec)
+{
+    VALUE coerced;
+    int state = 0;
+
+#if defined(HAVE_RB_TIME_TIMESPEC)
+    if (rb_obj_is_kind_of(time, rb_cTime)) {
+	struct timespec ts = rb_time_timespec(time);
+	*secs = (long long) ts.tv_sec;
+	*nsec = ts.tv_nsec;
+	return KRYPT_OK;
+    }
+#endif
+    *nsec = 0;
+    if (FIXNUM_P(time)) {
+	*secs = FIX2LONG(time);
+	return KRYPT_OK;
+    }
+    coerced = rb_protect(int_time_coerce, time, &state);
+    if (state) {
+	rb_set_errinfo(Qnil);
+	krypt_error_add("Invalid Time argument");
 	return KRYPT_ERR;
     }
+    *secs = NUM2LL(coerced);
+    return KRYPT_OK;
+}
 
-    *out = (uint8_t *) ret;
-    *len = 13;
+static int
+int_parse_digits(uint8_t **pp, uint8_t *end, int n, int *out)
+{
+    uint8_t *p = *pp;
+    int value = 0;
+
+    if (end - p < n) return KRYPT_ERR;
+    while (n--) {
+	if (*p < '0' || *p > '9') return KRYPT_ERR;
+	value = value * 10 + (*p++ - '0');
+    }
+    *pp = p;
+    *out = value;
     return KRYPT_OK;
 }
 
+#define int_is_digit(p, end)	((p) < (end) && *(p) >= '0' && *(p) <= '9')
+
 static int
-int_parse_utc_time(uint8_t *bytes, size_t len, VALUE *out)
+int_days_in_month(int year, int month)
 {
-    VALUE argv[6];
-    char *cstr;
-    struct tm tm = { 0 };
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
 
-    if (len != 13) {
-	krypt_error_add("Invalid UTC TIME format. Must be 13 characters long");
-	return KRYPT_ERR;
+    if (month == 2 && ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0))
+	return 29;
+    return days[month - 1];
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian calendar date */
+static long long
+int_days_from_civil(int year, int month, int day)
+{
+    long long era, yoe, doy, doe;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * Parses the two time formats of X.680 without any intermediate copies:
+ *
+ *   UTCTime:         YYMMDDhhmm[ss](Z|(+|-)hhmm)
+ *   GeneralizedTime: YYYYMMDDhh[mm[ss]][(.|,)f+][Z|(+|-)hh[mm]]
+ *
+ * A GeneralizedTime fraction applies to the last component present, as
+ * X.680 allows for fractions of hours and minutes, too. GeneralizedTime
+ * without a time zone is local time per X.680, it is interpreted as UTC
+ * since there is no way to tell which local time was meant.
+ */
+static int
+int_parse_time(uint8_t *bytes, size_t len, int utc, long long *secs, long *nsec)
+{
+    uint8_t *p = bytes, *end = bytes + len;
+    int year, month, day, hour, min = 0, sec = 0, off_hour = 0, off_min = 0, digit;
+    long long total, frac = 0, frac_scale = 1000000000LL, unit = 3600;
+    int sign = 0;
+
+    if (utc) {
+	if (int_parse_digits(&p, end, 2, &year) == KRYPT_ERR) return KRYPT_ERR;
+	year += year < 69 ? 2000 : 1900;
+    } else {
+	if (int_parse_digits(&p, end, 4, &year) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    if (int_parse_digits(&p, end, 2, &month) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_parse_digits(&p, end, 2, &day) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_parse_digits(&p, end, 2, &hour) == KRYPT_ERR) return KRYPT_ERR;
+    if (utc || int_is_digit(p, end)) {
+	if (int_parse_digits(&p, end, 2, &min) == KRYPT_ERR) return KRYPT_ERR;
+	unit = 60;
+	if (int_is_digit(p, end)) {
+	    if (int_parse_digits(&p, end, 2, &sec) == KRYPT_ERR) return KRYPT_ERR;
+	    unit = 1;
+	}
     }
 
-    int_raw_time_to_cstring(bytes, 13, cstr);
+    if (!utc && p < end && (*p == '.' || *p == ',')) {
+	p++;
+	if (!int_is_digit(p, end)) return KRYPT_ERR;
+	/* nanosecond precision, further digits are ignored */
+	while (int_is_digit(p, end)) {
+	    digit = *p++ - '0';
+	    if (frac_scale > 1) {
+		frac_scale /= 10;
+		frac += digit * frac_scale;
+	    }
+	}
+    }
 
-    if (sscanf((const char *) cstr,
-		"%2d%2d%2d%2d%2d%2dZ",
-		&tm.tm_year,
-		&tm.tm_mon,
-    		&tm.tm_mday,
-		&tm.tm_hour,
-		&tm.tm_min,
-		&tm.tm_sec) != 6) {
-	return KRYPT_ERR;
+    if (p < end) {
+	if (*p == 'Z') {
+	    p++;
+	} else if (*p == '+' || *p == '-') {
+	    sign = *p++ == '+' ? 1 : -1;
+	    if (int_parse_digits(&p, end, 2, &off_hour) == KRYPT_ERR) return KRYPT_ERR;
+	    if (utc || p < end) {
+		if (int_parse_digits(&p, end, 2, &off_min) == KRYPT_ERR) return KRYPT_ERR;
+	    }
+	} else {
+	    return KRYPT_ERR;
+	}
+    } else if (utc) {
+	return KRYPT_ERR; /* UTCTime requires a time zone */
     }
-    if (tm.tm_year < 69)
-	tm.tm_year += 2000;
-    else
-	tm.tm_year += 1900;
+    if (p != end) return KRYPT_ERR;
 
-    argv[0] = INT2NUM(tm.tm_year);
-    argv[1] = INT2NUM(tm.tm_mon);
-    argv[2] = INT2NUM(tm.tm_mday);
-    argv[3] = INT2NUM(tm.tm_hour);
-    argv[4] = INT2NUM(tm.tm_min);
-    argv[5] = INT2NUM(tm.tm_sec);
+    if (month < 1 || month > 12 ||
+	day < 1 || day > int_days_in_month(year, month) ||
+	hour > 23 || min > 59 || sec > 60 ||
+	off_hour > 23 || off_min > 59)
+	return KRYPT_ERR;
 
-    *out = rb_funcall2(rb_cTime, rb_intern("utc"), 6, argv);
+    total = int_days_from_civil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec;
+    total -= sign * (off_hour * 3600 + off_min * 60);
+    frac *= unit; /* nanoseconds of the last component */
+    *secs = total + frac / 1000000000LL;
+    *nsec = (long) (frac % 1000000000LL);
     return KRYPT_OK;
 }
 
 static int
-int_encode_generalized_time(VALUE value, uint8_t **out, size_t *len)
+int_time_new(long long secs, long nsec, int flags, VALUE *out)
 {
-    time_t time;
-    struct tm tm;
-    char *ret;
-    int r;
+    struct timespec ts;
 
-    int_as_time_t(time, value);
-    gmtime_r(&time, &tm);
-    if (!(gmtime_r(&time, &tm))) return KRYPT_ERR; 
+    if (flags & KRYPT_ASN1_DECODE_EPOCH_TIME) {
+	*out = LL2NUM(secs);
+	return KRYPT_OK;
+    }
 
-    ret = ALLOC_N(char, 20);
-    
-    r = snprintf(ret, 20,
-		 "%04d%02d%02d%02d%02d%02dZ",
-		 tm.tm_year + 1900,
-		 tm.tm_mon+1,
-		 tm.tm_mday,
-		 tm.tm_hour,
-		 tm.tm_min,
-		 tm.tm_sec);
-    if (r  > 20) {
-	krypt_error_add("Encoding into GENERALIZED format failed");
-	xfree(ret);
+    ts.tv_sec = (time_t) secs;
+    ts.tv_nsec = nsec;
+    if ((long long) ts.tv_sec != secs) {
+	krypt_error_add("Time value out of range");
 	return KRYPT_ERR;
     }
-
-    *out = (uint8_t *)ret;
-    *len = 15;
+    *out = rb_time_timespec_new(&ts, INT_MAX - 1); /* UTC */
     return KRYPT_OK;
 }
 
-static int
-int_parse_generalized_time(uint8_t *bytes, size_t len, VALUE *out)
+/* Inverse of int_days_from_civil */
+static void
+int_civil_from_days(long long days, int *year, int *month, int *day)
 {
-    VALUE argv[6];
-    char *cstr;
-    struct tm tm = { 0 };
+    long long era, doe, yoe, doy, mp;
+
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *day = (int) (doy - (153 * mp + 2) / 5 + 1);
+    *month = (int) (mp < 10 ? mp + 3 : mp - 9);
+    *year = (int) (yoe + era * 400 + (*month <= 2));
+}
+
+static uint8_t *
+int_write_digits(uint8_t *p, long value, int n)
+{
+    int i;
 
-    if (len != 15) {
-	krypt_error_add("Invalid GENERALIZED TIME format. Must be 15 characters long");
+    for (i = n - 1; i >= 0; i--) {
+	p[i] = '0' + (value % 10);
+	value /= 10;
+    }
+    return p + n;
+}
+
+/* Writes [YY]YYMMDDhhmmss, returns the position after the last digit */
+static uint8_t *
+int_write_time(uint8_t *p, long long secs, int year_digits, int year, int month, int day)
+{
+    long rem = (long) (secs % 86400);
+
+    if (rem < 0) rem += 86400;
+    p = int_write_digits(p, year, year_digits);
+    p = int_write_digits(p, month, 2);
+    p = int_write_digits(p, day, 2);
+    p = int_write_digits(p, rem / 3600, 2);
+    p = int_write_digits(p, (rem / 60) % 60, 2);
+    return int_write_digits(p, rem % 60, 2);
+}
+
+static long long
+int_floor_days(long long secs)
+{
+    return secs >= 0 ? secs / 86400 : (secs - 86399) / 86400;
+}
+
+static int
+int_encode_utc_time(VALUE value, uint8_t **out, size_t *len)
+{
+    long long secs;
+    long nsec;
+    int year, month, day;
+    uint8_t *ret, *p;
+
+    if (int_time_get(value, &secs, &nsec) == KRYPT_ERR) return KRYPT_ERR;
+    int_civil_from_days(int_floor_days(secs), &year, &month, &day);
+    /* the two-digit year must decode to the same year again */
+    if (year < 1969 || year > 2068) {
+	krypt_error_add("Year %d cannot be represented as UTC TIME", year);
 	return KRYPT_ERR;
     }
 
-    int_raw_time_to_cstring(bytes, 15, cstr);
+    ret = ALLOC_N(uint8_t, 13);
+    p = int_write_time(ret, secs, 2, year % 100, month, day);
+    *p = 'Z';
+    *out = ret;
+    *len = 13;
+    return KRYPT_OK;
+}
+
+static int
+int_parse_utc_time(uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    long long secs;
+    long nsec;
 
-    if (sscanf((const char *)cstr,
-		"%4d%2d%2d%2d%2d%2dZ",
-		&tm.tm_year,
-		&tm.tm_mon,
-    		&tm.tm_mday,
-		&tm.tm_hour,
-		&tm.tm_min,
-		&tm.tm_sec) != 6) {
+    if (int_parse_time(bytes, len, 1, &secs, &nsec) == KRYPT_ERR) {
+	krypt_error_add("Invalid UTC TIME format");
 	return KRYPT_ERR;
     }
+    return int_time_new(secs, nsec, flags, out);
+}
 
-    argv[0] = INT2NUM(tm.tm_year);
-    argv[1] = INT2NUM(tm.tm_mon);
-    argv[2] = INT2NUM(tm.tm_mday);
-    argv[3] = INT2NUM(tm.tm_hour);
-    argv[4] = INT2NUM(tm.tm_min);
-    argv[5] = INT2NUM(tm.tm_sec);
+/* If fractional is set, nanoseconds are added as DER demands it: separated
+ * by '.', without trailing zeros and omitted entirely if zero. */
+static int
+int_encode_generalized_time(VALUE value, int fractional, uint8_t **out, size_t *len)
+{
+    long long secs;
+    long nsec;
+    int year, month, day, digits = 9;
+    uint8_t *ret, *p;
+
+    if (int_time_get(value, &secs, &nsec) == KRYPT_ERR) return KRYPT_ERR;
+    int_civil_from_days(int_floor_days(secs), &year, &month, &day);
+    if (year < 0 || year > 9999) {
+	krypt_error_add("Year %d cannot be represented as GENERALIZED TIME", year);
+	return KRYPT_ERR;
+    }
 
-    *out = rb_funcall2(rb_cTime, rb_intern("utc"), 6, argv);
+    ret = ALLOC_N(uint8_t, 25); /* YYYYMMDDhhmmss.nnnnnnnnnZ */
+    p = int_write_time(ret, secs, 4, year, month, day);
+    if (fractional && nsec > 0) {
+	while (nsec % 10 == 0) {
+	    nsec /= 10;
+	    digits--;
+	}
+	*p++ = '.';
+	p = int_write_digits(p, nsec, digits);
+    }
+    *p++ = 'Z';
+    *out = ret;
+    *len = p - ret;
     return KRYPT_OK;
 }
 
+static int
+int_parse_generalized_time(uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    long long secs;
+    long nsec;
+
+    if (int_parse_time(bytes, len, 0, &secs, &nsec) == KRYPT_ERR) {
+	krypt_error_add("Invalid GENERALIZED TIME format");
+	return KRYPT_ERR;
+    }
+    return int_time_new(secs, nsec, flags, out);
+}
+
 size_t
 krypt_asn1_encode_integer(long num, uint8_t **out)
 {
@@ -914,60 +1376,204 @@ krypt_asn1_encode_integer(long num, uint8_t **out)
     return ptr - bytes;
 }
 
-static int
-int_decode_integer_to_long(uint8_t *bytes, size_t len, long *out)
+/* Interprets at most SIZEOF_LONG bytes as a big-endian two's complement
+ * number */
+static long
+int_decode_integer_to_long(uint8_t *bytes, size_t len)
 {
-    unsigned long num = 0;
+    unsigned long num;
     size_t i;
 
+    num = (bytes[0] & 0x80) ? ~0UL : 0UL;
     for (i = 0; i < len; i++)
-	num |= bytes[i] << ((len - i - 1) * CHAR_BIT);
+	num = (num << CHAR_BIT) | bytes[i];
+
+    return (long) num;
+}
+
+/* Registry of codecs for (tag class, tag) pairs. Entries are never
+ * freed since ASN1Data instances keep pointers to them, registering
+ * a pair again replaces the entry in place. */
+static st_table *krypt_codec_registry;
+static VALUE krypt_codec_handlers;
+static ID sKrypt_ID_DECODE, sKrypt_ID_ENCODE, sKrypt_ID_VALIDATE;
+
+#define int_registry_key(tc, t)	((st_data_t) (((unsigned long) (t) << 8) | ((tc) & 0xff)))
+
+static krypt_asn1_codec *
+int_codec_entry(int tag_class, int tag)
+{
+    krypt_asn1_codec *codec;
+    st_data_t key = int_registry_key(tag_class, tag);
+
+    if (!st_lookup(krypt_codec_registry, key, (st_data_t *) &codec)) {
+	codec = ALLOC(krypt_asn1_codec);
+	st_insert(krypt_codec_registry, key, (st_data_t) codec);
+    }
+    return codec;
+}
 
-    if (num > LONG_MAX) {
-	krypt_error_add("Integer value too large");
+/**
+ * Registers a native codec for values of the given tag class and tag,
+ * overriding the built-in codec for UNIVERSAL tags. Missing encoder,
+ * decoder or validator functions are replaced by the default ones that
+ * treat the value as a plain String.
+ *
+ * @param tag_class	The raw tag class, e.g. TAG_CLASS_APPLICATION
+ * @param tag		The tag number
+ * @param codec		The codec, its contents are copied
+ * @return		KRYPT_OK or KRYPT_ERR
+ */
+int
+krypt_asn1_codec_register(int tag_class, int tag, krypt_asn1_codec *codec)
+{
+    krypt_asn1_codec *entry;
+
+    if (tag < 0 || (tag_class & ~0xc0)) {
+	krypt_error_add("Invalid tag or tag class for codec");
 	return KRYPT_ERR;
     }
-    *out = (long) num;
+    entry = int_codec_entry(tag_class, tag);
+    entry->encoder = codec->encoder ? codec->encoder : int_asn1_encode_default;
+    entry->decoder = codec->decoder ? codec->decoder : int_asn1_decode_default;
+    entry->validator = codec->validator ? codec->validator : int_asn1_validate_default;
+    entry->handler = 0;
     return KRYPT_OK;
 }
 
-static int
-int_decode_positive_integer(uint8_t *bytes, size_t len, VALUE *out)
+/**
+ * Registers a Ruby object as codec for values of the given tag class
+ * and tag. The handler must implement +decode(bytes)+ and
+ * +encode(value)+ and may implement +validate(value)+.
+ *
+ * @param tag_class	The raw tag class, e.g. TAG_CLASS_APPLICATION
+ * @param tag		The tag number
+ * @param handler	The Ruby codec object
+ * @return		KRYPT_OK or KRYPT_ERR
+ */
+int
+krypt_asn1_codec_register_handler(int tag_class, int tag, VALUE handler)
 {
-    long num;
+    krypt_asn1_codec codec = { NULL, NULL, NULL, 0 };
 
-    if (int_decode_integer_to_long(bytes, len, &num) == KRYPT_ERR) return KRYPT_ERR;
-    *out = LONG2NUM(num);
+    if (!rb_respond_to(handler, sKrypt_ID_DECODE) || !rb_respond_to(handler, sKrypt_ID_ENCODE)) {
+	krypt_error_add("Codec must respond to decode and encode");
+	return KRYPT_ERR;
+    }
+    if (krypt_asn1_codec_register(tag_class, tag, &codec) == KRYPT_ERR) return KRYPT_ERR;
+    rb_hash_aset(krypt_codec_handlers, ULONG2NUM(int_registry_key(tag_class, tag)), handler);
+    int_codec_entry(tag_class, tag)->handler = handler;
     return KRYPT_OK;
 }
 
-static int
-int_decode_negative_integer(uint8_t *bytes, size_t len, VALUE *out)
+/**
+ * Returns the codec for the given tag class and tag. Registered codecs
+ * take precedence over the built-in UNIVERSAL codecs.
+ *
+ * @param tag_class	The raw tag class
+ * @param tag		The tag number
+ * @return		The codec, or NULL if there is none
+ */
+krypt_asn1_codec *
+krypt_asn1_codec_for(int tag_class, int tag)
 {
-    long num;
-    uint8_t *copy;
-    int result;
+    krypt_asn1_codec *codec;
+
+    if (krypt_codec_registry->num_entries &&
+	st_lookup(krypt_codec_registry, int_registry_key(tag_class, tag), (st_data_t *) &codec))
+	return codec;
+    if (tag_class == TAG_CLASS_UNIVERSAL && tag < 31)
+	return &krypt_asn1_codecs[tag];
+    return NULL;
+}
 
-    copy = ALLOC_N(uint8_t, len);
-    krypt_compute_twos_complement(copy, bytes, len);
-    result = int_decode_integer_to_long(copy, len, &num);
-    xfree(copy);
-    if (result == KRYPT_ERR) return KRYPT_ERR;
-    *out = LONG2NUM(-num);
-    return KRYPT_OK;
+static VALUE
+int_handler_call(VALUE args)
+{
+    VALUE *argv = (VALUE *) args;
+    return rb_funcall(argv[0], SYM2ID(argv[1]), 1, argv[2]);
 }
 
 static int
-int_decode_integer(uint8_t *bytes, size_t len, VALUE *out)
+int_handler_invoke(VALUE handler, ID method, VALUE arg, VALUE *out)
 {
-    if (bytes[0] & 0x80) {
-	return int_decode_negative_integer(bytes, len, out);
+    VALUE args[3], ret, err, exc;
+    int state = 0;
+
+    args[0] = handler;
+    args[1] = ID2SYM(method);
+    args[2] = arg;
+    ret = rb_protect(int_handler_call, (VALUE) args, &state);
+    if (state) {
+	exc = rb_errinfo();
+	if (!int_is_standard_error(exc))
+	    rb_jump_tag(state);
+	rb_set_errinfo(Qnil);
+	err = rb_protect(rb_obj_as_string, exc, &state);
+	if (state) {
+	    rb_set_errinfo(Qnil);
+	    err = rb_class_name(CLASS_OF(exc));
+	}
+	krypt_error_add("Codec %s failed: %.*s", rb_id2name(method), (int) RSTRING_LEN(err), RSTRING_PTR(err));
+	return KRYPT_ERR;
     }
-    else {
-	if (bytes[0] == 0x0)
-	    return int_decode_positive_integer(bytes + 1, len - 1, out);
-	else
-	    return int_decode_positive_integer(bytes, len, out);
+    *out = ret;
+    return KRYPT_OK;
+}
+
+int
+krypt_asn1_codec_decode(krypt_asn1_codec *codec, VALUE self, uint8_t *bytes, size_t len, int flags, VALUE *out)
+{
+    if (!codec->handler)
+	return codec->decoder(self, bytes, len, flags, out);
+    return int_handler_invoke(codec->handler, sKrypt_ID_DECODE, rb_str_new((const char *) bytes, len), out);
+}
+
+int
+krypt_asn1_codec_encode(krypt_asn1_codec *codec, VALUE self, VALUE value, uint8_t **out, size_t *len)
+{
+    VALUE encoded;
+
+    if (!codec->handler)
+	return codec->encoder(self, value, out, len);
+    if (int_handler_invoke(codec->handler, sKrypt_ID_ENCODE, value, &encoded) == KRYPT_ERR)
+	return KRYPT_ERR;
+    if (TYPE(encoded) != T_STRING) {
+	krypt_error_add("Codec encode must return a String");
+	return KRYPT_ERR;
     }
+    return int_asn1_encode_default(self, encoded, out, len);
 }
 
+int
+krypt_asn1_codec_validate(krypt_asn1_codec *codec, VALUE self, VALUE value)
+{
+    VALUE valid;
+
+    if (!codec->handler)
+	return codec->validator(self, value);
+    if (!rb_respond_to(codec->handler, sKrypt_ID_VALIDATE))
+	return KRYPT_OK;
+    if (int_handler_invoke(codec->handler, sKrypt_ID_VALIDATE, value, &valid) == KRYPT_ERR)
+	return KRYPT_ERR;
+    if (!RTEST(valid)) {
+	krypt_error_add("Value rejected by codec");
+	return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+void
+Init_krypt_asn1_codec(void)
+{
+    krypt_codec_registry = st_init_numtable();
+    krypt_codec_handlers = rb_hash_new();
+    rb_global_variable(&krypt_codec_handlers);
+    sKrypt_ID_DECODE = rb_intern("decode");
+    sKrypt_ID_ENCODE = rb_intern("encode");
+    sKrypt_ID_VALIDATE = rb_intern("validate");
+    krypt_oid_cache = rb_hash_new();
+    rb_global_variable(&krypt_oid_cache);
+    krypt_utf16be_index = rb_enc_find_index("UTF-16BE");
+    krypt_utf32be_index = rb_enc_find_index("UTF-32BE");
+}
@@ -0,0 +1,352 @@
+/*
+ * krypt-core API - C implementation
+ *
+ * Copyright (c) 2011-2013
+ * Hiroshi Nakamura <nahi@ruby-lang.org>
+ * Martin Bosslet <martin.bosslet@gmail.com>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "krypt-core.h"
+#include "krypt_asn1-internal.h"
+
+VALUE cKryptASN1RawInteger;
+
+typedef struct krypt_raw_integer_st {
+    VALUE der;     /* frozen String, the two's complement content octets */
+    VALUE integer; /* Integer, only computed on demand */
+} krypt_raw_integer;
+
+static void
+int_raw_integer_mark(krypt_raw_integer *raw)
+{
+    if (!raw) return;
+
+    rb_gc_mark(raw->der);
+    rb_gc_mark(raw->integer);
+}
+
+static void
+int_raw_integer_free(krypt_raw_integer *raw)
+{
+    if (!raw) return;
+
+    xfree(raw);
+}
+
+#define int_krypt_raw_integer_set(klass, obj, raw) 		\
+do { 							    	\
+    if (!(raw)) { 					    	\
+	rb_raise(eKryptError, "Uninitialized RawInteger"); 	\
+    } 								\
+    (obj) = Data_Wrap_Struct((klass), int_raw_integer_mark, int_raw_integer_free, (raw)); \
+} while (0)
+
+#define int_krypt_raw_integer_get(obj, raw) 			\
+do { 								\
+    Data_Get_Struct((obj), krypt_raw_integer, (raw));  		\
+    if (!(raw)) { 						\
+	rb_raise(eKryptError, "Uninitialized RawInteger");	\
+    } 								\
+} while (0)
+
+#define int_raw_integer_is_negative(raw)	(RSTRING_PTR((raw)->der)[0] & 0x80)
+
+/**
+ * Wraps the content octets of a DER-encoded INTEGER without interpreting
+ * them. The bytes are copied, so the caller keeps ownership of +bytes+.
+ *
+ * @param bytes	The content octets of the INTEGER, must not be empty
+ * @param len	The number of content octets
+ * @return	A new RawInteger instance
+ */
+VALUE
+krypt_asn1_raw_integer_new(uint8_t *bytes, size_t len)
+{
+    VALUE obj;
+    krypt_raw_integer *raw;
+
+    raw = ALLOC(krypt_raw_integer);
+    raw->der = Qnil;
+    raw->integer = Qnil;
+    int_krypt_raw_integer_set(cKryptASN1RawInteger, obj, raw);
+    /* only now the String is reachable by the GC */
+    raw->der = rb_obj_freeze(rb_str_new((const char *) bytes, len));
+    return obj;
+}
+
+int
+krypt_asn1_is_raw_integer(VALUE value)
+{
+    return RTEST(rb_obj_is_kind_of(value, cKryptASN1RawInteger));
+}
+
+/**
+ * Returns the two's complement content octets of +value+, which must be
+ * a RawInteger. The returned bytes are owned by +value+.
+ */
+void
+krypt_asn1_raw_integer_get_der(VALUE value, uint8_t **out, size_t *outlen)
+{
+    krypt_raw_integer *raw;
+
+    int_krypt_raw_integer_get(value, raw);
+    *out = (uint8_t *) RSTRING_PTR(raw->der);
+    *outlen = RSTRING_LEN(raw->der);
+}
+
+/**
+ * call-seq:
+ *    raw.to_i -> Integer
+ *
+ * Converts the raw INTEGER to a Ruby +Integer+. The result is computed
+ * once and cached afterwards.
+ */
+static VALUE
+krypt_raw_integer_to_i(VALUE self)
+{
+    krypt_raw_integer *raw;
+    uint8_t *bytes;
+    size_t len;
+
+    int_krypt_raw_integer_get(self, raw);
+    if (!NIL_P(raw->integer))
+	return raw->integer;
+
+    bytes = (uint8_t *) RSTRING_PTR(raw->der);
+    len = RSTRING_LEN(raw->der);
+    if (krypt_asn1_codecs[TAGS_INTEGER].decoder(self, bytes, len, 0, &raw->integer) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Error while decoding INTEGER");
+    return raw->integer;
+}
+
+/**
+ * call-seq:
+ *    raw.bytes -> String
+ *
+ * Returns the absolute value of the INTEGER as an unsigned big-endian
+ * binary +String+ without leading zero bytes. The sign is available via
+ * #negative?. For positive values no bytes are copied.
+ */
+static VALUE
+krypt_raw_integer_bytes(VALUE self)
+{
+    krypt_raw_integer *raw;
+    uint8_t *bytes, *abs;
+    size_t len, i = 0;
+    VALUE ret;
+
+    int_krypt_raw_integer_get(self, raw);
+    bytes = (uint8_t *) RSTRING_PTR(raw->der);
+    len = RSTRING_LEN(raw->der);
+
+    if (!int_raw_integer_is_negative(raw)) {
+	while (i < len - 1 && bytes[i] == 0x00)
+	    i++;
+	return rb_str_substr(raw->der, i, len - i);
+    }
+
+    abs = ALLOC_N(uint8_t, len);
+    krypt_compute_twos_complement(abs, bytes, len);
+    while (i < len - 1 && abs[i] == 0x00)
+	i++;
+    ret = rb_str_new((const char *) abs + i, len - i);
+    xfree(abs);
+    return ret;
+}
+
+/**
+ * call-seq:
+ *    raw.negative? -> true or false
+ *
+ * Returns +true+ if the INTEGER is less than zero.
+ */
+static VALUE
+krypt_raw_integer_is_negative(VALUE self)
+{
+    krypt_raw_integer *raw;
+
+    int_krypt_raw_integer_get(self, raw);
+    return int_raw_integer_is_negative(raw) ? Qtrue : Qfalse;
+}
+
+/**
+ * call-seq:
+ *    raw.to_der_bytes -> String
+ *
+ * Returns the content octets exactly as they were encoded, i.e. the two's
+ * complement big-endian representation of the INTEGER.
+ */
+static VALUE
+krypt_raw_integer_to_der_bytes(VALUE self)
+{
+    krypt_raw_integer *raw;
+
+    int_krypt_raw_integer_get(self, raw);
+    return raw->der;
+}
+
+/**
+ * call-seq:
+ *    raw == other -> true or false
+ *
+ * Two RawIntegers are compared by their encodings, anything else is
+ * compared with the converted +Integer+.
+ */
+static VALUE
+krypt_raw_integer_equals(VALUE self, VALUE other)
+{
+    krypt_raw_integer *raw, *other_raw;
+
+    if (krypt_asn1_is_raw_integer(other)) {
+	int_krypt_raw_integer_get(self, raw);
+	int_krypt_raw_integer_get(other, other_raw);
+	return rb_str_equal(raw->der, other_raw->der);
+    }
+    return rb_funcall(krypt_raw_integer_to_i(self), sKrypt_ID_EQUALS, 1, other);
+}
+
+static VALUE
+krypt_raw_integer_eql(VALUE self, VALUE other)
+{
+    if (!krypt_asn1_is_raw_integer(other)) return Qfalse;
+    return krypt_raw_integer_equals(self, other);
+}
+
+static VALUE
+krypt_raw_integer_hash(VALUE self)
+{
+    krypt_raw_integer *raw;
+
+    int_krypt_raw_integer_get(self, raw);
+    return rb_funcall(raw->der, rb_intern("hash"), 0);
+}
+
+static VALUE
+krypt_raw_integer_cmp(VALUE self, VALUE other)
+{
+    if (krypt_asn1_is_raw_integer(other))
+	other = krypt_raw_integer_to_i(other);
+    return rb_funcall(krypt_raw_integer_to_i(self), rb_intern("<=>"), 1, other);
+}
+
+/**
+ * call-seq:
+ *    raw.coerce(numeric) -> [numeric, Integer]
+ *
+ * Allows RawIntegers to be used as the right-hand operand of arithmetic
+ * operations, e.g. 1 + raw.
+ */
+static VALUE
+krypt_raw_integer_coerce(VALUE self, VALUE other)
+{
+    return rb_assoc_new(other, krypt_raw_integer_to_i(self));
+}
+
+static VALUE
+krypt_raw_integer_to_s(int argc, VALUE *argv, VALUE self)
+{
+    return rb_funcall2(krypt_raw_integer_to_i(self), rb_intern("to_s"), argc, argv);
+}
+
+static VALUE
+krypt_raw_integer_inspect(VALUE self)
+{
+    VALUE str = rb_str_new2("#<");
+    rb_str_cat2(str, rb_obj_classname(self));
+    rb_str_cat2(str, " ");
+    rb_str_append(str, krypt_raw_integer_to_s(0, NULL, self));
+    rb_str_cat2(str, ">");
+    return str;
+}
+
+/* Anything else is forwarded to the converted Integer */
+static VALUE
+krypt_raw_integer_method_missing(int argc, VALUE *argv, VALUE self)
+{
+    VALUE integer;
+    ID mid;
+
+    if (argc < 1 || !SYMBOL_P(argv[0]))
+	rb_raise(rb_eArgError, "No method name given");
+    mid = SYM2ID(argv[0]);
+    integer = krypt_raw_integer_to_i(self);
+    if (!rb_respond_to(integer, mid))
+	return rb_call_super(argc, argv);
+    return rb_funcall2(integer, mid, argc - 1, argv + 1);
+}
+
+static VALUE
+krypt_raw_integer_respond_to_missing(VALUE self, VALUE name, VALUE include_private)
+{
+    return rb_respond_to(INT2FIX(0), rb_to_id(name)) ? Qtrue : Qfalse;
+}
+
+void
+Init_krypt_asn1_raw_integer(void)
+{
+#if 0
+    mKrypt = rb_define_module("Krypt");
+    mKryptASN1 = rb_define_module_under(mKrypt, "ASN1"); /* Let RDoc know */ 
+#endif
+
+    /**
+     * Document-class: Krypt::ASN1::RawInteger
+     *
+     * Returned instead of an +Integer+ for INTEGER and ENUMERATED values
+     * when decoding with the +raw_integers+ option, or for template fields
+     * declared with the +raw+ option. A RawInteger merely keeps the encoded
+     * bytes, which avoids creating Bignums for large values such as RSA
+     * moduli that are only passed on as binary strings anyway. Conversion
+     * to an +Integer+ happens lazily once arithmetic is requested, the
+     * result is cached.
+     *
+     * RawIntegers may be assigned as values of Krypt::ASN1::Integer and
+     * template fields, they are re-encoded without any conversion.
+     *
+     * == Example usage
+     *
+     *   asn1 = Krypt::ASN1.decode(der, raw_integers: true)
+     *   n = asn1.value[0].value
+     *   n.bytes     # => unsigned big-endian String
+     *   n.negative? # => false
+     *   n + 1       # => converts to an Integer
+     */
+    cKryptASN1RawInteger = rb_define_class_under(mKryptASN1, "RawInteger", rb_cObject);
+    rb_include_module(cKryptASN1RawInteger, rb_mComparable);
+    rb_define_method(cKryptASN1RawInteger, "bytes", krypt_raw_integer_bytes, 0);
+    rb_define_method(cKryptASN1RawInteger, "negative?", krypt_raw_integer_is_negative, 0);
+    rb_define_method(cKryptASN1RawInteger, "to_der_bytes", krypt_raw_integer_to_der_bytes, 0);
+    rb_define_method(cKryptASN1RawInteger, "to_i", krypt_raw_integer_to_i, 0);
+    rb_define_method(cKryptASN1RawInteger, "to_int", krypt_raw_integer_to_i, 0);
+    rb_define_method(cKryptASN1RawInteger, "==", krypt_raw_integer_equals, 1);
+    rb_define_method(cKryptASN1RawInteger, "eql?", krypt_raw_integer_eql, 1);
+    rb_define_method(cKryptASN1RawInteger, "hash", krypt_raw_integer_hash, 0);
+    rb_define_method(cKryptASN1RawInteger, "<=>", krypt_raw_integer_cmp, 1);
+    rb_define_method(cKryptASN1RawInteger, "coerce", krypt_raw_integer_coerce, 1);
+    rb_define_method(cKryptASN1RawInteger, "to_s", krypt_raw_integer_to_s, -1);
+    rb_define_method(cKryptASN1RawInteger, "inspect", krypt_raw_integer_inspect, 0);
+    rb_define_method(cKryptASN1RawInteger, "method_missing", krypt_raw_integer_method_missing, -1);
+    rb_define_private_method(cKryptASN1RawInteger, "respond_to_missing?", krypt_raw_integer_respond_to_missing, 2);
+    rb_undef_alloc_func(cKryptASN1RawInteger);
+    rb_undef_method(CLASS_OF(cKryptASN1RawInteger), "new"); /* private constructor */
+}
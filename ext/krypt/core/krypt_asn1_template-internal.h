@@ -32,32 +32,55 @@
 extern ID sKrypt_ID_OPTIONS, sKrypt_ID_NAME, sKrypt_ID_TYPE,
 	  sKrypt_ID_CODEC, sKrypt_ID_LAYOUT, sKrypt_ID_MIN_SIZE;
 
-extern ID sKrypt_ID_DEFAULT,  sKrypt_ID_OPTIONAL, sKrypt_ID_TAG, sKrypt_ID_TAGGING;
+extern ID sKrypt_ID_DEFAULT,  sKrypt_ID_OPTIONAL, sKrypt_ID_TAG, sKrypt_ID_TAGGING,
+	  sKrypt_ID_RAW, sKrypt_ID_ENCAPSULATED;
    
 extern ID sKrypt_ID_PRIMITIVE, sKrypt_ID_SEQUENCE, sKrypt_ID_SET, sKrypt_ID_TEMPLATE,
           sKrypt_ID_SEQUENCE_OF, sKrypt_ID_SET_OF, sKrypt_ID_CHOICE, sKrypt_ID_ANY;
 
-extern ID sKrypt_IV_VALUE, sKrypt_IV_TYPE, sKrypt_IV_DEFINITION, sKrypt_IV_OPTIONS;
+extern ID sKrypt_IV_VALUE, sKrypt_IV_TYPE, sKrypt_IV_DEFINITION, sKrypt_IV_OPTIONS,
+	  sKrypt_IV_COMPILED_DEFINITION;
 
 extern ID sKrypt_ID_MERGE;
 
-extern VALUE cKryptASN1TemplateValue;
+extern VALUE cKryptASN1TemplateCollection;
 
 #define KRYPT_TEMPLATE_PARSED    (1 << 0)
 #define KRYPT_TEMPLATE_DECODED   (1 << 1)
 #define KRYPT_TEMPLATE_MODIFIED  (1 << 2)
+#define KRYPT_TEMPLATE_PROJECTED (1 << 3)
+#define KRYPT_TEMPLATE_BORROWED  (1 << 4) /* fields: object's bytes belong to an enclosing encoding */
+
+struct krypt_asn1_definition_st;
+
+/* The state of a field, kept in the field array of the template that it
+ * belongs to. Fields have no Ruby object of their own, nested templates are
+ * only instantiated once they are accessed. */
+typedef struct krypt_asn1_field_st {
+    int flags; /* KRYPT_TEMPLATE_* flags, unset if the field has no value */
+    int unused_bits; /* BIT STRING values */
+    krypt_asn1_object *object;
+    VALUE value;
+    struct krypt_asn1_definition_st *def; /* the definition the value was parsed with */
+} krypt_asn1_field;
 
 typedef struct krypt_asn1_template_st {
     int flags;
+    int decode_flags; /* KRYPT_ASN1_DECODE_* flags, inherited by inner values */
     krypt_asn1_object *object;
     VALUE definition;
     VALUE options;
     VALUE value;
+    struct krypt_asn1_definition_st *def; /* compiled definition, set for parsed values */
+    VALUE compiled; /* keeps the compiled definition tree that def points into alive */
+    VALUE owner; /* if not nil, object's bytes point into the encoding held by owner */
+    VALUE only; /* if not nil, the fields to parse, see Template::Parser#projection */
+    krypt_asn1_field *fields; /* indexed by field_index, allocated on first use */
+    long num_fields;
 } krypt_asn1_template;
 
 krypt_asn1_template *krypt_asn1_template_new(krypt_asn1_object *object, VALUE definition, VALUE options);
 krypt_asn1_template *krypt_asn1_template_new_from_stream(binyo_instream *in, krypt_asn1_header *header, VALUE definition, VALUE options);
-krypt_asn1_template *krypt_asn1_template_new_value(VALUE value);
 
 void krypt_asn1_template_mark(krypt_asn1_template *t);
 void krypt_asn1_template_free(krypt_asn1_template *t);
@@ -89,6 +112,7 @@ do { 									\
 #define krypt_asn1_template_is_parsed(o)		(((o)->flags & KRYPT_TEMPLATE_PARSED) == KRYPT_TEMPLATE_PARSED)
 #define krypt_asn1_template_is_decoded(o)		(((o)->flags & KRYPT_TEMPLATE_DECODED) == KRYPT_TEMPLATE_DECODED)
 #define krypt_asn1_template_is_modified(o)		(((o)->flags & KRYPT_TEMPLATE_MODIFIED) == KRYPT_TEMPLATE_MODIFIED)
+#define krypt_asn1_template_is_projected(o)		(((o)->flags & KRYPT_TEMPLATE_PROJECTED) == KRYPT_TEMPLATE_PROJECTED)
 #define krypt_asn1_template_set_parsed(o, b)	\
 do {						\
     if (b) {					\
@@ -105,6 +129,14 @@ do {						\
 	(o)->flags &= ~KRYPT_TEMPLATE_DECODED;	\
     }						\
 } while (0)
+#define krypt_asn1_template_set_projected(o, b)	\
+do {						\
+    if (b) {					\
+	(o)->flags |= KRYPT_TEMPLATE_PROJECTED;	\
+    } else {					\
+	(o)->flags &= ~KRYPT_TEMPLATE_PROJECTED;	\
+    }						\
+} while (0)
 #define krypt_asn1_template_set_modified(o, b)	\
 do {						\
     if (b) {					\
@@ -126,13 +158,63 @@ do {						\
 #define krypt_hash_get_tagging(d) 	rb_hash_aref((d), ID2SYM(sKrypt_ID_TAGGING))
 #define krypt_hash_get_layout(d) 	rb_hash_aref((d), ID2SYM(sKrypt_ID_LAYOUT))
 #define krypt_hash_get_min_size(d) 	rb_hash_aref((d), ID2SYM(sKrypt_ID_MIN_SIZE))
+#define krypt_hash_get_raw(o) 		rb_hash_aref((o), ID2SYM(sKrypt_ID_RAW))
+#define krypt_hash_get_encapsulated(o) 	rb_hash_aref((o), ID2SYM(sKrypt_ID_ENCAPSULATED))
+
+struct krypt_asn1_template_parse_ctx;
+
+#define KRYPT_DEFINITION_F_OPTIONAL	(1 << 0)
+#define KRYPT_DEFINITION_F_HAS_DEFAULT	(1 << 1)
+#define KRYPT_DEFINITION_F_EXPLICIT	(1 << 2)
+#define KRYPT_DEFINITION_F_RAW		(1 << 3)
+#define KRYPT_DEFINITION_F_ENCAPSULATED	(1 << 4)
+#define KRYPT_DEFINITION_F_TEMPLATE_TYPE	(1 << 5)
+#define KRYPT_DEFINITION_F_FIRST_COMPUTED	(1 << 6)
+#define KRYPT_DEFINITION_F_FIRST_ANY	(1 << 7)
+#define KRYPT_DEFINITION_F_FIRST_PENDING	(1 << 8)
 
+/* Entry of a CHOICE's FIRST set: the alternative at +index+ may start
+ * with +tag+ and +tag_class+. */
+typedef struct krypt_asn1_first_tag_st {
+    int tag;
+    int tag_class;
+    long index;
+} krypt_asn1_first_tag;
+
+/* Definitions are compiled once per template class, on first parse, into
+ * a tree of these. The Ruby values are read when compiling, afterwards
+ * parsing only works with the native fields. */
 typedef struct krypt_asn1_definition_st {
     VALUE definition;
     VALUE options;
-    VALUE values[8];
-    unsigned short value_read[8];
-    long matched_layout; /* this information is only used by CHOICEs */
+    VALUE values[10];
+    unsigned short value_read[10];
+    ID codec;
+    ID name; /* instance variable the value is stored in */
+    struct krypt_asn1_template_parse_ctx *parser;
+    int flags;
+    int default_tag; /* -1 if the codec has no default tag */
+    int expected_tag; /* -1 for untagged CHOICE/ANY/TEMPLATE values */
+    int expected_tag_class;
+    long min_size;
+    long layout_size;
+    struct krypt_asn1_definition_st **layout;
+    struct krypt_asn1_definition_st *type_def; /* TEMPLATE values, compiled on first use */
+    struct krypt_asn1_definition_st *prev; /* replaced type_def, values may still refer to it */
+    VALUE type_compiled; /* set if type_def is shared with the type's own compiled definition */
+    VALUE type_replaced; /* Array of replaced type_compiled, values may still refer to them */
+    long field_index; /* slot of the value in the template's fields, -1 if it has none */
+    int element_tag; /* SEQUENCE OF/SET OF: universal tag of elements decoded plainly, or -1 */
+    long num_fields; /* roots only: the number of slots of their templates */
+    ID *field_names; /* roots only: the name of each slot */
+    ID *field_keys; /* roots only: the name of each slot without '@', e.g. for Template#to_h */
+    st_table *field_methods; /* roots only: accessor method IDs to slots */
+    ID last_mid; /* roots only: the accessor looked up last and its slot */
+    long last_index;
+    krypt_asn1_first_tag *first; /* CHOICE only, sorted by tag class and tag */
+    long first_size;
+    long first_wildcard; /* first alternative that matches any tag, or -1 */
+    long first_any; /* first ANY alternative, or -1 */
 } krypt_asn1_definition;
 
 #define KRYPT_DEFINITION_NAME 0
@@ -143,6 +225,8 @@ typedef struct krypt_asn1_definition_st {
 #define KRYPT_DEFINITION_TAG 5
 #define KRYPT_DEFINITION_TAGGING 6
 #define KRYPT_DEFINITION_DEFAULT 7
+#define KRYPT_DEFINITION_RAW 8
+#define KRYPT_DEFINITION_ENCAPSULATED 9
 
 void krypt_definition_init(krypt_asn1_definition *def, VALUE definition, VALUE options);
 
@@ -160,8 +244,7 @@ do {					\
 #define krypt_definition_set_definition(def, d)		((def)->definition = (d))
 #define krypt_definition_get_options(def)		((def)->options)
 #define krypt_definition_set_options(def, o)		((def)->options = (o))
-#define krypt_definition_get_matched_layout(def)	((def)->matched_layout)
-#define krypt_definition_set_matched_layout(def, i)	((def)->matched_layout = (i))
+#define krypt_definition_has_flag(def, f)		(((def)->flags & (f)) == (f))
 
 VALUE krypt_definition_get_name(krypt_asn1_definition *def);
 VALUE krypt_definition_get_type(krypt_asn1_definition *def);
@@ -171,13 +254,53 @@ VALUE krypt_definition_get_optional(krypt_asn1_definition *def);
 VALUE krypt_definition_get_tag(krypt_asn1_definition *def);
 VALUE krypt_definition_get_tagging(krypt_asn1_definition *def);
 VALUE krypt_definition_get_default_value(krypt_asn1_definition *def);
+VALUE krypt_definition_get_raw(krypt_asn1_definition *def);
+VALUE krypt_definition_get_encapsulated(krypt_asn1_definition *def);
 int krypt_definition_is_optional(krypt_asn1_definition *def);
 int krypt_definition_has_default(krypt_asn1_definition *def);
+krypt_asn1_definition *krypt_definition_compiled_for(VALUE klass, VALUE *compiled);
+krypt_asn1_definition *krypt_definition_type_def(krypt_asn1_definition *def);
+
+long krypt_definition_field_index(krypt_asn1_definition *root, ID name);
+long krypt_definition_method_index(krypt_asn1_definition *root, ID mid);
+
+krypt_asn1_field *krypt_asn1_template_field(krypt_asn1_template *t, long index);
+krypt_asn1_field *krypt_asn1_template_get_field(krypt_asn1_template *t, krypt_asn1_definition *def);
+krypt_asn1_field *krypt_asn1_template_peek_field(krypt_asn1_template *t, krypt_asn1_definition *def);
+void krypt_asn1_field_clear(krypt_asn1_field *field);
+int krypt_asn1_template_field_value(VALUE self, krypt_asn1_field *field, VALUE *out);
+int krypt_asn1_template_prepare(VALUE self, krypt_asn1_template *t);
+void krypt_asn1_template_assign(krypt_asn1_template *t, long index, VALUE value);
 
 int krypt_asn1_template_error_add(VALUE definition);
 int krypt_asn1_template_get_cb_value(VALUE self, ID ivname, VALUE *out);
 void krypt_asn1_template_set_cb_value(VALUE self, ID ivname, VALUE value);
 int krypt_asn1_template_encode(VALUE templ, VALUE *out);
+int krypt_asn1_template_encode_to(VALUE templ, binyo_outstream *out);
+
+/* SEQUENCE OF and SET OF values decoded with KRYPT_ASN1_DECODE_LAZY. The
+ * element offsets are indexed up front, elements are only decoded once they
+ * are accessed. */
+typedef struct krypt_asn1_collection_st {
+    VALUE owner; /* the template holding the field whose encoding bytes points into */
+    VALUE type;
+    int template_type;
+    int decode_flags;
+    uint8_t *bytes;
+    size_t *offsets; /* size + 1 entries, element i spans offsets[i]...offsets[i+1] */
+    long size;
+    VALUE cache; /* decoded elements by index, nil if caching is disabled */
+} krypt_asn1_collection;
+
+#define krypt_asn1_collection_get(obj, c)				\
+do { 									\
+    Data_Get_Struct((obj), krypt_asn1_collection, (c));			\
+    if (!(c)) { 							\
+	rb_raise(eKryptError, "Uninitialized krypt_asn1_collection");	\
+    } 									\
+} while (0)
+
+VALUE krypt_asn1_collection_to_a(VALUE self);
 
 void Init_krypt_asn1_template_parser(void);
 
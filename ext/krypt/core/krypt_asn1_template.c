@@ -33,17 +33,17 @@
 ID sKrypt_ID_OPTIONS, sKrypt_ID_NAME, sKrypt_ID_TYPE,
    sKrypt_ID_CODEC, sKrypt_ID_LAYOUT, sKrypt_ID_MIN_SIZE;
 
-ID sKrypt_ID_DEFAULT,  sKrypt_ID_OPTIONAL, sKrypt_ID_TAG, sKrypt_ID_TAGGING;
+ID sKrypt_ID_DEFAULT,  sKrypt_ID_OPTIONAL, sKrypt_ID_TAG, sKrypt_ID_TAGGING,
+   sKrypt_ID_RAW, sKrypt_ID_ENCAPSULATED;
    
 ID sKrypt_ID_PRIMITIVE, sKrypt_ID_SEQUENCE, sKrypt_ID_SET, sKrypt_ID_TEMPLATE,
    sKrypt_ID_SEQUENCE_OF, sKrypt_ID_SET_OF, sKrypt_ID_CHOICE, sKrypt_ID_ANY;
 
-ID sKrypt_IV_TYPE, sKrypt_IV_DEFINITION, sKrypt_IV_OPTIONS;
+ID sKrypt_IV_TYPE, sKrypt_IV_DEFINITION, sKrypt_IV_OPTIONS, sKrypt_IV_COMPILED_DEFINITION;
 
 ID sKrypt_ID_MERGE;
 
 VALUE mKryptASN1Template;
-VALUE cKryptASN1TemplateValue;
 
 void
 krypt_definition_init(krypt_asn1_definition *def, VALUE definition, VALUE options)
@@ -87,6 +87,8 @@ OPTIONS_GETTER(optional, KRYPT_DEFINITION_OPTIONAL)
 OPTIONS_GETTER(tag, KRYPT_DEFINITION_TAG)
 OPTIONS_GETTER(tagging, KRYPT_DEFINITION_TAGGING)
 OPTIONS_GETTER(default_value, KRYPT_DEFINITION_DEFAULT)
+OPTIONS_GETTER(raw, KRYPT_DEFINITION_RAW)
+OPTIONS_GETTER(encapsulated, KRYPT_DEFINITION_ENCAPSULATED)
 
 int 
 krypt_definition_is_optional(krypt_asn1_definition *def)
@@ -115,6 +117,13 @@ krypt_asn1_template_new(krypt_asn1_object *object, VALUE definition, VALUE optio
     ret->options = options;
     ret->value = Qnil;
     ret->flags = 0;
+    ret->decode_flags = 0;
+    ret->def = NULL;
+    ret->compiled = Qnil;
+    ret->owner = Qnil;
+    ret->only = Qnil;
+    ret->fields = NULL;
+    ret->num_fields = 0;
     return ret;
 }
 
@@ -130,32 +139,96 @@ krypt_asn1_template_new_from_stream(binyo_instream *in, krypt_asn1_header *heade
     return krypt_asn1_template_new(encoding, definition, options);
 }
 
-krypt_asn1_template *
-krypt_asn1_template_new_value(VALUE value)
+void
+krypt_asn1_field_clear(krypt_asn1_field *field)
 {
-    krypt_asn1_template *ret;
+    if (field->object) {
+	/* borrowed bytes are released with the template's own encoding */
+	if (field->flags & KRYPT_TEMPLATE_BORROWED)
+	    field->object->bytes = NULL;
+	krypt_asn1_object_free(field->object);
+    }
+    field->flags = 0;
+    field->unused_bits = 0;
+    field->object = NULL;
+    field->value = Qnil;
+    field->def = NULL;
+}
 
-    ret = krypt_asn1_template_new(NULL, Qnil, Qnil);
-    ret->value = value;
-    ret->flags = KRYPT_TEMPLATE_PARSED | KRYPT_TEMPLATE_DECODED;
-    return ret;
+/* Returns the field at +index+, the field array is grown as needed */
+krypt_asn1_field *
+krypt_asn1_template_field(krypt_asn1_template *t, long index)
+{
+    long i, num_fields;
+
+    if (index >= t->num_fields) {
+	num_fields = index + 1;
+	if (t->def && t->def->num_fields > num_fields)
+	    num_fields = t->def->num_fields;
+	REALLOC_N(t->fields, krypt_asn1_field, num_fields);
+	for (i=t->num_fields; i < num_fields; ++i) {
+	    t->fields[i].object = NULL;
+	    krypt_asn1_field_clear(&t->fields[i]);
+	}
+	t->num_fields = num_fields;
+    }
+    return &t->fields[index];
+}
+
+krypt_asn1_field *
+krypt_asn1_template_get_field(krypt_asn1_template *t, krypt_asn1_definition *def)
+{
+    if (def->field_index < 0) return NULL;
+    return krypt_asn1_template_field(t, def->field_index);
+}
+
+/* Returns the field of +def+ if it has a value, NULL otherwise */
+krypt_asn1_field *
+krypt_asn1_template_peek_field(krypt_asn1_template *t, krypt_asn1_definition *def)
+{
+    krypt_asn1_field *field;
+
+    if (def->field_index < 0 || def->field_index >= t->num_fields) return NULL;
+    field = &t->fields[def->field_index];
+    return field->flags ? field : NULL;
 }
 
 void
 krypt_asn1_template_free(krypt_asn1_template *template)
 {
+    long i;
+
     if (!template) return;
-    if (template->object)
+    if (template->fields) {
+	for (i=0; i < template->num_fields; ++i)
+	    krypt_asn1_field_clear(&template->fields[i]);
+	xfree(template->fields);
+    }
+    if (template->object) {
+	/* borrowed bytes are released by their owner */
+	if (!NIL_P(template->owner))
+	    template->object->bytes = NULL;
 	krypt_asn1_object_free(template->object);
+    }
     xfree(template);
 }
 
 void
 krypt_asn1_template_mark(krypt_asn1_template *template)
 {
+    long i;
+
     if (!template) return;
+    for (i=0; i < template->num_fields; ++i)
+	rb_gc_mark(template->fields[i].value);
     if (!NIL_P(template->value))
 	rb_gc_mark(template->value);
+    if (!NIL_P(template->compiled))
+	rb_gc_mark(template->compiled);
+    if (!NIL_P(template->owner))
+	rb_gc_mark(template->owner);
+    if (!NIL_P(template->only))
+	rb_gc_mark(template->only);
 }
 
 static VALUE
@@ -189,67 +262,6 @@ krypt_asn1_template_alloc(VALUE klass)
     return Data_Wrap_Struct(klass, krypt_asn1_template_mark, krypt_asn1_template_free, 0);
 }
 
-static VALUE
-int_traverse_template(VALUE vt, 
-		      VALUE name, 
-		      void (*traverse_cb) (VALUE, VALUE, void *), 
-		      void *args)
-{
-    ID codec;
-    VALUE vcodec, definition;
-    krypt_asn1_template *t;
-
-    traverse_cb(vt, name, args);
-
-    if (NIL_P(vt)) {
-	/* base case 1 */
-	return Qnil;
-    }
-
-    krypt_asn1_template_get(vt, t);
-
-    definition = krypt_asn1_template_get_definition(t);
-    if (NIL_P(definition)) {
-	/* base case 2 */
-	return Qnil;
-    }
-
-    get_or_raise(vcodec, krypt_hash_get_codec(definition), "No codec found in definition");
-    codec = SYM2ID(vcodec);
-    if (codec == sKrypt_ID_PRIMITIVE) {
-	/* base case 3 */
-	return Qnil;
-    }
-    if (codec == sKrypt_ID_ANY ||
-	codec == sKrypt_ID_CHOICE ||
-	codec == sKrypt_ID_SET_OF ||
-	codec == sKrypt_ID_SEQUENCE_OF) {
-	VALUE name = krypt_hash_get_name(definition);
-	VALUE value = rb_ivar_get(vt, sKrypt_IV_VALUE);
-	return int_traverse_template(value, name, traverse_cb, args);
-    }
-    if (codec == sKrypt_ID_SET || codec == sKrypt_ID_SEQUENCE) {
-	long i;
-	VALUE dummy = Qnil;
-	VALUE layout = krypt_hash_get_layout(definition);
-	for (i=0; i < RARRAY_LEN(layout); ++i) {
-	    VALUE name, value;
-	    VALUE cur_def = rb_ary_entry(layout, i);
-
-	    get_or_raise(name, krypt_hash_get_name(cur_def), "SEQ/SET value without name found");
-	    value = rb_ivar_get(vt, SYM2ID(name));
-	    dummy = int_traverse_template(value, name, traverse_cb, args);
-	}
-	return dummy;
-    }
-    if (codec == sKrypt_ID_TEMPLATE) {
-	return int_traverse_template(t->value, name, traverse_cb, args);
-    }
-
-    rb_raise(eKryptASN1Error, "Unknown codec encountered: %s", rb_id2name(codec));
-    return Qnil;
-}
-
 static VALUE
 krypt_asn1_template_mod_included_callback(VALUE self, VALUE klass)
 {
@@ -303,12 +315,294 @@ krypt_asn1_template_set_callback_choice(VALUE self, VALUE name, VALUE value)
 {
     ID ivname = SYM2ID(name);
 
-    if (ivname == sKrypt_IV_TAG || ivname == sKrypt_IV_TYPE)
+    if (ivname == sKrypt_IV_TAG || ivname == sKrypt_IV_TYPE) {
+	krypt_asn1_template *template;
+	(void) int_return_choice_attr(self, ivname); /* parse first */
+	krypt_asn1_template_get(self, template);
+	krypt_asn1_template_set_modified(template, 1);
 	return rb_ivar_set(self, ivname, value);
+    }
 
     return krypt_asn1_template_set_callback(self, name, value);
 }
 
+static ID sKrypt_ID_SET_TYPE, sKrypt_ID_SET_TAG;
+
+/* Methods defined by _define_accessors look up the field they belong to
+ * by the name they were called with, decoded values are returned without
+ * any further work. */
+static VALUE
+krypt_asn1_template_field_reader(VALUE self)
+{
+    krypt_asn1_template *template;
+    krypt_asn1_field *field;
+    ID mid = rb_frame_this_func();
+    long index;
+    VALUE ret;
+
+    krypt_asn1_template_get(self, template);
+    if (!template->def || !krypt_asn1_template_is_parsed(template)) {
+	if (krypt_asn1_template_prepare(self, template) == KRYPT_ERR)
+	    krypt_error_raise(eKryptASN1Error, "Could not access %s", rb_id2name(mid));
+    }
+    if ((index = krypt_definition_method_index(template->def, mid)) == -1) {
+	if (mid == sKrypt_ID_TYPE) return rb_attr_get(self, sKrypt_IV_TYPE);
+	if (mid == sKrypt_ID_TAG) return rb_attr_get(self, sKrypt_IV_TAG);
+	return Qnil;
+    }
+    if (index >= template->num_fields || !(field = &template->fields[index])->flags)
+	return Qnil;
+    if (field->flags & KRYPT_TEMPLATE_DECODED)
+	return field->value;
+    if (krypt_asn1_template_field_value(self, field, &ret) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Could not access %s", rb_id2name(mid));
+    return ret;
+}
+
+static VALUE
+krypt_asn1_template_field_writer(VALUE self, VALUE value)
+{
+    krypt_asn1_template *template;
+    ID mid = rb_frame_this_func();
+    long index;
+
+    krypt_asn1_template_get(self, template);
+    /* parse first, parsing later on would overwrite the new value */
+    if (krypt_asn1_template_prepare(self, template) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Could not access %s", rb_id2name(mid));
+    if ((index = krypt_definition_method_index(template->def, mid)) == -1) {
+	if (mid != sKrypt_ID_SET_TYPE && mid != sKrypt_ID_SET_TAG)
+	    rb_raise(eKryptASN1Error, "Unknown field %s", rb_id2name(mid));
+	krypt_asn1_template_set_modified(template, 1);
+	return rb_ivar_set(self, mid == sKrypt_ID_SET_TYPE ? sKrypt_IV_TYPE : sKrypt_IV_TAG, value);
+    }
+    krypt_asn1_template_assign(template, index, value);
+    return value;
+}
+
+static void
+int_define_accessors_for(VALUE klass, ID name)
+{
+    const char *str = rb_id2name(name);
+
+    if (*str == '@') str++;
+    rb_define_method_id(klass, rb_intern(str), krypt_asn1_template_field_reader, 0);
+    rb_define_method_id(klass, rb_intern_str(rb_sprintf("%s=", str)), krypt_asn1_template_field_writer, 1);
+}
+
+/* Raises unless +name+ (with or without '@') is a field of +def+ */
+static void
+int_check_accessor_name(krypt_asn1_definition *def, ID name)
+{
+    const char *str = rb_id2name(name);
+    ID ivname = name;
+
+    if (str && *str != '@') ivname = rb_intern_str(rb_sprintf("@%s", str));
+    if (krypt_definition_field_index(def, ivname) != -1) return;
+    if (def->codec == sKrypt_ID_CHOICE && (ivname == sKrypt_IV_TYPE || ivname == sKrypt_IV_TAG)) return;
+    rb_raise(eKryptASN1Error, "Unknown field %s", str ? str : "");
+}
+
+/*
+ * call-seq:
+ *    Krypt::ASN1::Template._define_accessors(klass, *names) -> nil
+ *
+ * Defines a reader and a writer for each of the fields +names+ (e.g.
+ * :@version) of +klass+. Without +names+, accessors are defined for all
+ * fields of the definition of +klass+, plus +type+ and +tag+ for a CHOICE.
+ */
+static VALUE
+krypt_asn1_template_define_accessors(int argc, VALUE *argv, VALUE self)
+{
+    VALUE klass, names, compiled;
+    krypt_asn1_definition *def;
+    long i;
+
+    rb_scan_args(argc, argv, "1*", &klass, &names);
+    if (!(def = krypt_definition_compiled_for(klass, &compiled)))
+	krypt_error_raise(eKryptASN1Error, "Could not compile definition of %s", rb_class2name(klass));
+    if (RARRAY_LEN(names) > 0) {
+	/* check all names first, so that no accessors are defined on error */
+	for (i=0; i < RARRAY_LEN(names); ++i)
+	    int_check_accessor_name(def, rb_to_id(rb_ary_entry(names, i)));
+	for (i=0; i < RARRAY_LEN(names); ++i)
+	    int_define_accessors_for(klass, rb_to_id(rb_ary_entry(names, i)));
+	RB_GC_GUARD(compiled);
+	return Qnil;
+    }
+
+    for (i=0; i < def->num_fields; ++i)
+	int_define_accessors_for(klass, def->field_names[i]);
+    if (def->codec == sKrypt_ID_CHOICE) {
+	int_define_accessors_for(klass, sKrypt_IV_TYPE);
+	int_define_accessors_for(klass, sKrypt_IV_TAG);
+    }
+    RB_GC_GUARD(compiled);
+    return Qnil;
+}
+
+static ID sKrypt_ID_DEEP, sKrypt_ID_JSON, sKrypt_ID_VALUE, sKrypt_ID_TAG_CLASS, sKrypt_ID_TO_A,
+	  sKrypt_ID_TO_I, sKrypt_ID_GETUTC, sKrypt_ID_STRFTIME;
+
+/* Integers beyond +-(2^53 - 1) lose precision as JSON numbers */
+#define INT_KRYPT_JSON_INT_MAX 9007199254740991L
+
+typedef struct krypt_to_h_ctx_st {
+    int deep;
+    int json;
+} krypt_to_h_ctx;
+
+static VALUE int_to_h_template(krypt_to_h_ctx *ctx, VALUE self);
+static VALUE int_to_h_value(krypt_to_h_ctx *ctx, VALUE value, int tag);
+
+/* OCTET STRINGs, BIT STRINGs and any other binary contents that are not
+ * plain ASCII are rendered as hex */
+static VALUE
+int_to_h_json_string(VALUE value, int tag)
+{
+    uint8_t *hex;
+    size_t hex_len;
+    VALUE ret;
+
+    if (rb_enc_get_index(value) != rb_ascii8bit_encindex()) return value;
+    if (tag != TAGS_OCTET_STRING && tag != TAGS_BIT_STRING && rb_enc_str_asciionly_p(value)) return value;
+    if (RSTRING_LEN(value) == 0) return rb_usascii_str_new(NULL, 0);
+    if (krypt_hex_encode((uint8_t *) RSTRING_PTR(value), RSTRING_LEN(value), &hex, &hex_len) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Could not convert value");
+    ret = rb_usascii_str_new((const char *) hex, hex_len);
+    xfree(hex);
+    return ret;
+}
+
+static VALUE
+int_to_h_json_integer(VALUE value)
+{
+    if (FIXNUM_P(value)) {
+	long num = FIX2LONG(value);
+	if (num <= INT_KRYPT_JSON_INT_MAX && num >= -INT_KRYPT_JSON_INT_MAX) return value;
+    }
+    return rb_funcall(value, rb_intern("to_s"), 0);
+}
+
+static VALUE
+int_to_h_array(krypt_to_h_ctx *ctx, VALUE ary, int tag)
+{
+    VALUE ret = rb_ary_new2(RARRAY_LEN(ary));
+    long i;
+
+    for (i=0; i < RARRAY_LEN(ary); ++i)
+	rb_ary_push(ret, int_to_h_value(ctx, rb_ary_entry(ary, i), tag));
+    return ret;
+}
+
+static VALUE
+int_to_h_asn1_data(krypt_to_h_ctx *ctx, VALUE value)
+{
+    int tag = -1;
+
+    if (rb_funcall(value, sKrypt_ID_TAG_CLASS, 0) == ID2SYM(sKrypt_TC_UNIVERSAL))
+	tag = NUM2INT(rb_funcall(value, sKrypt_ID_TAG, 0));
+    return int_to_h_value(ctx, rb_funcall(value, sKrypt_ID_VALUE, 0), tag);
+}
+
+/* Nested templates, collections and ASN1Data values are only converted
+ * with +deep+, +json+ applies to all of the values that are returned.
+ * +tag+ is the universal tag the value was decoded from, or -1. */
+static VALUE
+int_to_h_value(krypt_to_h_ctx *ctx, VALUE value, int tag)
+{
+    if (SPECIAL_CONST_P(value) && !FIXNUM_P(value)) return value;
+    if (rb_obj_is_kind_of(value, mKryptASN1Template))
+	return ctx->deep ? int_to_h_template(ctx, value) : value;
+    if (rb_obj_is_kind_of(value, cKryptASN1TemplateCollection))
+	return ctx->deep ? int_to_h_array(ctx, rb_funcall(value, sKrypt_ID_TO_A, 0), tag) : value;
+    if (rb_obj_is_kind_of(value, cKryptASN1Data))
+	return ctx->deep ? int_to_h_asn1_data(ctx, value) : value;
+    if (RB_TYPE_P(value, T_ARRAY))
+	return ctx->deep ? int_to_h_array(ctx, value, tag) : value;
+    if (!ctx->json) return value;
+
+    if (FIXNUM_P(value) || RB_TYPE_P(value, T_BIGNUM))
+	return int_to_h_json_integer(value);
+    if (krypt_asn1_is_raw_integer(value))
+	return int_to_h_json_integer(rb_funcall(value, sKrypt_ID_TO_I, 0));
+    if (RB_TYPE_P(value, T_STRING))
+	return int_to_h_json_string(value, tag);
+    if (rb_obj_is_kind_of(value, rb_cTime))
+	return rb_funcall(rb_funcall(value, sKrypt_ID_GETUTC, 0), sKrypt_ID_STRFTIME, 1, rb_str_new2("%Y-%m-%dT%H:%M:%SZ"));
+    return value;
+}
+
+/* Walks the fields of the compiled definition, each one is decoded once
+ * and cached in the template as if it had been accessed */
+static VALUE
+int_to_h_template(krypt_to_h_ctx *ctx, VALUE self)
+{
+    krypt_asn1_template *t;
+    krypt_asn1_definition *def, *field_def;
+    krypt_asn1_field *field;
+    VALUE hash, value;
+    long i;
+    int tag;
+
+    krypt_asn1_template_get(self, t);
+    if (krypt_asn1_template_prepare(self, t) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Could not convert %s", rb_obj_classname(self));
+    def = t->def;
+    hash = rb_hash_new_capa(def->num_fields + 1);
+    for (i=0; i < def->num_fields; ++i) {
+	value = Qnil;
+	tag = -1;
+	if (i < t->num_fields && (field = &t->fields[i])->flags) {
+	    /* SEQUENCE OF elements have the tag of their type, if it is known */
+	    if ((field_def = field->def))
+		tag = (field_def->codec == sKrypt_ID_PRIMITIVE) ? field_def->default_tag : field_def->element_tag;
+	    if (field->flags & KRYPT_TEMPLATE_DECODED)
+		value = field->value;
+	    else if (krypt_asn1_template_field_value(self, field, &value) == KRYPT_ERR)
+		krypt_error_raise(eKryptASN1Error, "Could not access %s", rb_id2name(def->field_names[i]));
+	}
+	rb_hash_aset(hash, ID2SYM(def->field_keys[i]), int_to_h_value(ctx, value, tag));
+    }
+    if (def->codec == sKrypt_ID_CHOICE)
+	rb_hash_aset(hash, ID2SYM(sKrypt_ID_TAG), rb_attr_get(self, sKrypt_IV_TAG));
+    return hash;
+}
+
+/*
+ * call-seq:
+ *    template.to_h([opts]) -> Hash
+ *
+ * Returns a Hash of the fields of the template, keyed by their names as
+ * Symbols (e.g. :version for @version). A CHOICE has its +value+ and the
+ * +tag+ that was chosen. Fields are decoded at most once, just as if they
+ * had been accessed.
+ *
+ * * +opts+:
+ *   * +:deep+: if true, nested templates are converted to Hashes as well,
+ *     SEQUENCE OF and SET OF values to Arrays and ASN1Data values to
+ *     their values
+ *   * +:json+: if true, values are returned in forms that JSON can
+ *     represent: Times as ISO 8601 UTC Strings, Integers beyond 2^53 - 1
+ *     as decimal Strings and binary Strings (e.g. OCTET STRINGs) as hex.
+ *     OBJECT IDENTIFIERs are already Strings in dotted notation.
+ */
+static VALUE
+krypt_asn1_template_to_h(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts = Qnil;
+    krypt_to_h_ctx ctx;
+
+    rb_scan_args(argc, argv, "01", &opts);
+    ctx.deep = ctx.json = 0;
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+	ctx.deep = RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_DEEP)));
+	ctx.json = RTEST(rb_hash_aref(opts, ID2SYM(sKrypt_ID_JSON)));
+    }
+    return int_to_h_template(&ctx, self);
+}
+
 VALUE
 krypt_asn1_template_cmp(VALUE self, VALUE other)
 {
@@ -327,61 +621,95 @@ krypt_asn1_template_cmp(VALUE self, VALUE other)
 }
 
 static void
-int_inspect_i(VALUE template_value, VALUE name, void *args)
+int_inspect_value(VALUE name, ID codec, int flags, krypt_asn1_object *object, VALUE value, VALUE definition, VALUE options)
 {
-    krypt_asn1_template *t;
-    krypt_asn1_object *object;
-    VALUE definition, codec, str;
+    VALUE str;
     ID puts = rb_intern("puts");
     ID to_s = rb_intern("to_s");
     VALUE yes = rb_str_new2("y"), no = rb_str_new2("n");
 
     str = rb_str_new2("Name: ");
     rb_str_append(str, rb_funcall(name, to_s, 0));
-    if (NIL_P(template_value)) {
-	rb_str_append(str, rb_str_new2(" @value"));
-	rb_funcall(rb_mKernel, puts, 1, str);
-	return;
-    }
-
-    krypt_asn1_template_get(template_value, t);
-
-    definition = krypt_asn1_template_get_definition(t);
-    codec = NIL_P(definition) ? rb_str_new2("") : krypt_hash_get_codec(definition);
-
     rb_str_append(str, rb_str_new2(" Codec: "));
-    rb_str_append(str, rb_funcall(codec, to_s, 0));
+    rb_str_append(str, codec ? rb_id2str(codec) : rb_str_new2(""));
     rb_str_append(str, rb_str_new2(" Parsed: "));
-    rb_str_append(str, krypt_asn1_template_is_parsed(t) ? yes : no);
+    rb_str_append(str, (flags & KRYPT_TEMPLATE_PARSED) ? yes : no);
     rb_str_append(str, rb_str_new2(" Decoded: "));
-    rb_str_append(str, krypt_asn1_template_is_decoded(t) ? yes : no);
+    rb_str_append(str, (flags & KRYPT_TEMPLATE_DECODED) ? yes : no);
     rb_str_append(str, rb_str_new2(" Modified: "));
-    rb_str_append(str, krypt_asn1_template_is_modified(t) ? yes : no);
+    rb_str_append(str, (flags & KRYPT_TEMPLATE_MODIFIED) ? yes : no);
     rb_str_append(str, rb_str_new2(" Object: "));
-    object = krypt_asn1_template_get_object(t);
     rb_str_append(str, object ? yes : no);
     rb_str_append(str, rb_str_new2(" Bytes: "));
     rb_str_append(str, (object && object->bytes) ? yes : no);
     rb_funcall(rb_mKernel, puts, 1, str);
 
     str = rb_str_new2("Value: ");
-    rb_str_append(str, rb_funcall(krypt_asn1_template_get_value(t), to_s, 0));
+    rb_str_append(str, rb_funcall(value, to_s, 0));
     rb_funcall(rb_mKernel, puts, 1, str);
 
     str = rb_str_new2("Definition: ");
-    rb_str_append(str, rb_funcall(krypt_asn1_template_get_definition(t), to_s, 0));
+    rb_str_append(str, rb_funcall(definition, to_s, 0));
     rb_funcall(rb_mKernel, puts, 1, str);
 
     str = rb_str_new2("Options: ");
-    rb_str_append(str, rb_funcall(krypt_asn1_template_get_options(t), to_s, 0));
+    rb_str_append(str, rb_funcall(options, to_s, 0));
     rb_funcall(rb_mKernel, puts, 1, str);
 }
 
+static void int_inspect_template(VALUE self, VALUE name);
+
+static void
+int_inspect_fields(krypt_asn1_template *t, krypt_asn1_definition *def)
+{
+    krypt_asn1_field *field;
+    VALUE name;
+    long i;
+
+    if (def->codec == sKrypt_ID_SEQUENCE || def->codec == sKrypt_ID_SET) {
+	for (i=0; i < def->layout_size; ++i)
+	    int_inspect_fields(t, def->layout[i]);
+	return;
+    }
+
+    name = ID2SYM(def->name);
+    if (!(field = krypt_asn1_template_peek_field(t, def))) {
+	if (def->codec != sKrypt_ID_CHOICE) {
+	    VALUE str = rb_str_new2("Name: ");
+	    rb_str_append(str, rb_sym_to_s(name));
+	    rb_str_append(str, rb_str_new2(" -"));
+	    rb_funcall(rb_mKernel, rb_intern("puts"), 1, str);
+	}
+	return;
+    }
+    if (def->codec == sKrypt_ID_CHOICE) def = field->def;
+    if (def->codec == sKrypt_ID_TEMPLATE && (field->flags & KRYPT_TEMPLATE_DECODED) &&
+	rb_obj_is_kind_of(field->value, mKryptASN1Template)) {
+	int_inspect_template(field->value, name);
+	return;
+    }
+    int_inspect_value(name, def->codec, field->flags, field->object, field->value, def->definition, def->options);
+}
+
+static void
+int_inspect_template(VALUE self, VALUE name)
+{
+    krypt_asn1_template *t;
+    VALUE codec;
+
+    krypt_asn1_template_get(self, t);
+    codec = NIL_P(t->definition) ? Qnil : krypt_hash_get_codec(t->definition);
+    int_inspect_value(name, NIL_P(codec) ? 0 : SYM2ID(codec), t->flags, t->object, t->value, t->definition, t->options);
+    if (t->def && krypt_asn1_template_is_parsed(t))
+	int_inspect_fields(t, t->def);
+}
+
+/* Prints the state of the template and its fields, for debugging */
 static VALUE
 krypt_asn1_template_inspect(VALUE self)
 {
-    VALUE name = rb_str_new2("ROOT");
-    return int_traverse_template(self, name, int_inspect_i, NULL);
+    int_inspect_template(self, rb_str_new2("ROOT"));
+    return Qnil;
 }
 
 /*
@@ -400,15 +728,44 @@ krypt_asn1_template_to_der(VALUE template)
     return ret;
 }
 
+typedef struct int_encode_to_args_st {
+    VALUE self;
+    binyo_outstream *out;
+} int_encode_to_args;
+
 static VALUE
-krypt_asn1_template_value_to_s(VALUE self)
+int_template_encode_to_i(VALUE args)
 {
-    krypt_asn1_template *template;
+    int_encode_to_args *a = (int_encode_to_args *) args;
+    return INT2FIX(krypt_asn1_template_encode_to(a->self, a->out));
+}
 
-    krypt_asn1_template_get(self, template);
-    if (NIL_P(template->value))
-	return rb_str_new2("");
-    return rb_funcall(template->value, rb_intern("to_s"), 0);
+/*
+ * call-seq:
+ *    asn1.encode_to(io) -> self
+ *
+ * * +io+: an IO-like object supporting IO#write
+ *
+ * Behaves the same way that Krypt::ASN1#encode_to does. Values that were
+ * parsed and not modified since are written as they were parsed, all
+ * others are DER-encoded.
+ */
+static VALUE
+krypt_asn1_template_encode_to_io(VALUE self, VALUE io)
+{
+    int_encode_to_args args;
+    VALUE result;
+    int state = 0;
+
+    args.self = self;
+    args.out = binyo_outstream_new_value(io);
+    /* io.write may raise, the stream is freed before the error propagates */
+    result = rb_protect(int_template_encode_to_i, (VALUE) &args, &state);
+    binyo_outstream_free(args.out);
+    if (state) rb_jump_tag(state);
+    if (FIX2INT(result) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Error while encoding value");
+    return self;
 }
 
 void
@@ -424,6 +781,8 @@ Init_krypt_asn1_template(void)
     sKrypt_ID_TAGGING = rb_intern("tagging");
     sKrypt_ID_LAYOUT = rb_intern("layout");
     sKrypt_ID_MIN_SIZE = rb_intern("min_size");
+    sKrypt_ID_RAW = rb_intern("raw");
+    sKrypt_ID_ENCAPSULATED = rb_intern("encapsulated");
 
     sKrypt_ID_PRIMITIVE = rb_intern("PRIMITIVE");
     sKrypt_ID_SEQUENCE = rb_intern("SEQUENCE");
@@ -437,22 +796,34 @@ Init_krypt_asn1_template(void)
     sKrypt_IV_TYPE = rb_intern("@type");
     sKrypt_IV_DEFINITION = rb_intern("@definition");
     sKrypt_IV_OPTIONS = rb_intern("@options");
+    /* no '@', hidden from Ruby */
+    sKrypt_IV_COMPILED_DEFINITION = rb_intern("__compiled_definition__");
 
     sKrypt_ID_MERGE = rb_intern("merge");
+    sKrypt_ID_SET_TYPE = rb_intern("type=");
+    sKrypt_ID_SET_TAG = rb_intern("tag=");
+    sKrypt_ID_DEEP = rb_intern("deep");
+    sKrypt_ID_JSON = rb_intern("json");
+    sKrypt_ID_VALUE = rb_intern("value");
+    sKrypt_ID_TAG_CLASS = rb_intern("tag_class");
+    sKrypt_ID_TO_A = rb_intern("to_a");
+    sKrypt_ID_TO_I = rb_intern("to_i");
+    sKrypt_ID_GETUTC = rb_intern("getutc");
+    sKrypt_ID_STRFTIME = rb_intern("strftime");
 
     mKryptASN1Template = rb_define_module_under(mKryptASN1, "Template");
     rb_define_module_function(mKryptASN1Template, "_mod_included_callback", krypt_asn1_template_mod_included_callback, 1);
+    rb_define_module_function(mKryptASN1Template, "_define_accessors", krypt_asn1_template_define_accessors, -1);
     rb_define_method(mKryptASN1Template, "initialize", krypt_asn1_template_initialize, 0);
     rb_define_method(mKryptASN1Template, "_get_callback", krypt_asn1_template_get_callback, 1);
     rb_define_method(mKryptASN1Template, "_set_callback", krypt_asn1_template_set_callback, 2);
     rb_define_method(mKryptASN1Template, "_get_callback_choice", krypt_asn1_template_get_callback_choice, 1);
     rb_define_method(mKryptASN1Template, "_set_callback_choice", krypt_asn1_template_set_callback_choice, 2);
     rb_define_method(mKryptASN1Template, "to_der", krypt_asn1_template_to_der, 0);
+    rb_define_method(mKryptASN1Template, "encode_to", krypt_asn1_template_encode_to_io, 1);
     rb_define_method(mKryptASN1Template, "<=>", krypt_asn1_template_cmp, 1);
     rb_define_method(mKryptASN1Template, "__inspect__", krypt_asn1_template_inspect, 0);
-
-    cKryptASN1TemplateValue = rb_define_class_under(mKryptASN1Template, "Value", rb_cObject);
-    rb_define_method(cKryptASN1TemplateValue, "to_s", krypt_asn1_template_value_to_s, 0);
+    rb_define_method(mKryptASN1Template, "to_h", krypt_asn1_template_to_h, -1);
 
     Init_krypt_asn1_template_parser();
 }
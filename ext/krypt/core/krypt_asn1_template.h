@@ -47,7 +47,7 @@ extern ID sKrypt_ID_MERGE;
 
 extern VALUE mKryptASN1Template;
 
-VALUE krypt_asn1_template_parse_der(VALUE klass, VALUE der);
+VALUE krypt_asn1_template_parse_der(int argc, VALUE *argv, VALUE klass);
 VALUE krypt_asn1_template_to_der(VALUE templ);
 
 void Init_krypt_asn1_template(void);
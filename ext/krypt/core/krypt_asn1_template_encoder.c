@@ -30,47 +30,824 @@
 #include "krypt_asn1-internal.h"
 #include "krypt_asn1_template-internal.h"
 
-int
-int_template_encode_non_cached(VALUE self, krypt_asn1_template *template, VALUE *out)
+/* Encoding a template happens in two passes. The first one walks the
+ * compiled definition and builds a tree of nodes, encoding primitive
+ * contents and computing the length of every node bottom-up. Values that
+ * were parsed and not modified since refer to their cached encoding.
+ * The second pass writes the headers and contents of all nodes straight
+ * to the output, nothing is encoded to temporary buffers in between. */
+typedef struct krypt_template_enc_node_st {
+    int tag;
+    int tag_class;
+    int is_constructed;
+    krypt_asn1_object *object;	/* cached encoding, written as is */
+    uint8_t *bytes;		/* primitive contents, complete encoding if is_tlv */
+    size_t bytes_len;
+    int is_tlv;
+    size_t length;		/* length of the contents */
+    size_t total;		/* length of the complete encoding */
+    long num_children;
+    struct krypt_template_enc_node_st *first_child;
+    struct krypt_template_enc_node_st *last_child;
+    struct krypt_template_enc_node_st *next;
+    struct krypt_template_enc_node_st *all_next;
+} krypt_template_enc_node;
+
+typedef struct krypt_template_enc_ctx_st {
+    krypt_template_enc_node *all;
+} krypt_template_enc_ctx;
+
+static int int_plan_value(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out);
+static int int_plan_template(krypt_template_enc_ctx *ctx, VALUE instance, krypt_asn1_definition *def, krypt_template_enc_node **out);
+static int int_template_is_dirty(VALUE self, krypt_asn1_definition *def);
+
+static krypt_template_enc_node *
+int_node_new(krypt_template_enc_ctx *ctx, int tag, int tag_class, int is_constructed)
 {
-    return KRYPT_ERR;
+    krypt_template_enc_node *node;
+
+    node = ALLOC(krypt_template_enc_node);
+    memset(node, 0, sizeof(krypt_template_enc_node));
+    node->tag = tag;
+    node->tag_class = tag_class;
+    node->is_constructed = is_constructed;
+    node->all_next = ctx->all;
+    ctx->all = node;
+    return node;
 }
 
-int
-int_template_encode_cached(krypt_asn1_object *object, VALUE *value)
+static void
+int_ctx_cleanup(krypt_template_enc_ctx *ctx)
+{
+    krypt_template_enc_node *cur = ctx->all, *next;
+
+    while (cur) {
+	next = cur->all_next;
+	if (cur->bytes) xfree(cur->bytes);
+	xfree(cur);
+	cur = next;
+    }
+    ctx->all = NULL;
+}
+
+static size_t
+int_header_len(int tag, size_t length)
+{
+    size_t len = 2;
+
+    if (tag >= 31) {
+	do { len++; tag >>= 7; } while (tag);
+    }
+    if (length >= 0x80) {
+	do { len++; length >>= 8; } while (length);
+    }
+    return len;
+}
+
+static void
+int_node_set_length(krypt_template_enc_node *node, size_t length)
+{
+    node->length = length;
+    node->total = int_header_len(node->tag, length) + length;
+}
+
+static void
+int_node_add_child(krypt_template_enc_node *node, krypt_template_enc_node *child)
+{
+    if (!child) return;
+    if (node->last_child)
+	node->last_child->next = child;
+    else
+	node->first_child = child;
+    node->last_child = child;
+    node->num_children++;
+}
+
+static void
+int_node_finish_cons(krypt_template_enc_node *node)
+{
+    krypt_template_enc_node *cur;
+    size_t length = 0;
+
+    for (cur = node->first_child; cur; cur = cur->next)
+	length += cur->total;
+    int_node_set_length(node, length);
+}
+
+static krypt_template_enc_node *
+int_node_new_cached(krypt_template_enc_ctx *ctx, krypt_asn1_object *object)
+{
+    krypt_template_enc_node *node;
+    krypt_asn1_header *header = object->header;
+
+    node = int_node_new(ctx, header->tag, header->tag_class, header->is_constructed);
+    node->object = object;
+    node->total = header->tag_len + header->length_len + object->bytes_len;
+    return node;
+}
+
+static krypt_template_enc_node *
+int_node_new_der(krypt_template_enc_ctx *ctx, VALUE der)
+{
+    krypt_template_enc_node *node;
+    uint8_t *p = (uint8_t *) RSTRING_PTR(der);
+    size_t len = (size_t) RSTRING_LEN(der);
+
+    node = int_node_new(ctx, len ? (p[0] & COMPLEX_TAG_MASK) : 0, len ? (p[0] & TAG_CLASS_PRIVATE) : 0, 0);
+    node->bytes = ALLOC_N(uint8_t, len ? len : 1);
+    memcpy(node->bytes, p, len);
+    node->bytes_len = len;
+    node->is_tlv = 1;
+    node->total = len;
+    return node;
+}
+
+/* Wraps +inner+ in the EXPLICIT tag of +def+, if any */
+static krypt_template_enc_node *
+int_node_tag(krypt_template_enc_ctx *ctx, krypt_asn1_definition *def, krypt_template_enc_node *inner)
+{
+    krypt_template_enc_node *outer;
+
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_EXPLICIT)) return inner;
+    outer = int_node_new(ctx, def->expected_tag, def->expected_tag_class, 1);
+    int_node_add_child(outer, inner);
+    int_node_finish_cons(outer);
+    return outer;
+}
+
+/* The tag and tag class of the value itself, the inner one for EXPLICIT tagging */
+static void
+int_value_tag(krypt_asn1_definition *def, int *tag, int *tag_class)
+{
+    if (def->expected_tag == -1 || krypt_definition_has_flag(def, KRYPT_DEFINITION_F_EXPLICIT)) {
+	*tag = def->default_tag;
+	*tag_class = TAG_CLASS_UNIVERSAL;
+    }
+    else {
+	*tag = def->expected_tag;
+	*tag_class = def->expected_tag_class;
+    }
+}
+
+static int
+int_has_cached_encoding(krypt_asn1_object *object)
+{
+    return object && (object->bytes || object->bytes_len == 0)
+		   && object->header->tag_bytes && object->header->length_bytes;
+}
+
+static int
+int_write_header(binyo_outstream *out, krypt_template_enc_node *node)
+{
+    uint8_t buf[2 + 2 * sizeof(size_t) + sizeof(int)];
+    size_t i = 0, length = node->length;
+    uint8_t b = (uint8_t) node->tag_class;
+
+    if (node->is_constructed) b |= CONSTRUCTED_MASK;
+    if (node->tag < 31) {
+	buf[i++] = b | (uint8_t) node->tag;
+    }
+    else {
+	int tag = node->tag, shift = 0;
+	buf[i++] = b | COMPLEX_TAG_MASK;
+	while (tag >> (shift + 7)) shift += 7;
+	for (; shift > 0; shift -= 7)
+	    buf[i++] = 0x80 | ((tag >> shift) & 0x7f);
+	buf[i++] = tag & 0x7f;
+    }
+    if (length < 0x80) {
+	buf[i++] = (uint8_t) length;
+    }
+    else {
+	int num = 0, j;
+	size_t l = length;
+	while (l) { num++; l >>= 8; }
+	buf[i++] = INFINITE_LENGTH_MASK | (uint8_t) num;
+	for (j = num - 1; j >= 0; j--)
+	    buf[i++] = (uint8_t) (length >> (j * 8));
+    }
+    if (binyo_outstream_write(out, buf, i) == BINYO_ERR) return KRYPT_ERR;
+    return KRYPT_OK;
+}
+
+static int
+int_node_write(binyo_outstream *out, krypt_template_enc_node *node)
+{
+    krypt_template_enc_node *cur;
+
+    if (node->object)
+	return krypt_asn1_object_encode(out, node->object);
+    if (node->is_tlv) {
+	if (node->bytes_len && binyo_outstream_write(out, node->bytes, node->bytes_len) == BINYO_ERR) return KRYPT_ERR;
+	return KRYPT_OK;
+    }
+    if (int_write_header(out, node) == KRYPT_ERR) return KRYPT_ERR;
+    if (!node->is_constructed) {
+	if (node->bytes_len && binyo_outstream_write(out, node->bytes, node->bytes_len) == BINYO_ERR) return KRYPT_ERR;
+	return KRYPT_OK;
+    }
+    for (cur = node->first_child; cur; cur = cur->next) {
+	if (int_node_write(out, cur) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+/* Turns +node+ into its complete encoding, needed for SET OF ordering */
+static int
+int_node_materialize(krypt_template_enc_node *node)
 {
     binyo_outstream *out;
     uint8_t *bytes;
-    size_t len;
     int ret;
 
-    len = object->header->tag_len + object->header->length_len + object->bytes_len;
-    bytes = ALLOCA_N(uint8_t, len);
-    out = binyo_outstream_new_bytes_prealloc(bytes, len);
-
-    ret = krypt_asn1_object_encode(out, object);
+    if (node->is_tlv) return KRYPT_OK;
+    bytes = ALLOC_N(uint8_t, node->total ? node->total : 1);
+    out = binyo_outstream_new_bytes_prealloc(bytes, node->total);
+    ret = int_node_write(out, node);
     binyo_outstream_free(out);
-    if (ret == KRYPT_ERR) return KRYPT_ERR;
-    *value = rb_str_new((const char *) bytes, len);
+    if (ret == KRYPT_ERR) {
+	xfree(bytes);
+	return KRYPT_ERR;
+    }
+    if (node->bytes) xfree(node->bytes);
+    node->bytes = bytes;
+    node->bytes_len = node->total;
+    node->is_tlv = 1;
+    node->object = NULL;
+    node->first_child = node->last_child = NULL;
     return KRYPT_OK;
 }
 
-int
-krypt_asn1_template_encode(VALUE self, VALUE *out)
+static uint8_t *
+int_node_bytes(krypt_template_enc_node *node, size_t *len)
+{
+    *len = node->bytes_len;
+    return node->bytes;
+}
+
+static int
+int_node_cmp_set(const void *a, const void *b)
+{
+    const krypt_template_enc_node *x = *(krypt_template_enc_node * const *) a;
+    const krypt_template_enc_node *y = *(krypt_template_enc_node * const *) b;
+
+    if (x->tag_class != y->tag_class) return x->tag_class < y->tag_class ? -1 : 1;
+    if (x->tag != y->tag) return x->tag < y->tag ? -1 : 1;
+    return 0;
+}
+
+static int
+int_node_cmp_set_of(const void *a, const void *b)
+{
+    krypt_template_enc_node *x = *(krypt_template_enc_node **) a;
+    krypt_template_enc_node *y = *(krypt_template_enc_node **) b;
+    uint8_t *p1, *p2;
+    size_t l1, l2;
+    int result = 0;
+
+    p1 = int_node_bytes(x, &l1);
+    p2 = int_node_bytes(y, &l2);
+    (void) krypt_asn1_cmp_set_of(p1, l1, p2, l2, &result);
+    return result;
+}
+
+/* DER: the components of a SET are ordered by tag, those of a SET OF by
+ * their encoding */
+static int
+int_node_sort(krypt_template_enc_node *node, int set_of)
+{
+    krypt_template_enc_node **nodes, *cur;
+    long i, n = node->num_children;
+
+    if (n < 2) return KRYPT_OK;
+    nodes = ALLOC_N(krypt_template_enc_node *, n);
+    for (i = 0, cur = node->first_child; cur; cur = cur->next, ++i) {
+	if (set_of && int_node_materialize(cur) == KRYPT_ERR) {
+	    xfree(nodes);
+	    return KRYPT_ERR;
+	}
+	nodes[i] = cur;
+    }
+    qsort(nodes, n, sizeof(krypt_template_enc_node *), set_of ? int_node_cmp_set_of : int_node_cmp_set);
+    node->first_child = nodes[0];
+    for (i = 0; i < n - 1; ++i)
+	nodes[i]->next = nodes[i + 1];
+    nodes[n - 1]->next = NULL;
+    node->last_child = nodes[n - 1];
+    xfree(nodes);
+    return KRYPT_OK;
+}
+
+/* Returns the field of +def+ in +self+, NULL if it has no value */
+static krypt_asn1_field *
+int_field_get(VALUE self, krypt_asn1_definition *def)
+{
+    krypt_asn1_template *t;
+
+    krypt_asn1_template_get(self, t);
+    return krypt_asn1_template_peek_field(t, def);
+}
+
+static int
+int_missing_value(krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
+	krypt_error_add("Mandatory value %s is missing", rb_id2name(def->name));
+	return KRYPT_ERR;
+    }
+    *out = NULL;
+    return KRYPT_OK;
+}
+
+/* DER: values equal to their DEFAULT are omitted */
+static int
+int_is_default_value(krypt_asn1_definition *def, VALUE value)
+{
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_HAS_DEFAULT)) return 0;
+    return RTEST(rb_equal(krypt_definition_get_default_value(def), value));
+}
+
+static int
+int_encode_encapsulated(krypt_asn1_definition *def, VALUE value, uint8_t **out, size_t *outlen)
+{
+    VALUE der = krypt_to_der(value);
+    size_t len = (size_t) RSTRING_LEN(der), off = 0;
+    uint8_t *bytes;
+
+    if (def->default_tag == TAGS_BIT_STRING) off = 1; /* no unused bits */
+    bytes = ALLOC_N(uint8_t, len + off);
+    if (off) bytes[0] = 0x00;
+    memcpy(bytes + off, RSTRING_PTR(der), len);
+    *out = bytes;
+    *outlen = len + off;
+    return KRYPT_OK;
+}
+
+static int
+int_plan_prim(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    VALUE value;
+    krypt_asn1_field *field;
+    krypt_asn1_codec *codec;
+    krypt_template_enc_node *node;
+    int tag, tag_class;
+
+    if (!(field = int_field_get(self, def))) return int_missing_value(def, out);
+    if (!(field->flags & KRYPT_TEMPLATE_MODIFIED) && int_has_cached_encoding(field->object)) {
+	*out = int_node_new_cached(ctx, field->object);
+	return KRYPT_OK;
+    }
+    value = field->value;
+    if (NIL_P(value) && def->default_tag != TAGS_NULL) return int_missing_value(def, out);
+    if (int_is_default_value(def, value)) {
+	*out = NULL;
+	return KRYPT_OK;
+    }
+
+    int_value_tag(def, &tag, &tag_class);
+    node = int_node_new(ctx, tag, tag_class, 0);
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_ENCAPSULATED) && !RB_TYPE_P(value, T_STRING)) {
+	if (int_encode_encapsulated(def, value, &node->bytes, &node->bytes_len) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    else {
+	if (!(codec = krypt_asn1_codec_for(TAG_CLASS_UNIVERSAL, def->default_tag))) {
+	    krypt_error_add("No codec available for default tag %d", def->default_tag);
+	    return KRYPT_ERR;
+	}
+	if (krypt_asn1_codec_validate(codec, self, value) == KRYPT_ERR) goto error;
+	if (codec == &krypt_asn1_codecs[TAGS_BIT_STRING]) {
+	    /* the unused bits are kept in the field, not in +self+ */
+	    if (krypt_asn1_encode_bit_string(field->unused_bits, value, &node->bytes, &node->bytes_len) == KRYPT_ERR) goto error;
+	}
+	else if (krypt_asn1_codec_encode(codec, self, value, &node->bytes, &node->bytes_len) == KRYPT_ERR) goto error;
+    }
+    int_node_set_length(node, node->bytes_len);
+    *out = int_node_tag(ctx, def, node);
+    return KRYPT_OK;
+
+error:
+    krypt_error_add("Error while encoding value %s", rb_id2name(def->name));
+    return KRYPT_ERR;
+}
+
+static int
+int_plan_cons(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    krypt_template_enc_node *node, *child;
+    int tag, tag_class;
+    long i;
+
+    int_value_tag(def, &tag, &tag_class);
+    node = int_node_new(ctx, tag, tag_class, 1);
+    for (i=0; i < def->layout_size; ++i) {
+	if (int_plan_value(ctx, self, def->layout[i], &child) == KRYPT_ERR) return KRYPT_ERR;
+	int_node_add_child(node, child);
+    }
+    if (def->codec == sKrypt_ID_SET && int_node_sort(node, 0) == KRYPT_ERR) return KRYPT_ERR;
+    int_node_finish_cons(node);
+    *out = int_node_tag(ctx, def, node);
+    return KRYPT_OK;
+}
+
+static krypt_asn1_definition *
+int_element_definition(VALUE element)
+{
+    krypt_asn1_template *t;
+    VALUE dummy;
+
+    krypt_asn1_template_get(element, t);
+    if (t->def) return t->def;
+    return krypt_definition_compiled_for(CLASS_OF(element), &dummy);
+}
+
+/* Elements of a lazily decoded collection are independent of its encoding
+ * unless they were cached, cached templates may have been modified */
+static int
+int_collection_is_dirty(VALUE value)
+{
+    krypt_asn1_collection *c;
+    krypt_asn1_definition *cur_def;
+    VALUE cur;
+    long i;
+
+    /* a frozen Array of plain elements can't have changed */
+    if (RB_TYPE_P(value, T_ARRAY) && OBJ_FROZEN(value)) return 0;
+    if (!rb_obj_is_kind_of(value, cKryptASN1TemplateCollection)) return 1;
+    krypt_asn1_collection_get(value, c);
+    if (NIL_P(c->cache)) return 0;
+    for (i=0; i < RARRAY_LEN(c->cache); ++i) {
+	cur = rb_ary_entry(c->cache, i);
+	if (NIL_P(cur)) continue;
+	if (!rb_obj_is_kind_of(cur, mKryptASN1Template)) return 1;
+	if (!(cur_def = int_element_definition(cur))) {
+	    krypt_error_clear();
+	    return 1;
+	}
+	if (int_template_is_dirty(cur, cur_def)) return 1;
+    }
+    return 0;
+}
+
+/* Elements decoded with KRYPT_ASN1_DECODE_PLAIN are plain Ruby values,
+ * they are encoded with the codec of the element type */
+static int
+int_plan_plain_element(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, VALUE value, krypt_template_enc_node **out)
+{
+    krypt_asn1_codec *codec;
+    krypt_template_enc_node *node;
+
+    if (!(codec = krypt_asn1_codec_for(TAG_CLASS_UNIVERSAL, def->element_tag))) {
+	krypt_error_add("No codec available for default tag %d", def->element_tag);
+	return KRYPT_ERR;
+    }
+    node = int_node_new(ctx, def->element_tag, TAG_CLASS_UNIVERSAL, 0);
+    if (krypt_asn1_codec_validate(codec, self, value) == KRYPT_ERR ||
+	krypt_asn1_codec_encode(codec, self, value, &node->bytes, &node->bytes_len) == KRYPT_ERR) {
+	krypt_error_add("Error while encoding an element of %s", rb_id2name(def->name));
+	return KRYPT_ERR;
+    }
+    int_node_set_length(node, node->bytes_len);
+    *out = node;
+    return KRYPT_OK;
+}
+
+static int
+int_plan_cons_of(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    VALUE value;
+    krypt_asn1_field *field;
+    krypt_template_enc_node *node, *child;
+    int tag, tag_class;
+    long i;
+
+    if (!(field = int_field_get(self, def))) return int_missing_value(def, out);
+    if (!(field->flags & KRYPT_TEMPLATE_MODIFIED) && 
+	(!(field->flags & KRYPT_TEMPLATE_DECODED) || !int_collection_is_dirty(field->value)) && 
+	int_has_cached_encoding(field->object)) {
+	*out = int_node_new_cached(ctx, field->object);
+	return KRYPT_OK;
+    }
+    value = field->value;
+    if (NIL_P(value)) return int_missing_value(def, out);
+    if (int_is_default_value(def, value)) {
+	*out = NULL;
+	return KRYPT_OK;
+    }
+    if (rb_obj_is_kind_of(value, cKryptASN1TemplateCollection))
+	value = krypt_asn1_collection_to_a(value);
+    Check_Type(value, T_ARRAY);
+
+    int_value_tag(def, &tag, &tag_class);
+    node = int_node_new(ctx, tag, tag_class, 1);
+    for (i=0; i < RARRAY_LEN(value); ++i) {
+	VALUE cur = rb_ary_entry(value, i);
+	if (rb_obj_is_kind_of(cur, mKryptASN1Template)) {
+	    krypt_asn1_definition *cur_def;
+	    if (!(cur_def = int_element_definition(cur))) return KRYPT_ERR;
+	    if (int_plan_template(ctx, cur, cur_def, &child) == KRYPT_ERR) return KRYPT_ERR;
+	}
+	else if (def->element_tag != -1 && !rb_obj_is_kind_of(cur, cKryptASN1Data)) {
+	    if (int_plan_plain_element(ctx, self, def, cur, &child) == KRYPT_ERR) return KRYPT_ERR;
+	}
+	else {
+	    child = int_node_new_der(ctx, krypt_to_der(cur));
+	}
+	int_node_add_child(node, child);
+    }
+    if (def->codec == sKrypt_ID_SET_OF && int_node_sort(node, 1) == KRYPT_ERR) return KRYPT_ERR;
+    int_node_finish_cons(node);
+    *out = int_node_tag(ctx, def, node);
+    return KRYPT_OK;
+}
+
+static int
+int_plan_any(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    krypt_asn1_field *field;
+
+    if (!(field = int_field_get(self, def))) return int_missing_value(def, out);
+    if (!(field->flags & (KRYPT_TEMPLATE_MODIFIED | KRYPT_TEMPLATE_DECODED)) && int_has_cached_encoding(field->object)) {
+	*out = int_node_new_cached(ctx, field->object);
+	return KRYPT_OK;
+    }
+    if (NIL_P(field->value)) return int_missing_value(def, out);
+    if (int_is_default_value(def, field->value)) {
+	*out = NULL;
+	return KRYPT_OK;
+    }
+    *out = int_node_tag(ctx, def, int_node_new_der(ctx, krypt_to_der(field->value)));
+    return KRYPT_OK;
+}
+
+/* The cached encoding of a parsed value can only be used where it
+ * carries the tag +def+ expects, it may have been assigned from elsewhere */
+static int
+int_cached_matches(krypt_asn1_object *object, krypt_asn1_definition *def)
+{
+    if (def->expected_tag == -1) return 1;
+    return object->header->tag == def->expected_tag && object->header->tag_class == def->expected_tag_class;
+}
+
+static int
+int_plan_template_value(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    VALUE value;
+    krypt_asn1_field *field;
+    krypt_asn1_definition *type_def;
+
+    if (!(field = int_field_get(self, def))) return int_missing_value(def, out);
+    if (!(type_def = krypt_definition_type_def(def))) return KRYPT_ERR;
+    /* templates that were never accessed are written as they were parsed */
+    if (!(field->flags & KRYPT_TEMPLATE_DECODED) &&
+	int_has_cached_encoding(field->object) &&
+	int_cached_matches(field->object, type_def)) {
+	*out = int_node_new_cached(ctx, field->object);
+	return KRYPT_OK;
+    }
+    if (krypt_asn1_template_field_value(self, field, &value) == KRYPT_ERR) return KRYPT_ERR;
+    if (NIL_P(value)) return int_missing_value(def, out);
+    if (int_is_default_value(def, value)) {
+	*out = NULL;
+	return KRYPT_OK;
+    }
+    if (!rb_obj_is_kind_of(value, mKryptASN1Template)) {
+	krypt_error_add("Value %s is not a template", rb_id2name(def->name));
+	return KRYPT_ERR;
+    }
+    return int_plan_template(ctx, value, type_def, out);
+}
+
+/* Finds the alternative of a CHOICE that matches its @type and @tag */
+static krypt_asn1_definition *
+int_choice_alternative(VALUE self, krypt_asn1_definition *def)
+{
+    VALUE type = rb_attr_get(self, sKrypt_IV_TYPE);
+    VALUE vtag = rb_attr_get(self, sKrypt_IV_TAG);
+    long i;
+
+    for (i=0; i < def->layout_size; ++i) {
+	krypt_asn1_definition *alt = def->layout[i];
+	if (!RTEST(rb_equal(krypt_definition_get_type(alt), type))) continue;
+	if (NIL_P(vtag) || alt->expected_tag == -1 || alt->expected_tag == NUM2INT(vtag))
+	    return alt;
+    }
+    krypt_error_add("No CHOICE alternative matches the value's type and tag");
+    return NULL;
+}
+
+static int
+int_plan_choice(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    krypt_asn1_definition *alt;
+    krypt_template_enc_node *node;
+
+    if (!int_field_get(self, def)) return int_missing_value(def, out);
+    if (!(alt = int_choice_alternative(self, def))) return KRYPT_ERR;
+    if (int_plan_value(ctx, self, alt, &node) == KRYPT_ERR) return KRYPT_ERR;
+    if (!node) return int_missing_value(def, out);
+    *out = int_node_tag(ctx, def, node);
+    return KRYPT_OK;
+}
+
+static int
+int_plan_value(krypt_template_enc_ctx *ctx, VALUE self, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    ID codec = def->codec;
+
+    if (codec == sKrypt_ID_PRIMITIVE)
+	return int_plan_prim(ctx, self, def, out);
+    else if (codec == sKrypt_ID_SEQUENCE || codec == sKrypt_ID_SET)
+	return int_plan_cons(ctx, self, def, out);
+    else if (codec == sKrypt_ID_SEQUENCE_OF || codec == sKrypt_ID_SET_OF)
+	return int_plan_cons_of(ctx, self, def, out);
+    else if (codec == sKrypt_ID_TEMPLATE)
+	return int_plan_template_value(ctx, self, def, out);
+    else if (codec == sKrypt_ID_ANY)
+	return int_plan_any(ctx, self, def, out);
+    else if (codec == sKrypt_ID_CHOICE)
+	return int_plan_choice(ctx, self, def, out);
+
+    krypt_error_add("Unknown codec: %s", rb_id2name(codec));
+    return KRYPT_ERR;
+}
+
+static int
+int_plan_template(krypt_template_enc_ctx *ctx, VALUE instance, krypt_asn1_definition *def, krypt_template_enc_node **out)
+{
+    krypt_asn1_template *t;
+    krypt_template_enc_node *node;
+
+    krypt_asn1_template_get(instance, t);
+    if (int_has_cached_encoding(t->object) && 
+	int_cached_matches(t->object, def) &&
+	!int_template_is_dirty(instance, def)) {
+	*out = int_node_new_cached(ctx, t->object);
+	return KRYPT_OK;
+    }
+    if (krypt_asn1_template_is_projected(t)) {
+	krypt_error_add("Only some fields of %s were parsed, it can't be encoded after it was modified", rb_obj_classname(instance));
+	return KRYPT_ERR;
+    }
+    if (!krypt_asn1_template_is_parsed(t)) {
+	VALUE dummy;
+	/* parse before re-encoding, the fields are needed */
+	if (krypt_asn1_template_get_cb_value(instance, sKrypt_IV_VALUE, &dummy) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    if (int_plan_value(ctx, instance, def, &node) == KRYPT_ERR) return KRYPT_ERR;
+    if (!node) {
+	krypt_error_add("Template value is empty");
+	return KRYPT_ERR;
+    }
+    *out = node;
+    return KRYPT_OK;
+}
+
+/* A value needs to be encoded again if it was assigned to or if any of the
+ * values below it were. Decoded SEQUENCE OF, SET OF and ANY values may have
+ * been modified in place, so these are re-encoded, too. */
+static int
+int_value_is_dirty(VALUE self, krypt_asn1_definition *def)
+{
+    ID codec = def->codec;
+    krypt_asn1_field *field;
+    long i;
+
+    if (codec == sKrypt_ID_SEQUENCE || codec == sKrypt_ID_SET) {
+	for (i=0; i < def->layout_size; ++i) {
+	    if (int_value_is_dirty(self, def->layout[i])) return 1;
+	}
+	return 0;
+    }
+    if (codec == sKrypt_ID_CHOICE) {
+	krypt_asn1_definition *alt;
+	if (!(field = int_field_get(self, def))) return 0;
+	if (field->flags & KRYPT_TEMPLATE_MODIFIED) return 1;
+	if (!(alt = int_choice_alternative(self, def))) {
+	    krypt_error_clear();
+	    return 1;
+	}
+	return int_value_is_dirty(self, alt);
+    }
+
+    if (!(field = int_field_get(self, def))) return 0;
+    if (field->flags & KRYPT_TEMPLATE_MODIFIED) return 1;
+    if (codec == sKrypt_ID_PRIMITIVE) return 0;
+    if (!(field->flags & KRYPT_TEMPLATE_DECODED)) return 0;
+    if (codec == sKrypt_ID_TEMPLATE) {
+	krypt_asn1_definition *type_def;
+	if (NIL_P(field->value) || !rb_obj_is_kind_of(field->value, mKryptASN1Template)) return 0;
+	if (!(type_def = krypt_definition_type_def(def))) {
+	    krypt_error_clear();
+	    return 1;
+	}
+	return int_template_is_dirty(field->value, type_def);
+    }
+    if (codec == sKrypt_ID_SEQUENCE_OF || codec == sKrypt_ID_SET_OF)
+	return int_collection_is_dirty(field->value);
+    return 1;
+}
+
+static int
+int_template_is_dirty(VALUE self, krypt_asn1_definition *def)
+{
+    krypt_asn1_template *t;
+
+    krypt_asn1_template_get(self, t);
+    if (krypt_asn1_template_is_modified(t)) return 1;
+    if (!krypt_asn1_template_is_parsed(t)) return 0;
+    return int_value_is_dirty(self, def);
+}
+
+static krypt_asn1_definition *
+int_template_definition(VALUE self, krypt_asn1_template *template)
+{
+    VALUE dummy;
+
+    if (template->def) return template->def;
+    return krypt_definition_compiled_for(CLASS_OF(self), &dummy);
+}
+
+static int
+int_template_plan(krypt_template_enc_ctx *ctx, VALUE self, krypt_template_enc_node **out)
 {
     krypt_asn1_template *template;
-    krypt_asn1_object *object;
-    int has_cached_encoding;
+    krypt_asn1_definition *def;
 
     krypt_asn1_template_get(self, template);
-    object = template->object;
+    if (!(def = int_template_definition(self, template))) return KRYPT_ERR;
+    return int_plan_template(ctx, self, def, out);
+}
 
-    has_cached_encoding = object && (object->bytes || object->bytes_len == 0)
-                                 && object->header->tag_bytes && object->header->length_bytes;
-    
-    if (has_cached_encoding)
-	return int_template_encode_cached(object, out);
-    else
-	return int_template_encode_non_cached(self, template, out);
+typedef struct int_encode_args_st {
+    krypt_template_enc_ctx ctx;
+    VALUE self;
+    binyo_outstream *out;	/* NULL to encode to a new String */
+    VALUE str;
+} int_encode_args;
+
+static int
+int_template_encode(int_encode_args *args)
+{
+    krypt_template_enc_node *node;
+    binyo_outstream *bos;
+    int ret;
+
+    if (int_template_plan(&args->ctx, args->self, &node) == KRYPT_ERR) return KRYPT_ERR;
+    if (args->out) return int_node_write(args->out, node);
+
+    if (node->total > LONG_MAX) {
+	krypt_error_add("Size of string too large: %lu", (unsigned long) node->total);
+	return KRYPT_ERR;
+    }
+    args->str = rb_str_new(NULL, (long) node->total);
+    bos = binyo_outstream_new_bytes_prealloc((uint8_t *) RSTRING_PTR(args->str), node->total);
+    ret = int_node_write(bos, node);
+    binyo_outstream_free(bos);
+    return ret;
+}
+
+static VALUE
+int_template_encode_i(VALUE args)
+{
+    return INT2FIX(int_template_encode((int_encode_args *) args));
+}
+
+/* Planning and writing call into Ruby (codecs, to_der, default values,
+ * IO#write) and may raise. The nodes built so far are freed in any case
+ * before a pending exception is propagated. */
+static int
+int_template_encode_protect(int_encode_args *args)
+{
+    VALUE ret;
+    int state = 0;
+
+    args->ctx.all = NULL;
+    ret = rb_protect(int_template_encode_i, (VALUE) args, &state);
+    int_ctx_cleanup(&args->ctx);
+    if (state) rb_jump_tag(state);
+    return FIX2INT(ret);
+}
+
+int
+krypt_asn1_template_encode(VALUE self, VALUE *out)
+{
+    int_encode_args args;
+
+    args.self = self;
+    args.out = NULL;
+    args.str = Qnil;
+    if (int_template_encode_protect(&args) == KRYPT_ERR) return KRYPT_ERR;
+    *out = args.str;
+    return KRYPT_OK;
 }
 
+int
+krypt_asn1_template_encode_to(VALUE self, binyo_outstream *out)
+{
+    int_encode_args args;
+
+    args.self = self;
+    args.out = out;
+    args.str = Qnil;
+    return int_template_encode_protect(&args);
+}
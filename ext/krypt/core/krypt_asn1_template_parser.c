@@ -30,6 +30,12 @@
 #include "krypt_asn1-internal.h"
 #include "krypt_asn1_template-internal.h"
 
+VALUE cKryptASN1TemplateCollection;
+VALUE cKryptASN1TemplateStream;
+VALUE cKryptASN1TemplateProjection;
+
+static ID sKrypt_ID_ONLY, sKrypt_ID_PATH, sKrypt_IV_PROJECTION_TEMPLATE, sKrypt_IV_PROJECTION_FIELDS;
+
 struct krypt_asn1_template_match_ctx {
     krypt_asn1_object *object;
     krypt_asn1_header *header;
@@ -39,31 +45,41 @@ struct krypt_asn1_template_match_ctx {
 struct krypt_asn1_template_parse_ctx {
     int (*match)(VALUE recv, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
     int (*parse)(VALUE recv, krypt_asn1_object *obj, krypt_asn1_definition *def, int *dont_free);
-    int (*decode)(VALUE recv, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+    int (*decode)(VALUE recv, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out);
 };
 
+/* Owner of a compiled definition tree, stored with the template class */
+typedef struct krypt_asn1_compiled_definition_st {
+    VALUE definition;
+    krypt_asn1_definition *root;
+    krypt_asn1_definition *match_root; /* the top-level value is matched without options */
+} krypt_asn1_compiled_definition;
+
 static int int_match_prim(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_parse_assign(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
-static int int_decode_prim(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+static int int_decode_prim(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out);
 
 static int int_match_sequence(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_match_set(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
+static int int_parse_set(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
 static int int_parse_cons(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
 
 static int int_match_template(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
-static int int_parse_template(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
+static int int_decode_template(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out);
 
 static int int_match_seq_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_match_set_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
-static int int_decode_cons_of(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+static int int_decode_cons_of(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out);
+static VALUE int_rb_template_new_initial(VALUE klass, binyo_instream *in, krypt_asn1_header *header, int decode_flags);
+static int int_decode_plain_elements(VALUE self, krypt_asn1_definition *def, int decode_flags, uint8_t *p, size_t len, VALUE *out);
 
 static int int_match_any(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
-static int int_decode_any(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out);
+static int int_decode_any(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out);
 
 static int int_match_choice(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def);
 static int int_parse_choice(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free);
 
-static int krypt_asn1_template_parse_stream(binyo_instream *in, VALUE klass, VALUE *out);
+static int krypt_asn1_template_parse_stream(binyo_instream *in, VALUE klass, int decode_flags, VALUE *out);
 
 static struct krypt_asn1_template_parse_ctx krypt_template_primitive_ctx= {
     int_match_prim,
@@ -79,14 +95,14 @@ static struct krypt_asn1_template_parse_ctx krypt_template_sequence_ctx= {
 
 static struct krypt_asn1_template_parse_ctx krypt_template_set_ctx= {
     int_match_set,
-    int_parse_cons,
+    int_parse_set,
     NULL
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_template_ctx= {
     int_match_template,
-    int_parse_template,
-    NULL
+    int_parse_assign,
+    int_decode_template
 };
 
 static struct krypt_asn1_template_parse_ctx krypt_template_seq_of_ctx= {
@@ -174,49 +190,10 @@ int_match_ctx_cleanup(struct krypt_asn1_template_match_ctx *ctx)
 }
 
 static int
-int_expected_tag(VALUE tag, int default_tag)
-{
-    if (NIL_P(tag)) 
-	return default_tag;
-    else
-        return NUM2INT(tag);
-}
-
-static int
-int_expected_tag_class(VALUE tag_class)
-{
-    if (NIL_P(tag_class))
-	return TAG_CLASS_UNIVERSAL;
-    else
-	return krypt_asn1_tag_class_for_id(SYM2ID(tag_class));
-}
-
-static int
-int_match_tag(krypt_asn1_header *header, VALUE tag, int default_tag)
-{
-    if (header->tag == int_expected_tag(tag, default_tag))
-	return INT_KRYPT_MATCH;
-    else
-	return INT_KRYPT_NO_MATCH;
-}
-
-static int
-int_match_class(krypt_asn1_header *header, VALUE tag_class)
-{
-    int expected_tc;
-    
-    if ((expected_tc = int_expected_tag_class(tag_class)) == KRYPT_ERR) return INT_KRYPT_NO_MATCH;
-    if (header->tag_class == expected_tc)
-	return INT_KRYPT_MATCH;
-    else
-	return INT_KRYPT_NO_MATCH;
-}
-
-static int
-int_tag_and_class_mismatch(krypt_asn1_header *header, VALUE tag, VALUE tagging, int default_tag, const char *name)
+int_tag_and_class_mismatch(krypt_asn1_header *header, krypt_asn1_definition *def, const char *name)
 {
-    int expected_tag = int_expected_tag(tag, default_tag);
-    int expected_tag_class = int_expected_tag_class(tagging);
+    int expected_tag = def->expected_tag;
+    int expected_tag_class = def->expected_tag_class;
     
     if (name)
 	krypt_error_add("Could not parse %s", name);
@@ -231,11 +208,11 @@ int_tag_and_class_mismatch(krypt_asn1_header *header, VALUE tag, VALUE tagging,
 }
 
 static int
-int_match_tag_and_class(krypt_asn1_header *header, VALUE tag, VALUE tagging, int default_tag)
+int_match_tag_and_class(krypt_asn1_header *header, krypt_asn1_definition *def)
 {
-    if (int_match_tag(header, tag, default_tag) == INT_KRYPT_NO_MATCH) return INT_KRYPT_NO_MATCH;
-    if (int_match_class(header, tagging) == INT_KRYPT_NO_MATCH) return INT_KRYPT_NO_MATCH;
-    return INT_KRYPT_MATCH;
+    if (header->tag == def->expected_tag && header->tag_class == def->expected_tag_class)
+	return INT_KRYPT_MATCH;
+    return INT_KRYPT_NO_MATCH;
 }
 
 static krypt_asn1_header *
@@ -253,10 +230,10 @@ int_parse_explicit_header(krypt_asn1_object *object)
 }
 
 static krypt_asn1_header *
-int_unpack_explicit(VALUE tagging, krypt_asn1_object *object, uint8_t **pp, size_t *len, int *free_header)
+int_unpack_explicit(krypt_asn1_definition *def, krypt_asn1_object *object, uint8_t **pp, size_t *len, int *free_header)
 {
     
-    if (NIL_P(tagging) || SYM2ID(tagging) != sKrypt_TC_EXPLICIT) {
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_EXPLICIT)) {
 	*pp = object->bytes;
 	*len = object->bytes_len;
 	*free_header = 0;
@@ -273,6 +250,15 @@ int_unpack_explicit(VALUE tagging, krypt_asn1_object *object, uint8_t **pp, size
 	header_len = header->tag_len + header->length_len;
 	*pp = object->bytes + header_len;
 	*len = object->bytes_len - header_len;
+	/* the END OF CONTENTS of an infinite length tag is not part of the value */
+	if (object->header->is_infinite) {
+	    if (*len < 2 || (*pp)[*len - 2] != 0 || (*pp)[*len - 1] != 0) {
+		krypt_error_add("No closing END OF CONTENTS found for explicitly tagged value");
+		krypt_asn1_header_free(header);
+		return NULL;
+	    }
+	    *len -= 2;
+	}
 	*free_header = 1;
 	return header;
     }
@@ -303,6 +289,89 @@ error:
     return KRYPT_ERR;
 }
 
+/*
+ * Like int_next_object, but the returned object refers to its value bytes
+ * within +base+ instead of a copy. *offset tracks the position of +in+
+ * relative to +base+. Once an infinite length value was read positions are
+ * no longer known, *slicing is set to 0 and values are copied from then on.
+ */
+static int
+int_next_object_slice(binyo_instream *in, uint8_t *base, size_t len, size_t *offset, int *slicing, krypt_asn1_object **out)
+{
+    krypt_asn1_header *next = NULL;
+    krypt_asn1_object *next_object = NULL;
+    int result;
+    size_t start, value_len;
+    uint8_t *value = NULL;
+
+    if (!*slicing) return int_next_object(in, out);
+
+    result = krypt_asn1_next_header(in, &next);
+    if (result == KRYPT_ASN1_EOF) return KRYPT_ASN1_EOF;
+    if (result == KRYPT_ERR) goto error;
+
+    if (next->is_infinite) {
+	*slicing = 0;
+	if (krypt_asn1_get_value(in, next, &value, &value_len) == KRYPT_ERR) goto error;
+    }
+    else {
+	start = *offset + next->tag_len + next->length_len;
+	if (start > len || next->length > len - start) {
+	    krypt_error_add("Premature EOF detected");
+	    goto error;
+	}
+	if (krypt_asn1_skip_value(in, next) == KRYPT_ERR) goto error;
+	*offset = start + next->length;
+	value_len = next->length;
+	value = value_len ? base + start : NULL;
+    }
+    if (!(next_object = krypt_asn1_object_new_value(next, value, value_len))) goto error;
+
+    *out = next_object;
+    return KRYPT_OK;
+
+error:
+    if (next) krypt_asn1_header_free(next);
+    krypt_error_add("Error while trying to read next value");
+    return KRYPT_ERR;
+}
+
+/* Whether +object+ borrows its bytes from the encoding of +from+ */
+static int
+int_object_borrows(krypt_asn1_object *object, krypt_asn1_object *from)
+{
+    return from && object && object != from && object->bytes && from->bytes &&
+	   object->bytes >= from->bytes && object->bytes < from->bytes + from->bytes_len;
+}
+
+static void
+int_object_release(krypt_asn1_object *object, krypt_asn1_object *from)
+{
+    if (int_object_borrows(object, from))
+	object->bytes = NULL;
+    krypt_asn1_object_free(object);
+}
+
+static int
+int_header_is_eoc(krypt_asn1_header *header)
+{
+    return header->tag == TAGS_END_OF_CONTENTS && header->tag_class == TAG_CLASS_UNIVERSAL;
+}
+
+/* Reads the header of the next element of a SEQUENCE OF / SET OF. The END
+ * OF CONTENTS closing infinite length contents ends the elements like EOF. */
+static int
+int_next_element_header(binyo_instream *in, int is_infinite, krypt_asn1_header **out)
+{
+    int result = krypt_asn1_next_header(in, out);
+
+    if (result == KRYPT_OK && is_infinite && int_header_is_eoc(*out)) {
+	krypt_asn1_header_free(*out);
+	return KRYPT_ASN1_EOF;
+    }
+    return result;
+}
+
 static int
 int_parse_eoc(binyo_instream *in)
 {
@@ -336,16 +405,14 @@ int_ensure_stream_is_consumed(binyo_instream *in)
 }
 
 static int
-int_try_match_cons(struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
+int_try_match_cons(struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
 {
     krypt_asn1_header *header = ctx->header;
-    VALUE tag = krypt_definition_get_tag(def);
-    VALUE tagging = krypt_definition_get_tagging(def);
 
     if (header->is_constructed && 
-	int_match_tag_and_class(header, tag, tagging, default_tag) == INT_KRYPT_MATCH) return INT_KRYPT_MATCH;
+	int_match_tag_and_class(header, def) == INT_KRYPT_MATCH) return INT_KRYPT_MATCH;
 
-    if (!header->is_constructed && !krypt_definition_is_optional(def)) {
+    if (!header->is_constructed && !krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
 	krypt_error_add("Constructive bit not set");
 	return INT_KRYPT_MATCH_ERR;
     }
@@ -362,807 +429,3035 @@ int_determine_name(VALUE name)
 }
 
 static void
-int_set_default_value(VALUE self, krypt_asn1_definition *def)
+int_definition_free(krypt_asn1_definition *def)
 {
-    ID name;
-    VALUE obj, def_value; 
-    krypt_asn1_template *template;
+    long i;
 
-    name = int_determine_name(krypt_definition_get_name(def));
-    /* set the default value, no more decoding needed */
-    def_value = krypt_definition_get_default_value(def);
-    template = krypt_asn1_template_new_value(def_value); 
-    krypt_asn1_template_set(cKryptASN1TemplateValue, obj, template);
-    rb_ivar_set(self, name, obj);
+    if (!def) return;
+    if (def->layout) {
+	for (i=0; i < def->layout_size; ++i)
+	    int_definition_free(def->layout[i]);
+	xfree(def->layout);
+    }
+    if (!def->type_compiled) int_definition_free(def->type_def);
+    int_definition_free(def->prev);
+    if (def->first) xfree(def->first);
+    if (def->field_names) xfree(def->field_names);
+    if (def->field_keys) xfree(def->field_keys);
+    if (def->field_methods) st_free_table(def->field_methods);
+    xfree(def);
 }
 
-static int
-int_check_optional_or_default(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
+static void
+int_definition_mark(krypt_asn1_definition *def)
 {
-    krypt_asn1_header *header = ctx->header;
-    VALUE tag = krypt_definition_get_tag(def);
-    VALUE tagging = krypt_definition_get_tagging(def);
-
-    if (!krypt_definition_is_optional(def)) { 
-	const char *str;
-	ID name = int_determine_name(krypt_definition_get_name(def));
-        str = rb_id2name(name);
-        krypt_error_add("Mandatory value %s is missing", str);
-	return int_tag_and_class_mismatch(header, tag, tagging, default_tag, str);
+    long i;
+
+    if (!def) return;
+    rb_gc_mark(def->definition);
+    rb_gc_mark(def->options);
+    for (i=0; i < 10; ++i)
+	rb_gc_mark(def->values[i]);
+    if (def->layout) {
+	for (i=0; i < def->layout_size; ++i)
+	    int_definition_mark(def->layout[i]);
     }
-
-    if (krypt_definition_has_default(def)) {
-	int_set_default_value(self, def);
-	return INT_KRYPT_MATCH_DEFAULT_APPLIED;
+    if (def->type_compiled) {
+	rb_gc_mark(def->type_compiled);
+	rb_gc_mark(def->type_replaced);
     }
-
-    return INT_KRYPT_NO_MATCH;
+    else {
+	int_definition_mark(def->type_def);
+    }
+    int_definition_mark(def->prev);
 }
 
 static int
-int_match_prim(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+int_definition_default_tag(krypt_asn1_definition *def, int *out)
 {
-    VALUE tag, tagging, vdef_tag;
-    krypt_asn1_header *header = ctx->header;
-    int default_tag;
-
-    get_or_raise(vdef_tag, krypt_definition_get_type(def), "'type is missing in ASN.1 definition");
-    default_tag = NUM2INT(vdef_tag);
-    tag = krypt_definition_get_tag(def);
-    tagging = krypt_definition_get_tagging(def);
+    ID codec = def->codec;
 
-    if (int_match_tag_and_class(header, tag, tagging, default_tag) == INT_KRYPT_MATCH) return INT_KRYPT_MATCH;
-
-    return int_check_optional_or_default(self, ctx, def, default_tag);
+    if (codec == sKrypt_ID_PRIMITIVE) {
+	VALUE type;
+	get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
+	*out = NUM2INT(type);
+    }
+    else if (codec == sKrypt_ID_SEQUENCE || codec == sKrypt_ID_SEQUENCE_OF)
+	*out = TAGS_SEQUENCE;
+    else if (codec == sKrypt_ID_SET || codec == sKrypt_ID_SET_OF)
+	*out = TAGS_SET;
+    else
+	*out = -1; /* CHOICE, ANY and TEMPLATE have no tag of their own */
+    return 1;
 }
 
+/* Elements of SEQUENCE OF and SET OF values with a primitive universal
+ * type may be decoded right to their Ruby values, see
+ * KRYPT_ASN1_DECODE_PLAIN. BIT STRINGs are not, their unused bits would
+ * be lost. */
 static int
-int_parse_assign(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
+int_definition_element_tag(VALUE type)
 {
-    ID name;
-    VALUE instance;
-    krypt_asn1_template *t;
+    int tag = krypt_asn1_universal_tag_for(type);
 
-    name = int_determine_name(krypt_definition_get_name(def));
-    t = krypt_asn1_template_new(object, krypt_definition_get_definition(def), krypt_definition_get_options(def));
-    krypt_asn1_template_set(cKryptASN1TemplateValue, instance, t);
-    rb_ivar_set(self, name, instance);
-    krypt_asn1_template_set_parsed(t, 1);
-    *dont_free = 1;
-    return KRYPT_OK;
+    if (tag <= 0 || tag == TAGS_BIT_STRING || tag == TAGS_SEQUENCE || tag == TAGS_SET) return -1;
+    if (!krypt_asn1_codec_for(TAG_CLASS_UNIVERSAL, tag)) return -1;
+    return tag;
 }
 
-/* TODO */
 static int
-int_decode_prim_inf(VALUE tvalue, krypt_asn1_object *obj, krypt_asn1_definition *def, VALUE *out)
+int_definition_compile_flags(krypt_asn1_definition *def)
 {
-    rb_raise(rb_eNotImpError, "Not implemented yet");
+    VALUE tagging, type;
+    int flags = 0;
+
+    if (RTEST(krypt_definition_get_optional(def)))
+	flags |= KRYPT_DEFINITION_F_OPTIONAL;
+    if (!NIL_P(krypt_definition_get_default_value(def)))
+	flags |= KRYPT_DEFINITION_F_OPTIONAL | KRYPT_DEFINITION_F_HAS_DEFAULT;
+    tagging = krypt_definition_get_tagging(def);
+    if (!NIL_P(tagging) && SYM2ID(tagging) == sKrypt_TC_EXPLICIT)
+	flags |= KRYPT_DEFINITION_F_EXPLICIT;
+    if (RTEST(krypt_definition_get_raw(def)))
+	flags |= KRYPT_DEFINITION_F_RAW;
+    if (def->codec == sKrypt_ID_PRIMITIVE &&
+	(def->default_tag == TAGS_BIT_STRING || def->default_tag == TAGS_OCTET_STRING) &&
+	RTEST(krypt_definition_get_encapsulated(def)))
+	flags |= KRYPT_DEFINITION_F_ENCAPSULATED;
+    if (def->codec == sKrypt_ID_SEQUENCE_OF || def->codec == sKrypt_ID_SET_OF) {
+	get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
+	if (RTEST(rb_funcall(type, rb_intern("include?"), 1, mKryptASN1Template)))
+	    flags |= KRYPT_DEFINITION_F_TEMPLATE_TYPE;
+	else
+	    def->element_tag = int_definition_element_tag(type);
+    }
+    def->flags = flags;
+    return 1;
 }
 
+static krypt_asn1_definition *int_definition_compile(VALUE definition, VALUE options);
+
 static int
-int_decode_prim(VALUE tvalue, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
+int_definition_compile_layout(krypt_asn1_definition *def)
 {
-    VALUE value, vtype, tagging;
-    krypt_asn1_header *header = object->header;
-    int free_header = 0, default_tag;
-    uint8_t *p;
-    size_t len;
+    VALUE layout, min_size;
+    long i;
 
-    if (header->is_infinite)
-	return int_decode_prim_inf(tvalue, object, def, out);
+    get_or_raise(layout, krypt_definition_get_layout(def), "'layout' missing in ASN.1 definition");
+    if (def->codec != sKrypt_ID_CHOICE) {
+	get_or_raise(min_size, krypt_definition_get_min_size(def), "'min_size' missing in ASN.1 definition");
+	def->min_size = NUM2LONG(min_size);
+    }
+    def->layout_size = RARRAY_LEN(layout);
+    def->layout = ALLOC_N(krypt_asn1_definition *, def->layout_size);
+    memset(def->layout, 0, def->layout_size * sizeof(krypt_asn1_definition *));
 
-    get_or_raise(vtype, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
-    tagging = krypt_definition_get_tagging(def);
-    default_tag = NUM2INT(vtype);
+    for (i=0; i < def->layout_size; ++i) {
+	VALUE cur = rb_ary_entry(layout, i);
+	if (!(def->layout[i] = int_definition_compile(cur, krypt_hash_get_options(cur)))) return 0;
+    }
+    return 1;
+}
 
-    if (!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
-    if (header->is_constructed) {
-	krypt_error_add("Constructed bit set");
+/* Compiles the Hash +definition+ and its +options+ into a tree of
+ * krypt_asn1_definitions, so that parsing no longer needs to look
+ * anything up in the Ruby Hashes. TEMPLATE types are compiled lazily
+ * by int_definition_type_def since they may be recursive. */
+static krypt_asn1_definition *
+int_definition_compile(VALUE definition, VALUE options)
+{
+    krypt_asn1_definition *def;
+    VALUE codec, tag, tagging;
+
+    def = ALLOC(krypt_asn1_definition);
+    krypt_definition_init(def, definition, options);
+    def->field_index = -1;
+    def->element_tag = -1;
+
+    if (NIL_P((codec = krypt_hash_get_codec(definition)))) {
+	krypt_error_add("'codec' missing in ASN.1 definition");
 	goto error;
     }
+    def->codec = SYM2ID(codec);
+    if (!(def->parser = int_get_parse_ctx_for_codec(def->codec))) goto error;
+    def->name = int_determine_name(krypt_definition_get_name(def));
+    if (!int_definition_default_tag(def, &def->default_tag)) goto error;
 
-    if (!krypt_asn1_codecs[default_tag].decoder) {
-	int default_tag = NUM2INT(vtype);
-        krypt_error_add("No codec available for default tag %d", default_tag);
-	goto error;
+    tag = krypt_definition_get_tag(def);
+    def->expected_tag = NIL_P(tag) ? def->default_tag : NUM2INT(tag);
+    tagging = krypt_definition_get_tagging(def);
+    if (NIL_P(tagging)) {
+	def->expected_tag_class = TAG_CLASS_UNIVERSAL;
     }
-    if (krypt_asn1_codecs[default_tag].decoder(tvalue, p, len, &value) == KRYPT_ERR) {
+    else if ((def->expected_tag_class = krypt_asn1_tag_class_for_id(SYM2ID(tagging))) == KRYPT_ERR) {
+	krypt_error_add("Unknown tag class: %s", rb_id2name(SYM2ID(tagging)));
 	goto error;
     }
 
-    if (free_header) krypt_asn1_header_free(header);
-    *out = value;
-    return KRYPT_OK;
+    if (!int_definition_compile_flags(def)) goto error;
 
-error: {
-    ID name = int_determine_name(krypt_definition_get_name(def));
-    krypt_error_add("Error while decoding value %s", rb_id2name(name));
-    if (free_header) krypt_asn1_header_free(header);
-    return KRYPT_ERR;
-       }
+    if (def->codec == sKrypt_ID_SEQUENCE || def->codec == sKrypt_ID_SET || def->codec == sKrypt_ID_CHOICE) {
+	if (!int_definition_compile_layout(def)) goto error;
+    }
+    return def;
+
+error:
+    int_definition_free(def);
+    return NULL;
 }
 
-static int
-int_match_cons(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
+/* Returns the slot of the field +name+ in the templates of +root+, or -1 */
+long
+krypt_definition_field_index(krypt_asn1_definition *root, ID name)
 {
-    int match = int_try_match_cons(ctx, def, default_tag);
+    long i;
 
-    if (match == INT_KRYPT_MATCH || match == INT_KRYPT_MATCH_ERR) return match;
-
-    if (!krypt_definition_is_optional(def)) {
-	VALUE tag = krypt_definition_get_tag(def);
-	VALUE tagging = krypt_definition_get_tagging(def);
-	krypt_error_add("Mandatory sequence value not found");
-	return int_tag_and_class_mismatch(ctx->header, tag, tagging, default_tag, "Constructed");
+    for (i=0; i < root->num_fields; ++i) {
+	if (root->field_names[i] == name) return i;
     }
-    return INT_KRYPT_NO_MATCH;
+    return -1;
 }
 
-static int
-int_match_sequence(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+/* Returns the slot that the accessor +mid+ reads or writes, or -1 */
+long
+krypt_definition_method_index(krypt_asn1_definition *root, ID mid)
 {
-    return int_match_cons(self, ctx, def, TAGS_SEQUENCE);
+    st_data_t index;
+
+    /* accessors tend to be called repeatedly, spare the lookup then */
+    if (root->last_mid == mid) return root->last_index;
+    if (!root->field_methods || !st_lookup(root->field_methods, (st_data_t) mid, &index))
+	index = (st_data_t) -1;
+    root->last_mid = mid;
+    root->last_index = (long) index;
+    return root->last_index;
 }
 
-static int
-int_match_set(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+/* The accessors of @foo are foo and foo=, foo is also its key */
+static void
+int_definition_add_field_methods(krypt_asn1_definition *root, ID name, long index)
 {
-    return int_match_cons(self, ctx, def, TAGS_SET);
+    const char *str = rb_id2name(name);
+
+    root->field_keys[index] = name;
+    if (!str) return;
+    if (*str == '@') str++;
+    root->field_keys[index] = rb_intern(str);
+    if (!root->field_methods) root->field_methods = st_init_numtable();
+    st_insert(root->field_methods, (st_data_t) root->field_keys[index], (st_data_t) index);
+    st_insert(root->field_methods, (st_data_t) rb_intern_str(rb_sprintf("%s=", str)), (st_data_t) index);
 }
 
-static int
-int_ensure_rest_is_optional(VALUE self, VALUE layout, long index)
+static long
+int_definition_field_slot(krypt_asn1_definition *root, ID name, long *capa)
 {
-    long i, size;
+    long index;
 
-    size = RARRAY_LEN(layout);
-    for (i=index; i < size; ++i) {
-	krypt_asn1_definition def;
-	VALUE cur_def = rb_ary_entry(layout, i);
-
-	krypt_definition_init(&def, cur_def, krypt_hash_get_options(cur_def));
-	if (!krypt_definition_is_optional(&def)) {
-	    ID name = int_determine_name(krypt_definition_get_name(&def));
-	    krypt_error_add("Mandatory value %s not found", rb_id2name(name));
-	    return KRYPT_ERR;
-	}
-	if (krypt_definition_has_default(&def)) {
-	    int_set_default_value(self, &def);
-	}
+    if ((index = krypt_definition_field_index(root, name)) != -1) return index;
+    if (root->num_fields == *capa) {
+	*capa = *capa ? *capa * 2 : 8;
+	REALLOC_N(root->field_names, ID, *capa);
+	REALLOC_N(root->field_keys, ID, *capa);
     }
-    return KRYPT_OK;
+    root->field_names[root->num_fields] = name;
+    int_definition_add_field_methods(root, name, root->num_fields);
+    return root->num_fields++;
 }
 
-static int
-int_parse_cons(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
+/* The values of inline SEQUENCEs and SETs are fields of the template
+ * itself, as are the alternatives of a CHOICE. These share the @value
+ * slot, which is also the CHOICE's own. */
+static void
+int_definition_number_field(krypt_asn1_definition *root, krypt_asn1_definition *def, long *capa)
 {
-    binyo_instream *in;
-    VALUE layout, vmin_size, tagging;
-    long num_parsed = 0, layout_size, min_size, i;
-    krypt_asn1_header *header = object->header;
-    krypt_asn1_object *cur_object = NULL;
-    int object_consumed = 0, free_header = 0;
-    uint8_t *p;
-    size_t len;
-
-    get_or_raise(layout, krypt_definition_get_layout(def), "'layout' missing in ASN.1 definition");
-    get_or_raise(vmin_size, krypt_definition_get_min_size(def), "'min_size' is missing in ASN.1 definition");
-    min_size = NUM2LONG(vmin_size);
-    tagging = krypt_definition_get_tagging(def);
-    layout_size = RARRAY_LEN(layout);
-
-    if(!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
-    if (!header->is_constructed) {
-	krypt_error_add("Constructed bit not set");
-	return KRYPT_ERR;
-    }
-
-    in = binyo_instream_new_bytes(p, len);
-    if (int_next_object(in, &cur_object) != KRYPT_OK) goto error;
-
-    for (i=0; i < layout_size; ++i) {
-	ID codec;
-	int result;
-	krypt_asn1_definition inner_def;
-	struct krypt_asn1_template_parse_ctx *parser;
-	struct krypt_asn1_template_match_ctx ctx;
-	VALUE cur_def = rb_ary_entry(layout, i);
+    long i;
+
+    if (def->codec == sKrypt_ID_CHOICE)
+	def->field_index = int_definition_field_slot(root, sKrypt_IV_VALUE, capa);
+    else if (def->codec != sKrypt_ID_SEQUENCE && def->codec != sKrypt_ID_SET)
+	def->field_index = int_definition_field_slot(root, def->name, capa);
+    for (i=0; i < def->layout_size; ++i)
+	int_definition_number_field(root, def->layout[i], capa);
+}
 
-	krypt_error_clear();
-	krypt_definition_init(&inner_def, cur_def, krypt_hash_get_options(cur_def));
-	codec = SYM2ID(krypt_hash_get_codec(cur_def));
-	parser = int_get_parse_ctx_for_codec(codec);
-	int_match_ctx_init(&ctx, cur_object);
+/* Assigns each field below +root+ its slot in the field array of the
+ * templates that +root+ is the definition of */
+static void
+int_definition_number_fields(krypt_asn1_definition *root)
+{
+    long capa = 0;
+    int_definition_number_field(root, root, &capa);
+}
 
-	if ((result = parser->match(self, &ctx, &inner_def)) != INT_KRYPT_MATCH_ERR) {
-	    if (result == INT_KRYPT_MATCH) {
-		int inner_dont_free;
-		if (parser->parse(self, cur_object, &inner_def, &inner_dont_free) == KRYPT_ERR) goto error;
-		if (!inner_dont_free) krypt_asn1_object_free(cur_object);
-		object_consumed = 1;
-		num_parsed++;
-		if (i < layout_size - 1) {
-		    int has_more = int_next_object(in, &cur_object); 
-		    if (has_more == KRYPT_ERR) goto error;
-		    if (has_more == KRYPT_ASN1_EOF) {
-		       	if (int_ensure_rest_is_optional(self, layout, i+1) == KRYPT_ERR) goto error;
-			break; /* EOF reached */
-		    }
-		}
-	    } /* else -> didn't match or default value was set */
-	} else {
-	    goto error;
-	}
-    }
+static VALUE int_compiled_definition_for(VALUE klass);
 
-    if (num_parsed < min_size) {
-	krypt_error_add("Expected %d..%d values. Got: %d", min_size, layout_size, num_parsed);
-	goto error;
-    }
-    if (header->is_infinite) {
-	if(int_parse_eoc(in) == KRYPT_ERR) {
-	    krypt_error_add("No closing END OF CONTENTS found for constructive value");
-	    goto error;
+/* TEMPLATE values without options share the compiled definition of their
+ * type, this also keeps recursive types finite. */
+static krypt_asn1_definition *
+int_definition_shared_type_def(krypt_asn1_definition *def, VALUE type)
+{
+    VALUE vcompiled;
+    krypt_asn1_compiled_definition *compiled;
+
+    if (NIL_P((vcompiled = int_compiled_definition_for(type)))) return NULL;
+    if (def->type_compiled != vcompiled) {
+	if (def->type_compiled) {
+	    if (!def->type_replaced) def->type_replaced = rb_ary_new();
+	    rb_ary_push(def->type_replaced, def->type_compiled);
 	}
+	Data_Get_Struct(vcompiled, krypt_asn1_compiled_definition, compiled);
+	def->type_compiled = vcompiled;
+	def->type_def = compiled->match_root;
     }
-    if (int_ensure_stream_is_consumed(in) == KRYPT_ERR) goto error;
-
-    binyo_instream_free(in);
-    if (free_header) krypt_asn1_header_free(header);
-    *dont_free = 0;
-    return KRYPT_OK;
-
-error:
-    binyo_instream_free(in);
-    if (cur_object && !object_consumed) krypt_asn1_object_free(cur_object);
-    if (free_header) krypt_asn1_header_free(header);
-    return KRYPT_ERR;
-} 
+    return def->type_def;
+}
 
-static int
-int_match_template(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+static krypt_asn1_definition *
+int_definition_type_def(krypt_asn1_definition *def)
 {
-    ID codec;
     VALUE type, type_def;
-    krypt_asn1_definition new_def;
-    struct krypt_asn1_template_parse_ctx *parser;
-    int match;
-    
+    krypt_asn1_definition *compiled;
+
     get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
+    if (NIL_P(krypt_definition_get_options(def))) return int_definition_shared_type_def(def, type);
     if (NIL_P((type_def = krypt_definition_get(type)))) {
 	krypt_error_add("Type %s has no ASN.1 definition", rb_class2name(type));
-	return INT_KRYPT_MATCH_ERR;
-    }
-    krypt_definition_init(&new_def, type_def, krypt_definition_get_options(def));
-    codec = SYM2ID(krypt_hash_get_codec(type_def));
-    parser = int_get_parse_ctx_for_codec(codec);
-    match = parser->match(self, ctx, &new_def);
-    if (match == INT_KRYPT_NO_MATCH) {
-	if (krypt_definition_has_default(def)) {
-	    int_set_default_value(self, def);
-	    return INT_KRYPT_MATCH_DEFAULT_APPLIED;
-	}   
+	return NULL;
     }
-    return match;
+    if (def->type_def && def->type_def->definition == type_def) return def->type_def;
+
+    if (!(compiled = int_definition_compile(type_def, krypt_definition_get_options(def)))) return NULL;
+    int_definition_number_fields(compiled);
+    compiled->prev = def->type_def;
+    def->type_def = compiled;
+    return compiled;
 }
 
-static int
-int_parse_template(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
-{
-    ID name;
-    VALUE container, instance;
-    VALUE type, type_def, options;
-    krypt_asn1_template *container_template, *value_template;
+/* FIRST sets
+ *
+ * Every value but an untagged CHOICE, ANY or TEMPLATE starts with exactly
+ * expected_tag/expected_tag_class. An untagged TEMPLATE starts like its
+ * type, an untagged CHOICE like any of its alternatives. The latter are
+ * collected into a table sorted by tag, so that the matching alternative
+ * is found with a single lookup instead of trying every alternative. */
 
-    get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
-    name = int_determine_name(krypt_definition_get_name(def));
-    if (NIL_P((type_def = krypt_definition_get(type)))) {
-	krypt_error_add("Type %s has no ASN.1 definition", rb_class2name(type));
-	return KRYPT_ERR;
-    }
+/* Untagged CHOICEs nested deeper than this are tried one by one */
+#define INT_KRYPT_FIRST_MAX_DEPTH 16
 
-    options = krypt_definition_get_options(def);
-    value_template = krypt_asn1_template_new(object, type_def, options);
-    krypt_asn1_template_set(type, instance, value_template);
+static int int_definition_first_compute(krypt_asn1_definition *def, int depth);
 
-    container_template = krypt_asn1_template_new_value(instance);
-    krypt_asn1_template_set_definition(container_template, krypt_definition_get_definition(def));
-    krypt_asn1_template_set_options(container_template, options);
-    krypt_asn1_template_set(cKryptASN1TemplateValue, container, container_template);
-
-    rb_ivar_set(self, name, container);
-    *dont_free = 1;
-    return KRYPT_OK;
-}
+/* Resolves an untagged TEMPLATE to the definition of its type */
+static krypt_asn1_definition *
+int_first_target(krypt_asn1_definition *def)
+{
+    if (def->codec == sKrypt_ID_TEMPLATE && def->expected_tag == -1)
+	return int_definition_type_def(def);
+    return def;
+}
 
 static int
-int_match_cons_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, int default_tag)
+int_first_is_any(krypt_asn1_definition *def)
 {
-    int match = int_try_match_cons(ctx, def, default_tag);
-
-    if (match == INT_KRYPT_MATCH || match == INT_KRYPT_MATCH_ERR) return match;
-    return int_check_optional_or_default(self, ctx, def, default_tag);
+    if (def->codec == sKrypt_ID_ANY) /* the tag of an ANY is only checked if it is optional */
+	return !(krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL) && def->expected_tag != -1);
+    if (def->codec == sKrypt_ID_CHOICE && def->expected_tag == -1)
+	return krypt_definition_has_flag(def, KRYPT_DEFINITION_F_FIRST_ANY);
+    return 0;
 }
 
-static int
-int_match_seq_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+static void
+int_first_add(krypt_asn1_definition *def, long *capa, int tag, int tag_class, long index)
 {
-    return int_match_cons_of(self, ctx, def, TAGS_SEQUENCE);
+    if (def->first_size == *capa) {
+	*capa = *capa ? *capa * 2 : 8;
+	REALLOC_N(def->first, krypt_asn1_first_tag, *capa);
+    }
+    def->first[def->first_size].tag = tag;
+    def->first[def->first_size].tag_class = tag_class;
+    def->first[def->first_size].index = index;
+    def->first_size++;
 }
 
 static int
-int_match_set_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+int_first_cmp(const void *a, const void *b)
 {
-    return int_match_cons_of(self, ctx, def, TAGS_SET);
+    const krypt_asn1_first_tag *x = (const krypt_asn1_first_tag *) a;
+    const krypt_asn1_first_tag *y = (const krypt_asn1_first_tag *) b;
+
+    if (x->tag_class != y->tag_class) return x->tag_class < y->tag_class ? -1 : 1;
+    if (x->tag != y->tag) return x->tag < y->tag ? -1 : 1;
+    if (x->index != y->index) return x->index < y->index ? -1 : 1;
+    return 0;
 }
 
 static int
-int_decode_cons_of_templates(binyo_instream *in, VALUE type, VALUE *out)
+int_first_add_alternative(krypt_asn1_definition *def, long *capa, long index, int depth)
 {
-    VALUE cur;
-    VALUE ary = rb_ary_new();
-    int result;
+    krypt_asn1_definition *alt = def->layout[index], *target;
+    long i;
+
+    if (!(target = int_first_target(alt))) return KRYPT_ERR;
+    if (target->codec == sKrypt_ID_CHOICE && target->expected_tag == -1) {
+	if (depth >= INT_KRYPT_FIRST_MAX_DEPTH || 
+	    krypt_definition_has_flag(target, KRYPT_DEFINITION_F_FIRST_PENDING)) {
+	    /* e.g. a CHOICE containing itself, the alternative is simply tried */
+	    if (def->first_wildcard == -1) def->first_wildcard = index;
+	    return KRYPT_OK;
+	}
+	if (int_definition_first_compute(target, depth + 1) == KRYPT_ERR) return KRYPT_ERR;
+    }
 
-    while ((result = krypt_asn1_template_parse_stream(in, type, &cur)) == KRYPT_OK) {
-	rb_ary_push(ary, cur);
+    /* a DEFAULT alternative of a CHOICE applies its default on any tag */
+    if (int_first_is_any(target) || 
+	(def->codec == sKrypt_ID_CHOICE && krypt_definition_has_flag(alt, KRYPT_DEFINITION_F_HAS_DEFAULT))) {
+	if (def->first_wildcard == -1) def->first_wildcard = index;
+    }
+    else if (target->codec == sKrypt_ID_CHOICE && target->expected_tag == -1) {
+	for (i=0; i < target->first_size; ++i)
+	    int_first_add(def, capa, target->first[i].tag, target->first[i].tag_class, index);
+    }
+    else {
+	int_first_add(def, capa, target->expected_tag, target->expected_tag_class, index);
     }
-    if (result == KRYPT_ERR) return KRYPT_ERR;
-    *out = ary;
     return KRYPT_OK;
 }
 
 static int
-int_decode_cons_of_prim(binyo_instream *in, VALUE type, VALUE *out)
+int_definition_first_compute(krypt_asn1_definition *def, int depth)
 {
-    VALUE cur;
-    VALUE ary = rb_ary_new();
-    int result;
-
-    while ((result = krypt_asn1_decode_stream(in, &cur)) == KRYPT_OK) {
-	if (!rb_obj_is_kind_of(cur, type)) {
-	    krypt_error_add("Expected %s but got %s instead", rb_class2name(type), rb_class2name(CLASS_OF(cur)));
+    long i, j, capa = 0;
+
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_FIRST_COMPUTED)) return KRYPT_OK;
+
+    def->first_wildcard = -1;
+    def->first_any = -1;
+    def->flags |= KRYPT_DEFINITION_F_FIRST_PENDING;
+    for (i=0; i < def->layout_size; ++i) {
+	if (def->layout[i]->codec == sKrypt_ID_ANY && def->first_any == -1)
+	    def->first_any = i;
+	if (int_first_add_alternative(def, &capa, i, depth) == KRYPT_ERR) {
+	    def->flags &= ~KRYPT_DEFINITION_F_FIRST_PENDING;
+	    if (def->first) xfree(def->first);
+	    def->first = NULL;
+	    def->first_size = 0;
 	    return KRYPT_ERR;
 	}
-	rb_ary_push(ary, cur);
     }
-    if (result == KRYPT_ERR) return KRYPT_ERR;
-    *out = ary;
+
+    if (def->first_size > 1) {
+	qsort(def->first, def->first_size, sizeof(krypt_asn1_first_tag), int_first_cmp);
+	for (i=1, j=0; i < def->first_size; ++i) { /* drop duplicates */
+	    if (int_first_cmp(&def->first[i], &def->first[j]) != 0)
+		def->first[++j] = def->first[i];
+	}
+	def->first_size = j + 1;
+    }
+    def->flags &= ~KRYPT_DEFINITION_F_FIRST_PENDING;
+    /* the first ANY matches if no other alternative will */
+    if (def->first_wildcard != -1 || def->first_any != -1)
+	def->flags |= KRYPT_DEFINITION_F_FIRST_ANY;
+    def->flags |= KRYPT_DEFINITION_F_FIRST_COMPUTED;
     return KRYPT_OK;
 }
 
+/* Returns the position of the first entry for +tag+ and +tag_class+ in
+ * the FIRST set of +def+, or first_size if there is none. */
+static long
+int_first_lookup(krypt_asn1_definition *def, int tag, int tag_class)
+{
+    long lo = 0, hi = def->first_size;
+
+    while (lo < hi) {
+	long mid = lo + (hi - lo) / 2;
+	krypt_asn1_first_tag *cur = &def->first[mid];
+	if (cur->tag_class < tag_class || 
+	    (cur->tag_class == tag_class && cur->tag < tag))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < def->first_size && 
+	def->first[lo].tag == tag && 
+	def->first[lo].tag_class == tag_class)
+	return lo;
+    return def->first_size;
+}
+
+/* Returns 0 if a value of +def+ cannot start with the tag of +header+.
+ * CHOICEs are left to int_match_choice, which has its own lookup. */
 static int
-int_decode_cons_of(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
+int_definition_may_start_with(krypt_asn1_definition *def, krypt_asn1_header *header)
 {
-    ID name;
-    binyo_instream *in;
-    VALUE type, tagging, val_ary, mod_p;
-    uint8_t *p;
-    size_t len;
-    int free_header = 0;
-    krypt_asn1_header *header = object->header;
+    krypt_asn1_definition *target;
 
-    get_or_raise(type, krypt_definition_get_type(def), "'type' missing in ASN.1 definition");
-    name = int_determine_name(krypt_definition_get_name(def));
-    tagging = krypt_definition_get_tagging(def);
+    if (!(target = int_first_target(def))) return 1; /* let the matcher report the error */
+    if (target->codec == sKrypt_ID_CHOICE || int_first_is_any(target)) return 1;
+    return header->tag == target->expected_tag && header->tag_class == target->expected_tag_class;
+}
 
-    if (!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
-    if (!header->is_constructed) {
-	krypt_error_add("Constructed bit not set");
-	return KRYPT_ERR;
-    }
+static void
+int_compiled_definition_mark(krypt_asn1_compiled_definition *compiled)
+{
+    if (!compiled) return;
+    rb_gc_mark(compiled->definition);
+    int_definition_mark(compiled->root);
+    if (compiled->match_root != compiled->root)
+	int_definition_mark(compiled->match_root);
+}
 
-    in = binyo_instream_new_bytes(p, len);
+static void
+int_compiled_definition_free(krypt_asn1_compiled_definition *compiled)
+{
+    if (!compiled) return;
+    if (compiled->match_root != compiled->root)
+	int_definition_free(compiled->match_root);
+    int_definition_free(compiled->root);
+    xfree(compiled);
+}
+
+/* Returns the compiled definition of +klass+, compiling it on first use
+ * or if the class has been assigned a new definition in the meantime. */
+static VALUE
+int_compiled_definition_for(VALUE klass)
+{
+    VALUE definition, vcompiled;
+    krypt_asn1_compiled_definition *compiled;
 
-    mod_p = rb_funcall(type, rb_intern("include?"), 1, mKryptASN1Template);
-    if (RTEST(mod_p)) {
-	if (int_decode_cons_of_templates(in, type, &val_ary) == KRYPT_ERR) return KRYPT_ERR;
+    if (NIL_P((definition = krypt_definition_get(klass)))) {
+        krypt_error_add("%s has no ASN.1 definition", rb_class2name(klass));
+        return Qnil;
     }
-    else {
-	if (int_decode_cons_of_prim(in, type, &val_ary) == KRYPT_ERR) return KRYPT_ERR;
+
+    if (rb_ivar_defined(klass, sKrypt_IV_COMPILED_DEFINITION)) {
+	vcompiled = rb_ivar_get(klass, sKrypt_IV_COMPILED_DEFINITION);
+	Data_Get_Struct(vcompiled, krypt_asn1_compiled_definition, compiled);
+	if (compiled->definition == definition) return vcompiled;
     }
 
-    if (RARRAY_LEN(val_ary) == 0 && !krypt_definition_is_optional(def)) {
-	krypt_error_add("Mandatory value %s could not be parsed. Sequence is empty", rb_id2name(name));
-	goto error;
+    compiled = ALLOC(krypt_asn1_compiled_definition);
+    compiled->definition = definition;
+    compiled->root = compiled->match_root = NULL;
+    vcompiled = Data_Wrap_Struct(0, int_compiled_definition_mark, int_compiled_definition_free, compiled);
+
+    if (!(compiled->root = int_definition_compile(definition, krypt_hash_get_options(definition)))) return Qnil;
+    int_definition_number_fields(compiled->root);
+    if (NIL_P(krypt_definition_get_options(compiled->root)))
+	compiled->match_root = compiled->root;
+    else if (!(compiled->match_root = int_definition_compile(definition, Qnil))) /* top-level definition has no options */
+	return Qnil;
+    else
+	int_definition_number_fields(compiled->match_root);
+
+    rb_ivar_set(klass, sKrypt_IV_COMPILED_DEFINITION, vcompiled);
+    return vcompiled;
+}
+
+/* Returns the compiled definition of +klass+ that values are parsed with,
+ * +out+ receives the object keeping it alive. */
+krypt_asn1_definition *
+krypt_definition_compiled_for(VALUE klass, VALUE *out)
+{
+    VALUE vcompiled;
+    krypt_asn1_compiled_definition *compiled;
+
+    if (NIL_P((vcompiled = int_compiled_definition_for(klass)))) return NULL;
+    Data_Get_Struct(vcompiled, krypt_asn1_compiled_definition, compiled);
+    *out = vcompiled;
+    return compiled->root;
+}
+
+krypt_asn1_definition *
+krypt_definition_type_def(krypt_asn1_definition *def)
+{
+    return int_definition_type_def(def);
+}
+
+static void
+int_set_default_value(VALUE self, krypt_asn1_definition *def)
+{
+    krypt_asn1_template *template;
+    krypt_asn1_field *field;
+
+    /* set the default value, no more decoding needed */
+    krypt_asn1_template_get(self, template);
+    if (!(field = krypt_asn1_template_get_field(template, def))) return;
+    krypt_asn1_field_clear(field);
+    field->value = krypt_definition_get_default_value(def);
+    field->def = def;
+    field->flags = KRYPT_TEMPLATE_PARSED | KRYPT_TEMPLATE_DECODED;
+}
+
+static int
+int_check_optional_or_default(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) { 
+	const char *str = rb_id2name(def->name);
+        krypt_error_add("Mandatory value %s is missing", str);
+	return int_tag_and_class_mismatch(ctx->header, def, str);
     }
 
-    if (header->is_infinite) {
-	if(int_parse_eoc(in) == KRYPT_ERR) {
-	    krypt_error_add("No closing END OF CONTENTS found for %s", rb_id2name(name));
-	    goto error;
-	}
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_HAS_DEFAULT)) {
+	int_set_default_value(self, def);
+	return INT_KRYPT_MATCH_DEFAULT_APPLIED;
     }
-    if (int_ensure_stream_is_consumed(in) == KRYPT_ERR) goto error;
 
-    *out = val_ary;
-    binyo_instream_free(in);
-    if (free_header) krypt_asn1_header_free(header);
-    return KRYPT_OK;
+    return INT_KRYPT_NO_MATCH;
+}
 
-error:
-    binyo_instream_free(in);
-    if (free_header) krypt_asn1_header_free(header);
-    return KRYPT_ERR;
+/* Does what the matcher of an OPTIONAL +def+ does if the tag does not match */
+static void
+int_skip_optional(VALUE self, krypt_asn1_definition *def)
+{
+    /* inline SEQUENCEs and SETs never had their DEFAULT applied */
+    if (def->codec == sKrypt_ID_SEQUENCE || def->codec == sKrypt_ID_SET) return;
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_HAS_DEFAULT))
+	int_set_default_value(self, def);
 }
 
 static int
-int_match_any(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+int_match_prim(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
 {
-    if (krypt_definition_is_optional(def)) {
-	VALUE tagging;
-	krypt_asn1_header *header;
-	int pseudo_default;
-	VALUE tag = krypt_definition_get_tag(def);
+    if (int_match_tag_and_class(ctx->header, def) == INT_KRYPT_MATCH) return INT_KRYPT_MATCH;
 
-	if (NIL_P(tag)) {
-	    return INT_KRYPT_MATCH;
-	}
-	tagging = krypt_definition_get_tagging(def);
-	header = ctx->header;
-	pseudo_default = NUM2INT(tag);
-	if (!int_match_tag_and_class(header, tag, tagging, pseudo_default)) {
-	    if (krypt_definition_has_default(def)) {
-		int_set_default_value(self, def);
-		return INT_KRYPT_MATCH_DEFAULT_APPLIED;
-	    }
-	    return INT_KRYPT_NO_MATCH;
-	}
+    return int_check_optional_or_default(self, ctx, def);
+}
+
+/* Values inherit the decode flags of their parent, the 'raw' option
+ * additionally enables raw INTEGERs for this value and anything below it. */
+static int
+int_inherit_decode_flags(VALUE self, krypt_asn1_definition *def)
+{
+    krypt_asn1_template *parent;
+    int flags;
+
+    krypt_asn1_template_get(self, parent);
+    flags = parent->decode_flags;
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_RAW))
+	flags |= KRYPT_ASN1_DECODE_RAW_INTEGER;
+    return flags;
+}
+
+/* Creates the template for the TEMPLATE field +def+ of +self+, it shares
+ * the compiled definition tree of its parent. If +borrowed+ is set, the
+ * bytes of +object+ belong to the encoding of +self+. */
+static krypt_asn1_template *
+int_inner_template_new(VALUE self, krypt_asn1_object *object, int borrowed, krypt_asn1_definition *def, krypt_asn1_definition *type_def)
+{
+    krypt_asn1_template *parent, *t;
+
+    krypt_asn1_template_get(self, parent);
+    t = krypt_asn1_template_new(object, krypt_definition_get_definition(type_def), krypt_definition_get_options(def));
+    t->decode_flags = int_inherit_decode_flags(self, def);
+    t->def = type_def;
+    t->compiled = parent->compiled;
+    /* TEMPLATE values leading to projected fields are projected as well */
+    if (!NIL_P(parent->only) && rb_hash_lookup(parent->only, ID2SYM(def->name)) != Qtrue)
+	t->only = parent->only;
+    if (borrowed)
+	t->owner = self;
+    return t;
+}
+
+/* Values are kept in the field array of +self+ as they were parsed, they
+ * are only decoded once they are accessed */
+static int
+int_parse_assign(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
+{
+    krypt_asn1_template *t;
+    krypt_asn1_field *field;
+
+    krypt_asn1_template_get(self, t);
+    if (!(field = krypt_asn1_template_get_field(t, def))) {
+	krypt_error_add("Value %s has no field", rb_id2name(def->name));
+	return KRYPT_ERR;
     }
-    return INT_KRYPT_MATCH;
+    krypt_asn1_field_clear(field);
+    field->object = object;
+    field->def = def;
+    field->flags = KRYPT_TEMPLATE_PARSED;
+    /* either a slice of the template's encoding or, for CHOICEs, the
+     * encoding itself which in turn may be borrowed */
+    if (int_object_borrows(object, t->object) || (object == t->object && !NIL_P(t->owner)))
+	field->flags |= KRYPT_TEMPLATE_BORROWED;
+    *dont_free = 1;
+    return KRYPT_OK;
 }
 
+/* TODO */
 static int
-int_decode_any(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, VALUE *out)
+int_decode_prim_inf(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out)
 {
-    VALUE value, tagging;
-    binyo_instream *in, *seq_a, *seq_b, *seq_c;
+    rb_raise(rb_eNotImpError, "Not implemented yet");
+}
+
+static int
+int_decode_prim(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out)
+{
+    VALUE value;
+    krypt_asn1_object *object = field->object;
     krypt_asn1_header *header = object->header;
-    int free_header = 0;
+    krypt_asn1_codec *codec;
+    int free_header = 0, default_tag = def->default_tag, decode_flags;
     uint8_t *p;
     size_t len;
 
-    tagging = krypt_definition_get_tagging(def);
+    if (header->is_infinite)
+	return int_decode_prim_inf(self, field, def, out);
 
-    if(!(header = int_unpack_explicit(tagging, object, &p, &len, &free_header))) return KRYPT_ERR;
+    decode_flags = int_inherit_decode_flags(self, def);
 
-    seq_a = binyo_instream_new_bytes(header->tag_bytes, header->tag_len);
-    seq_b = binyo_instream_new_bytes(header->length_bytes, header->length_len);
-    seq_c = binyo_instream_new_bytes(p, len);
-    in = binyo_instream_new_seq_n(3, seq_a, seq_b, seq_c);
-    if (krypt_asn1_decode_stream(in, &value) != KRYPT_OK) goto error;
+    if (!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if (header->is_constructed) {
+	krypt_error_add("Constructed bit set");
+	goto error;
+    }
+
+    /* BIT STRING and OCTET STRING values may hold DER that is decoded in place */
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_ENCAPSULATED)) {
+	if (krypt_asn1_decode_encapsulated(default_tag, p, len, decode_flags, &value) == KRYPT_ERR)
+	    goto error;
+    }
+    else if (!(codec = krypt_asn1_codec_for(TAG_CLASS_UNIVERSAL, default_tag))) {
+        krypt_error_add("No codec available for default tag %d", default_tag);
+	goto error;
+    }
+    else {
+	if (codec == &krypt_asn1_codecs[TAGS_BIT_STRING]) {
+	    /* the unused bits are kept in the field, not in +self+ */
+	    if (krypt_asn1_decode_bit_string(p, len, decode_flags, &field->unused_bits, &value) == KRYPT_ERR)
+		goto error;
+	}
+	else if (krypt_asn1_codec_decode(codec, self, p, len, decode_flags, &value) == KRYPT_ERR)
+	    goto error;
+    }
 
-    binyo_instream_free(in);
     if (free_header) krypt_asn1_header_free(header);
     *out = value;
     return KRYPT_OK;
 
 error: {
-    ID name = int_determine_name(krypt_definition_get_name(def));
-    binyo_instream_free(in);
-    krypt_error_add("Error while decoding value %s", rb_id2name(name));
+    krypt_error_add("Error while decoding value %s", rb_id2name(def->name));
     if (free_header) krypt_asn1_header_free(header);
     return KRYPT_ERR;
        }
 }
 
 static int
-int_enforce_explicit_tagging(krypt_asn1_definition *def, VALUE *tagging)
+int_match_cons(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
 {
-    VALUE tc = krypt_definition_get_tagging(def);
-    if (!(NIL_P(tc) || SYM2ID(tc) == sKrypt_TC_EXPLICIT)) {
-        krypt_error_add("Only explicit tagging is allowed for CHOICEs");
-        return KRYPT_ERR;
+    int match = int_try_match_cons(ctx, def);
+
+    if (match == INT_KRYPT_MATCH || match == INT_KRYPT_MATCH_ERR) return match;
+
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
+	krypt_error_add("Mandatory sequence value not found");
+	return int_tag_and_class_mismatch(ctx->header, def, "Constructed");
     }
-    *tagging = tc;
-    return KRYPT_OK;
+    return INT_KRYPT_NO_MATCH;
 }
 
 static int
-int_match_choice(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+int_match_sequence(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
 {
-    VALUE layout, tagging;
-    long i, layout_size, first_any = -1;
-    struct krypt_asn1_template_match_ctx inner_ctx;
-    
-    get_or_raise(layout, krypt_definition_get_layout(def), "'layout' missing in ASN.1 definition");
-    if (int_enforce_explicit_tagging(def, &tagging) == KRYPT_ERR) return INT_KRYPT_MATCH_ERR;
-    int_match_ctx_init(&inner_ctx, ctx->object);
-    /* No match if tagging was explicit but we can't skip the header */
-    if (!(NIL_P(tagging) || int_match_ctx_skip_header(&inner_ctx) == KRYPT_OK)) 
-	return INT_KRYPT_NO_MATCH; 
-    
-    layout_size = RARRAY_LEN(layout);
-    for (i=0; i < layout_size; ++i) {
-	ID codec;
-	int result;
-	krypt_asn1_definition inner_def;
-	struct krypt_asn1_template_parse_ctx *parser;
-	VALUE options;
-	VALUE cur_def = rb_ary_entry(layout, i);
+    return int_match_cons(self, ctx, def);
+}
 
-	krypt_error_clear();
-        options = krypt_hash_get_options(cur_def);
-	krypt_definition_init(&inner_def, cur_def, options);
-	codec = SYM2ID(krypt_hash_get_codec(cur_def));
-	parser = int_get_parse_ctx_for_codec(codec);
-	if (codec == sKrypt_ID_ANY && first_any == -1) {
-	    first_any = i;
+static int
+int_match_set(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    return int_match_cons(self, ctx, def);
+}
+
+static int
+int_ensure_rest_is_optional(VALUE self, krypt_asn1_definition *def, long index)
+{
+    long i;
+
+    for (i=index; i < def->layout_size; ++i) {
+	krypt_asn1_definition *cur_def = def->layout[i];
+
+	if (!krypt_definition_has_flag(cur_def, KRYPT_DEFINITION_F_OPTIONAL)) {
+	    krypt_error_add("Mandatory value %s not found", rb_id2name(cur_def->name));
+	    return KRYPT_ERR;
 	}
-	
-	if ((result = parser->match(self, &inner_ctx, &inner_def)) == INT_KRYPT_MATCH) {
-            int_match_ctx_cleanup(&inner_ctx);
-	    krypt_definition_set_matched_layout(def, i);
-	    return INT_KRYPT_MATCH;
+	if (krypt_definition_has_flag(cur_def, KRYPT_DEFINITION_F_HAS_DEFAULT)) {
+	    int_set_default_value(self, cur_def);
 	}
-	
-        if (result == INT_KRYPT_MATCH_DEFAULT_APPLIED) {
-            int_match_ctx_cleanup(&inner_ctx);
-            return INT_KRYPT_MATCH_DEFAULT_APPLIED;
-        }
-	/* else -> didn't match */
-    }
-
-    int_match_ctx_cleanup(&inner_ctx);
-    
-    if (first_any != -1) {
-        krypt_definition_set_matched_layout(def, first_any); /*the first ANY value matches if no other will */
-        return INT_KRYPT_MATCH;
     }
+    return KRYPT_OK;
+}
 
-    if (!krypt_definition_is_optional(def)) {
-	krypt_error_add("Mandatory CHOICE value not found");
-	return INT_KRYPT_MATCH_ERR;
-    }
-    return INT_KRYPT_NO_MATCH;
+/* Fields that are not part of the template's projection are only matched */
+static int
+int_projection_skips(krypt_asn1_template *t, krypt_asn1_definition *def)
+{
+    if (NIL_P(t->only) || !def->name || def->name == sKrypt_IV_VALUE) return 0;
+    return NIL_P(rb_hash_lookup(t->only, ID2SYM(def->name)));
 }
 
-static krypt_asn1_object *
-int_skip_explicit_choice_header(VALUE tagging, krypt_asn1_object *object, int *new_object)
+static int
+int_parse_cons(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
 {
     binyo_instream *in;
-    krypt_asn1_object *next_object = NULL;
+    long num_parsed = 0, layout_size = def->layout_size, min_size = def->min_size, i;
+    krypt_asn1_header *header = object->header;
+    krypt_asn1_object *cur_object = NULL;
+    krypt_asn1_template *t;
+    int object_consumed = 0, free_header = 0, slicing;
+    uint8_t *p;
+    size_t len, offset = 0;
 
-    if (NIL_P(tagging)) {
-	*new_object = 0;
-	return object;
+    if(!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if (!header->is_constructed) {
+	krypt_error_add("Constructed bit not set");
+	return KRYPT_ERR;
     }
 
-    in = binyo_instream_new_bytes(object->bytes, object->bytes_len);
-    if (int_next_object(in, &next_object) != KRYPT_OK) {
-	binyo_instream_free(in);
-	krypt_error_add("Error while trying to read next value");
-	return NULL;
-    }
+    /* Fields of a template's own encoding refer to slices of it instead of
+     * copies, the template keeps the encoding to re-encode unmodified fields */
+    krypt_asn1_template_get(self, t);
+    slicing = (object == t->object);
 
-    binyo_instream_free(in);
-    *new_object = 1;
-    return next_object;
-}
+    in = binyo_instream_new_bytes(p, len);
+    if (int_next_object_slice(in, p, len, &offset, &slicing, &cur_object) != KRYPT_OK) goto error;
+
+    for (i=0; i < layout_size; ++i) {
+	int result;
+	krypt_asn1_definition *inner_def = def->layout[i];
+	struct krypt_asn1_template_parse_ctx *parser = inner_def->parser;
+	struct krypt_asn1_template_match_ctx ctx;
+
+	/* OPTIONAL values that can't start with the next tag are skipped right away */
+	if (krypt_definition_has_flag(inner_def, KRYPT_DEFINITION_F_OPTIONAL) &&
+	    !int_definition_may_start_with(inner_def, cur_object->header)) {
+	    int_skip_optional(self, inner_def);
+	    continue;
+	}
+
+	krypt_error_clear();
+	int_match_ctx_init(&ctx, cur_object);
+
+	if ((result = parser->match(self, &ctx, inner_def)) != INT_KRYPT_MATCH_ERR) {
+	    if (result == INT_KRYPT_MATCH) {
+		int inner_dont_free = 0;
+		if (!int_projection_skips(t, inner_def) &&
+		    parser->parse(self, cur_object, inner_def, &inner_dont_free) == KRYPT_ERR) goto error;
+		if (!inner_dont_free) int_object_release(cur_object, object);
+		object_consumed = 1;
+		num_parsed++;
+		if (i < layout_size - 1) {
+		    int has_more = int_next_object_slice(in, p, len, &offset, &slicing, &cur_object);
+		    if (has_more == KRYPT_ERR) goto error;
+		    if (has_more == KRYPT_ASN1_EOF) {
+		       	if (int_ensure_rest_is_optional(self, def, i+1) == KRYPT_ERR) goto error;
+			break; /* EOF reached */
+		    }
+		}
+	    } /* else -> didn't match or default value was set */
+	} else {
+	    goto error;
+	}
+    }
+
+    if (num_parsed < min_size) {
+	krypt_error_add("Expected %d..%d values. Got: %d", min_size, layout_size, num_parsed);
+	goto error;
+    }
+    if (header->is_infinite) {
+	if(int_parse_eoc(in) == KRYPT_ERR) {
+	    krypt_error_add("No closing END OF CONTENTS found for constructive value");
+	    goto error;
+	}
+    }
+    if (int_ensure_stream_is_consumed(in) == KRYPT_ERR) goto error;
+
+    binyo_instream_free(in);
+    if (free_header) krypt_asn1_header_free(header);
+    *dont_free = 0;
+    return KRYPT_OK;
+
+error:
+    binyo_instream_free(in);
+    if (cur_object && !object_consumed) int_object_release(cur_object, object);
+    if (free_header) krypt_asn1_header_free(header);
+    return KRYPT_ERR;
+} 
+
+/* Finds the field of the SET +def+ that +object+ is a value of. The
+ * fields that may start with its tag are found in the FIRST table of the
+ * SET, the ones accepting any tag are only tried if none of them match. */
+static int
+int_match_set_index(VALUE self, krypt_asn1_definition *def, krypt_asn1_object *object, const char *seen, long *matched)
+{
+    struct krypt_asn1_template_match_ctx ctx;
+    krypt_asn1_header *header = object->header;
+    long pos, i, duplicate = -1;
 
-static int
-int_parse_choice(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
-{
-    ID codec;
-    struct krypt_asn1_template_parse_ctx *parser;
-    struct krypt_asn1_template_match_ctx ctx;
-    VALUE layout, matched_def, matched_opts, tagging, type;
-    krypt_asn1_object *unpacked;
-    krypt_asn1_definition inner_def;
-    long matched_index;
-    int new_object, inner_dont_free;
-    
-    get_or_raise(layout, krypt_definition_get_layout(def), "'layout' missing in ASN.1 definition");
-    if (int_enforce_explicit_tagging(def, &tagging) == KRYPT_ERR) return KRYPT_ERR;
-    
-    /* determine the matching index */
     int_match_ctx_init(&ctx, object);
-    if (int_match_choice(self, &ctx, def) != INT_KRYPT_MATCH) {
-        krypt_error_add("Matching value not found");
-        return KRYPT_ERR;
+    for (pos = int_first_lookup(def, header->tag, header->tag_class);
+	 pos < def->first_size && def->first[pos].tag == header->tag && def->first[pos].tag_class == header->tag_class;
+	 ++pos) {
+	i = def->first[pos].index;
+	if (seen[i]) {
+	    duplicate = i;
+	    continue;
+	}
+	krypt_error_clear();
+	if (def->layout[i]->parser->match(self, &ctx, def->layout[i]) == INT_KRYPT_MATCH) {
+	    *matched = i;
+	    return KRYPT_OK;
+	}
+    }
+    if (def->first_wildcard != -1 || def->first_any != -1) {
+	for (i=0; i < def->layout_size; ++i) {
+	    krypt_asn1_definition *inner_def = def->layout[i], *target;
+	    if (seen[i] || !(target = int_first_target(inner_def)) || !int_first_is_any(target)) continue;
+	    krypt_error_clear();
+	    if (inner_def->parser->match(self, &ctx, inner_def) == INT_KRYPT_MATCH) {
+		*matched = i;
+		return KRYPT_OK;
+	    }
+	}
+    }
+
+    krypt_error_clear();
+    if (duplicate != -1)
+	krypt_error_add("Duplicate value %s in SET", rb_id2name(def->layout[duplicate]->name));
+    else
+	krypt_error_add("No value of the SET has tag %d (class %d)", header->tag, header->tag_class);
+    return KRYPT_ERR;
+}
+
+/* The values of a SET may come in any order, each of them is matched to
+ * its field with a single lookup. Fields that are still missing at the
+ * end are checked in one go. */
+static int
+int_parse_set(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
+{
+    binyo_instream *in;
+    long layout_size = def->layout_size, i;
+    krypt_asn1_header *header = object->header;
+    krypt_asn1_object *cur_object = NULL;
+    krypt_asn1_template *t;
+    char *seen = NULL;
+    int free_header = 0, slicing, result;
+    uint8_t *p;
+    size_t len, offset = 0;
+
+    if(!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if (!header->is_constructed || int_definition_first_compute(def, 0) == KRYPT_ERR) {
+	if (!header->is_constructed) krypt_error_add("Constructed bit not set");
+	if (free_header) krypt_asn1_header_free(header);
+	return KRYPT_ERR;
+    }
+
+    krypt_asn1_template_get(self, t);
+    slicing = (object == t->object);
+    seen = ALLOC_N(char, layout_size + 1);
+    memset(seen, 0, layout_size + 1);
+
+    in = binyo_instream_new_bytes(p, len);
+    while ((result = int_next_object_slice(in, p, len, &offset, &slicing, &cur_object)) == KRYPT_OK) {
+	krypt_asn1_definition *inner_def;
+	int inner_dont_free = 0;
+
+	if (header->is_infinite &&
+	    cur_object->header->tag == TAGS_END_OF_CONTENTS &&
+	    cur_object->header->tag_class == TAG_CLASS_UNIVERSAL) {
+	    int_object_release(cur_object, object);
+	    cur_object = NULL;
+	    break;
+	}
+	if (int_match_set_index(self, def, cur_object, seen, &i) == KRYPT_ERR) goto error;
+	inner_def = def->layout[i];
+	if (!int_projection_skips(t, inner_def) &&
+	    inner_def->parser->parse(self, cur_object, inner_def, &inner_dont_free) == KRYPT_ERR) goto error;
+	if (!inner_dont_free) int_object_release(cur_object, object);
+	cur_object = NULL;
+	seen[i] = 1;
+    }
+    if (result == KRYPT_ERR) goto error;
+
+    for (i=0; i < layout_size; ++i) {
+	if (seen[i]) continue;
+	if (!krypt_definition_has_flag(def->layout[i], KRYPT_DEFINITION_F_OPTIONAL)) {
+	    krypt_error_add("Mandatory value %s not found", rb_id2name(def->layout[i]->name));
+	    goto error;
+	}
+	int_skip_optional(self, def->layout[i]);
     }
-    matched_index = krypt_definition_get_matched_layout(def);
-    matched_def = rb_ary_entry(layout, matched_index);
-    matched_opts = krypt_hash_get_options(matched_def);
+    if (int_ensure_stream_is_consumed(in) == KRYPT_ERR) goto error;
+
+    binyo_instream_free(in);
+    xfree(seen);
+    if (free_header) krypt_asn1_header_free(header);
+    *dont_free = 0;
+    return KRYPT_OK;
+
+error:
+    binyo_instream_free(in);
+    xfree(seen);
+    if (cur_object) int_object_release(cur_object, object);
+    if (free_header) krypt_asn1_header_free(header);
+    return KRYPT_ERR;
+}
+
+static int
+int_match_template(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    krypt_asn1_definition *type_def;
+    int match;
     
-    /* Set up a temporary inner definition for actual parsing, using the matching definition */
-    krypt_definition_init(&inner_def, matched_def, matched_opts);
-    get_or_raise(type, krypt_definition_get_type(&inner_def), "'type' missing in inner choice definition");
+    if (!(type_def = int_definition_type_def(def))) return INT_KRYPT_MATCH_ERR;
+    match = type_def->parser->match(self, ctx, type_def);
+    if (match == INT_KRYPT_NO_MATCH) {
+	if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_HAS_DEFAULT)) {
+	    int_set_default_value(self, def);
+	    return INT_KRYPT_MATCH_DEFAULT_APPLIED;
+	}   
+    }
+    return match;
+}
+
+/* Nested templates are only instantiated once they are accessed, they
+ * take over the encoding of the field */
+static int
+int_decode_template(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out)
+{
+    VALUE instance;
+    krypt_asn1_definition *type_def;
+    krypt_asn1_template *t;
+
+    if (!(type_def = int_definition_type_def(def))) return KRYPT_ERR;
+    t = int_inner_template_new(self, field->object, field->flags & KRYPT_TEMPLATE_BORROWED, def, type_def);
+    krypt_asn1_template_set(krypt_definition_get_type(def), instance, t);
+    field->object = NULL;
+    field->flags &= ~KRYPT_TEMPLATE_BORROWED;
+    *out = instance;
+    return KRYPT_OK;
+}
+
+static int
+int_match_cons_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    int match = int_try_match_cons(ctx, def);
+
+    if (match == INT_KRYPT_MATCH || match == INT_KRYPT_MATCH_ERR) return match;
+    return int_check_optional_or_default(self, ctx, def);
+}
+
+static int
+int_match_seq_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    return int_match_cons_of(self, ctx, def);
+}
+
+static int
+int_match_set_of(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    return int_match_cons_of(self, ctx, def);
+}
+
+static int
+int_decode_cons_of_templates(binyo_instream *in, int is_infinite, VALUE type, int decode_flags, VALUE *out)
+{
+    krypt_asn1_header *header;
+    VALUE cur;
+    VALUE ary = rb_ary_new();
+    int result;
+
+    while ((result = int_next_element_header(in, is_infinite, &header)) == KRYPT_OK) {
+	if (NIL_P((cur = int_rb_template_new_initial(type, in, header, decode_flags)))) {
+	    krypt_asn1_header_free(header);
+	    return KRYPT_ERR;
+	}
+	rb_ary_push(ary, cur);
+    }
+    if (result == KRYPT_ERR) return KRYPT_ERR;
+    *out = ary;
+    return KRYPT_OK;
+}
+
+static int
+int_decode_cons_of_prim(binyo_instream *in, int is_infinite, VALUE type, int decode_flags, VALUE *out)
+{
+    krypt_asn1_header *header;
+    VALUE cur;
+    VALUE ary = rb_ary_new();
+    int result;
+
+    while ((result = int_next_element_header(in, is_infinite, &header)) == KRYPT_OK) {
+	if (krypt_asn1_decode_header_flags(in, header, decode_flags, &cur) == KRYPT_ERR) return KRYPT_ERR;
+	if (!rb_obj_is_kind_of(cur, type)) {
+	    krypt_error_add("Expected %s but got %s instead", rb_class2name(type), rb_class2name(CLASS_OF(cur)));
+	    return KRYPT_ERR;
+	}
+	rb_ary_push(ary, cur);
+    }
+    if (result == KRYPT_ERR) return KRYPT_ERR;
+    *out = ary;
+    return KRYPT_OK;
+}
+
+static void
+int_collection_mark(krypt_asn1_collection *c)
+{
+    if (!c) return;
+    rb_gc_mark(c->owner);
+    rb_gc_mark(c->type);
+    if (!NIL_P(c->cache))
+	rb_gc_mark(c->cache);
+}
+
+static void
+int_collection_free(krypt_asn1_collection *c)
+{
+    if (!c) return;
+    if (c->offsets)
+	xfree(c->offsets);
+    xfree(c);
+}
+
+/*
+ * Records where the elements in +p+ start by looking at their headers only.
+ * Sets *offsets to NULL if an element has infinite length, these are not
+ * indexed.
+ */
+static int
+int_collection_scan(uint8_t *p, size_t len, size_t **offsets, long *size)
+{
+    binyo_instream *in;
+    krypt_asn1_header *header;
+    size_t *ret, offset = 0, header_len;
+    long n = 0, capa = 16;
+    int result;
+
+    in = binyo_instream_new_bytes(p, len);
+    ret = ALLOC_N(size_t, capa);
+    ret[0] = 0;
+
+    while ((result = krypt_asn1_next_header(in, &header)) == KRYPT_OK) {
+	if (header->is_infinite) {
+	    krypt_asn1_header_free(header);
+	    binyo_instream_free(in);
+	    xfree(ret);
+	    *offsets = NULL;
+	    return KRYPT_OK;
+	}
+	header_len = header->tag_len + header->length_len;
+	if (header_len > len - offset || header->length > len - offset - header_len) {
+	    krypt_asn1_header_free(header);
+	    krypt_error_add("Premature EOF detected");
+	    goto error;
+	}
+	if (krypt_asn1_skip_value(in, header) == KRYPT_ERR) {
+	    krypt_asn1_header_free(header);
+	    goto error;
+	}
+	offset += header_len + header->length;
+	krypt_asn1_header_free(header);
+	if (n + 2 > capa) {
+	    capa *= 2;
+	    REALLOC_N(ret, size_t, capa);
+	}
+	ret[++n] = offset;
+    }
+    if (result == KRYPT_ERR) goto error;
+
+    binyo_instream_free(in);
+    *offsets = ret;
+    *size = n;
+    return KRYPT_OK;
+
+error:
+    binyo_instream_free(in);
+    xfree(ret);
+    return KRYPT_ERR;
+}
+
+/*
+ * Creates a Collection for the contents +p+ of the encoding of a field of
+ * +self+. Sets *out to Qnil if the contents can't be indexed.
+ */
+static int
+int_collection_new(VALUE self, krypt_asn1_definition *def, int decode_flags, uint8_t *p, size_t len, VALUE *out)
+{
+    krypt_asn1_collection *c;
+    size_t *offsets;
+    long size;
+
+    if (int_collection_scan(p, len, &offsets, &size) == KRYPT_ERR) return KRYPT_ERR;
+    if (!offsets) {
+	*out = Qnil;
+	return KRYPT_OK;
+    }
+
+    c = ALLOC(krypt_asn1_collection);
+    c->owner = self;
+    c->type = krypt_definition_get_type(def);
+    c->template_type = krypt_definition_has_flag(def, KRYPT_DEFINITION_F_TEMPLATE_TYPE);
+    c->decode_flags = decode_flags;
+    c->bytes = p;
+    c->offsets = offsets;
+    c->size = size;
+    c->cache = Qnil;
+    *out = Data_Wrap_Struct(cKryptASN1TemplateCollection, int_collection_mark, int_collection_free, c);
+    /* only now the cache is reachable by the GC */
+    if (!(decode_flags & KRYPT_ASN1_DECODE_NO_CACHE))
+	c->cache = rb_ary_new2(size);
+    return KRYPT_OK;
+}
+
+static int
+int_collection_element(krypt_asn1_collection *c, long i, VALUE *out)
+{
+    binyo_instream *in;
+    VALUE cur;
+    int result;
+
+    if (!NIL_P(c->cache) && !NIL_P((cur = rb_ary_entry(c->cache, i)))) {
+	*out = cur;
+	return KRYPT_OK;
+    }
+
+    in = binyo_instream_new_bytes(c->bytes + c->offsets[i], c->offsets[i + 1] - c->offsets[i]);
+    if (c->template_type) {
+	result = krypt_asn1_template_parse_stream(in, c->type, c->decode_flags, &cur);
+    }
+    else {
+	result = krypt_asn1_decode_stream_flags(in, c->decode_flags, &cur);
+	if (result == KRYPT_OK && !rb_obj_is_kind_of(cur, c->type)) {
+	    krypt_error_add("Expected %s but got %s instead", rb_class2name(c->type), rb_class2name(CLASS_OF(cur)));
+	    result = KRYPT_ERR;
+	}
+    }
+    binyo_instream_free(in);
+    if (result != KRYPT_OK) {
+	krypt_error_add("Could not decode element %ld", i);
+	return KRYPT_ERR;
+    }
+
+    if (!NIL_P(c->cache))
+	rb_ary_store(c->cache, i, cur);
+    *out = cur;
+    return KRYPT_OK;
+}
+
+static int
+int_decode_cons_of(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out)
+{
+    ID name = def->name;
+    binyo_instream *in;
+    VALUE type, val_ary;
+    uint8_t *p;
+    size_t len;
+    int free_header = 0, decode_flags;
+    krypt_asn1_object *object = field->object;
+    krypt_asn1_header *header = object->header;
+
+    type = krypt_definition_get_type(def);
+    decode_flags = int_inherit_decode_flags(self, def);
+
+    if (!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
+    if (!header->is_constructed) {
+	krypt_error_add("Constructed bit not set");
+	return KRYPT_ERR;
+    }
+
+    /* plain values are cheaper than a Collection, so they take precedence */
+    if ((decode_flags & KRYPT_ASN1_DECODE_PLAIN) && def->element_tag != -1 && !header->is_infinite) {
+	if (int_decode_plain_elements(self, def, decode_flags, p, len, &val_ary) == KRYPT_ERR) goto lazy_error;
+	if (!NIL_P(val_ary)) {
+	    if (RARRAY_LEN(val_ary) == 0 && !krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
+		krypt_error_add("Mandatory value %s could not be parsed. Sequence is empty", rb_id2name(name));
+		goto lazy_error;
+	    }
+	    if (free_header) krypt_asn1_header_free(header);
+	    *out = val_ary;
+	    return KRYPT_OK;
+	}
+	/* BER encoded elements are decoded as usual */
+    }
+
+    if ((decode_flags & KRYPT_ASN1_DECODE_LAZY) && !header->is_infinite) {
+	if (int_collection_new(self, def, decode_flags, p, len, &val_ary) == KRYPT_ERR) goto lazy_error;
+	if (!NIL_P(val_ary)) {
+	    krypt_asn1_collection *c;
+	    krypt_asn1_collection_get(val_ary, c);
+	    if (c->size == 0 && !krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
+		krypt_error_add("Mandatory value %s could not be parsed. Sequence is empty", rb_id2name(name));
+		goto lazy_error;
+	    }
+	    if (free_header) krypt_asn1_header_free(header);
+	    *out = val_ary;
+	    return KRYPT_OK;
+	}
+	/* elements of infinite length are decoded right away */
+    }
+
+    in = binyo_instream_new_bytes(p, len);
+
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_TEMPLATE_TYPE)) {
+	if (int_decode_cons_of_templates(in, header->is_infinite, type, decode_flags, &val_ary) == KRYPT_ERR) goto error;
+    }
+    else {
+	if (int_decode_cons_of_prim(in, header->is_infinite, type, decode_flags, &val_ary) == KRYPT_ERR) goto error;
+    }
+
+    if (RARRAY_LEN(val_ary) == 0 && !krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
+	krypt_error_add("Mandatory value %s could not be parsed. Sequence is empty", rb_id2name(name));
+	goto error;
+    }
+
+    if (int_ensure_stream_is_consumed(in) == KRYPT_ERR) goto error;
+
+    *out = val_ary;
+    binyo_instream_free(in);
+    if (free_header) krypt_asn1_header_free(header);
+    return KRYPT_OK;
+
+error:
+    binyo_instream_free(in);
+lazy_error:
+    if (free_header) krypt_asn1_header_free(header);
+    return KRYPT_ERR;
+}
+
+static int
+int_match_any(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
+	if (def->expected_tag == -1) {
+	    return INT_KRYPT_MATCH;
+	}
+	if (int_match_tag_and_class(ctx->header, def) != INT_KRYPT_MATCH) {
+	    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_HAS_DEFAULT)) {
+		int_set_default_value(self, def);
+		return INT_KRYPT_MATCH_DEFAULT_APPLIED;
+	    }
+	    return INT_KRYPT_NO_MATCH;
+	}
+    }
+    return INT_KRYPT_MATCH;
+}
+
+static int
+int_decode_any(VALUE self, krypt_asn1_field *field, krypt_asn1_definition *def, VALUE *out)
+{
+    VALUE value;
+    binyo_instream *in, *seq_a, *seq_b, *seq_c;
+    krypt_asn1_object *object = field->object;
+    krypt_asn1_header *header = object->header;
+    int free_header = 0;
+    uint8_t *p;
+    size_t len;
+
+    if(!(header = int_unpack_explicit(def, object, &p, &len, &free_header))) return KRYPT_ERR;
+
+    seq_a = binyo_instream_new_bytes(header->tag_bytes, header->tag_len);
+    seq_b = binyo_instream_new_bytes(header->length_bytes, header->length_len);
+    seq_c = binyo_instream_new_bytes(p, len);
+    in = binyo_instream_new_seq_n(3, seq_a, seq_b, seq_c);
+    if (krypt_asn1_decode_stream_flags(in, int_inherit_decode_flags(self, def), &value) != KRYPT_OK) goto error;
+
+    binyo_instream_free(in);
+    if (free_header) krypt_asn1_header_free(header);
+    *out = value;
+    return KRYPT_OK;
+
+error: {
+    binyo_instream_free(in);
+    krypt_error_add("Error while decoding value %s", rb_id2name(def->name));
+    if (free_header) krypt_asn1_header_free(header);
+    return KRYPT_ERR;
+       }
+}
+
+static int
+int_enforce_explicit_tagging(krypt_asn1_definition *def)
+{
+    VALUE tc = krypt_definition_get_tagging(def);
+    if (!(NIL_P(tc) || SYM2ID(tc) == sKrypt_TC_EXPLICIT)) {
+        krypt_error_add("Only explicit tagging is allowed for CHOICEs");
+        return KRYPT_ERR;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_match_choice_index(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def, long *matched)
+{
+    long pos, wildcard;
+    struct krypt_asn1_template_match_ctx inner_ctx;
+    
+    if (int_enforce_explicit_tagging(def) == KRYPT_ERR) return INT_KRYPT_MATCH_ERR;
+    if (int_definition_first_compute(def, 0) == KRYPT_ERR) return INT_KRYPT_MATCH_ERR;
+    int_match_ctx_init(&inner_ctx, ctx->object);
+    /* No match if tagging was explicit but we can't skip the header */
+    if (!(!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_EXPLICIT) || int_match_ctx_skip_header(&inner_ctx) == KRYPT_OK)) 
+	return INT_KRYPT_NO_MATCH; 
+    
+    /* Only the alternatives that may start with the tag found, plus the
+     * first one that accepts any tag, are tried - in layout order */
+    pos = int_first_lookup(def, inner_ctx.header->tag, inner_ctx.header->tag_class);
+    wildcard = def->first_wildcard;
+    for (;;) {
+	int result;
+	long i;
+	krypt_asn1_definition *inner_def;
+
+	if (pos < def->first_size &&
+	    def->first[pos].tag == inner_ctx.header->tag &&
+	    def->first[pos].tag_class == inner_ctx.header->tag_class &&
+	    (wildcard == -1 || def->first[pos].index < wildcard)) {
+	    i = def->first[pos++].index;
+	}
+	else if (wildcard != -1) {
+	    i = wildcard;
+	    wildcard = -1;
+	}
+	else {
+	    break;
+	}
+	inner_def = def->layout[i];
+
+	krypt_error_clear();
+	if ((result = inner_def->parser->match(self, &inner_ctx, inner_def)) == INT_KRYPT_MATCH) {
+            int_match_ctx_cleanup(&inner_ctx);
+	    *matched = i;
+	    return INT_KRYPT_MATCH;
+	}
+	
+        if (result == INT_KRYPT_MATCH_DEFAULT_APPLIED) {
+            int_match_ctx_cleanup(&inner_ctx);
+            return INT_KRYPT_MATCH_DEFAULT_APPLIED;
+        }
+	/* else -> didn't match */
+    }
+
+    int_match_ctx_cleanup(&inner_ctx);
+    
+    if (def->first_any != -1) {
+        *matched = def->first_any; /*the first ANY value matches if no other will */
+        return INT_KRYPT_MATCH;
+    }
+
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL)) {
+	krypt_error_add("Mandatory CHOICE value not found");
+	return INT_KRYPT_MATCH_ERR;
+    }
+    return INT_KRYPT_NO_MATCH;
+}
+
+static int
+int_match_choice(VALUE self, struct krypt_asn1_template_match_ctx *ctx, krypt_asn1_definition *def)
+{
+    long matched;
+    return int_match_choice_index(self, ctx, def, &matched);
+}
+
+static krypt_asn1_object *
+int_skip_explicit_choice_header(krypt_asn1_definition *def, krypt_asn1_object *object, int *new_object)
+{
+    binyo_instream *in;
+    krypt_asn1_object *next_object = NULL;
+
+    if (!krypt_definition_has_flag(def, KRYPT_DEFINITION_F_EXPLICIT)) {
+	*new_object = 0;
+	return object;
+    }
+
+    in = binyo_instream_new_bytes(object->bytes, object->bytes_len);
+    if (int_next_object(in, &next_object) != KRYPT_OK) {
+	binyo_instream_free(in);
+	krypt_error_add("Error while trying to read next value");
+	return NULL;
+    }
+
+    binyo_instream_free(in);
+    *new_object = 1;
+    return next_object;
+}
+
+static int
+int_parse_choice(VALUE self, krypt_asn1_object *object, krypt_asn1_definition *def, int *dont_free)
+{
+    struct krypt_asn1_template_match_ctx ctx;
+    VALUE type;
+    krypt_asn1_object *unpacked;
+    krypt_asn1_definition *inner_def;
+    long matched_index;
+    int new_object, inner_dont_free;
+    
+    /* determine the matching index */
+    int_match_ctx_init(&ctx, object);
+    if (int_match_choice_index(self, &ctx, def, &matched_index) != INT_KRYPT_MATCH) {
+        krypt_error_add("Matching value not found");
+        return KRYPT_ERR;
+    }
+    inner_def = def->layout[matched_index];
+    get_or_raise(type, krypt_definition_get_type(inner_def), "'type' missing in inner choice definition");
+
+    if (!(unpacked = int_skip_explicit_choice_header(def, object, &new_object))) return KRYPT_ERR;
+    
+    if (inner_def->parser->parse(self, unpacked, inner_def, &inner_dont_free) == KRYPT_ERR) return KRYPT_ERR;
+
+    rb_ivar_set(self, sKrypt_IV_TYPE, type);
+    rb_ivar_set(self, sKrypt_IV_TAG, INT2NUM(unpacked->header->tag));
+    
+    /* complicated cleanup */
+    if (!inner_dont_free) {
+	if (new_object)
+	    krypt_asn1_object_free(unpacked); /* free the unpacked object also, since bytes were copied in inner processing */
+	*dont_free = 0; /* free the argument object in any case */
+    } else {
+	if (new_object)
+	    *dont_free = 0; /* we unpacked the explicit tag, so free the argument object */
+	else
+	    *dont_free = 1; /* the original object was consumed as is within, so don't free it */
+    }
+
+    return KRYPT_OK;
+}
+
+static int
+int_template_parse(VALUE self, krypt_asn1_template *t)
+{
+    krypt_asn1_definition *def = t->def;
+    int dont_free = 0;
+
+    if (!def) {
+	krypt_error_add("Template value has no compiled definition");
+	return KRYPT_ERR;
+    }
+    if (def->parser->parse(self, t->object, def, &dont_free) == KRYPT_ERR) return KRYPT_ERR;
+    krypt_asn1_template_set_parsed(t, 1);
+    krypt_asn1_template_set_decoded(t, 1);
+    if (!NIL_P(t->only) && (def->codec == sKrypt_ID_SEQUENCE || def->codec == sKrypt_ID_SET))
+	krypt_asn1_template_set_projected(t, 1);
+
+    /* If dont_free is 1 the object was consumed as is by an inner value,
+     * otherwise it is kept: the fields refer to slices of its bytes and it
+     * is reused as the encoding as long as no value below is modified */
+    if (dont_free)
+	t->object = NULL;
+    return KRYPT_OK;
+}
+
+/* Returns the value of +field+ of +self+, decoding it on first access */
+int
+krypt_asn1_template_field_value(VALUE self, krypt_asn1_field *field, VALUE *out)
+{
+    VALUE value;
+    krypt_asn1_definition *def = field->def;
+
+    if (!(field->flags & KRYPT_TEMPLATE_DECODED)) {
+	if (!def || !def->parser->decode) {
+	    krypt_error_add("Template value has no compiled definition");
+	    return KRYPT_ERR;
+	}
+	if (def->parser->decode(self, field, def, &value) == KRYPT_ERR) return KRYPT_ERR;
+	field->flags |= KRYPT_TEMPLATE_DECODED;
+	field->value = value;
+    }
+    *out = field->value;
+    return KRYPT_OK;
+}
+
+/* Parses +self+ if needed, templates created with new also compile their
+ * definition here, on first access */
+int
+krypt_asn1_template_prepare(VALUE self, krypt_asn1_template *t)
+{
+    if (!(krypt_asn1_template_is_parsed(t))) {
+	if (int_template_parse(self, t) == KRYPT_ERR) return KRYPT_ERR;
+    }
+    if (!t->def && !(t->def = krypt_definition_compiled_for(CLASS_OF(self), &t->compiled))) return KRYPT_ERR;
+    return KRYPT_OK;
+}
+
+int
+krypt_asn1_template_get_cb_value(VALUE self, ID ivname, VALUE *out)
+{
+    krypt_asn1_template *template;
+    long index;
+
+    krypt_asn1_template_get(self, template);
+    if (krypt_asn1_template_prepare(self, template) == KRYPT_ERR) return KRYPT_ERR;
+    index = krypt_definition_field_index(template->def, ivname);
+    if (index == -1 || index >= template->num_fields || !template->fields[index].flags) {
+	*out = Qnil;
+	return KRYPT_OK;
+    }
+    return krypt_asn1_template_field_value(self, &template->fields[index], out);
+}
+
+/* Replaces the value of the field at +index+, the template must have been
+ * prepared, parsing it later on would overwrite the new value */
+void
+krypt_asn1_template_assign(krypt_asn1_template *t, long index, VALUE value)
+{
+    krypt_asn1_field *field;
+
+    field = krypt_asn1_template_field(t, index);
+    krypt_asn1_template_set_modified(t, 1);
+    field->flags |= KRYPT_TEMPLATE_PARSED | KRYPT_TEMPLATE_DECODED | KRYPT_TEMPLATE_MODIFIED;
+    field->value = value;
+}
+
+void
+krypt_asn1_template_set_cb_value(VALUE self, ID ivname, VALUE value)
+{
+    krypt_asn1_template *template;
+    long index;
+
+    krypt_asn1_template_get(self, template);
+    if (krypt_asn1_template_prepare(self, template) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Could not access %s", rb_id2name(ivname));
+    if ((index = krypt_definition_field_index(template->def, ivname)) == -1)
+	rb_raise(eKryptASN1Error, "Unknown field %s", rb_id2name(ivname));
+    krypt_asn1_template_assign(template, index, value);
+}
+
+static VALUE
+int_rb_template_new_initial(VALUE klass, binyo_instream *in, krypt_asn1_header *header, int decode_flags)
+{
+    VALUE obj;
+    VALUE vcompiled;
+    krypt_asn1_template *template;
+    krypt_asn1_compiled_definition *compiled;
+    krypt_asn1_definition *def;
+    struct krypt_asn1_template_match_ctx ctx;
+
+    if (NIL_P((vcompiled = int_compiled_definition_for(klass)))) return Qnil;
+    Data_Get_Struct(vcompiled, krypt_asn1_compiled_definition, compiled);
+
+    if (!(template = krypt_asn1_template_new_from_stream(in, header, compiled->definition, krypt_hash_get_options(compiled->definition)))) {
+        krypt_error_add("Error while reading data");
+        return Qnil;
+    }
+    template->decode_flags = decode_flags;
+    template->def = compiled->root;
+    template->compiled = vcompiled;
+
+    /* ensure it matches */
+    def = compiled->match_root;
+    int_match_ctx_init(&ctx, template->object);
+    obj = rb_obj_alloc(klass);
+    DATA_PTR(obj) = template;
+    if (def->parser->match(obj, &ctx, def) != INT_KRYPT_MATCH) {
+	krypt_error_add("Type mismatch");
+	/* the header is released by the caller */
+	DATA_PTR(obj) = NULL;
+	template->object->header = NULL;
+	krypt_asn1_template_free(template);
+	return Qnil;
+    }
+    return obj;
+}
+
+static int
+krypt_asn1_template_parse_stream(binyo_instream *in, VALUE klass, int decode_flags, VALUE *out)
+{
+    krypt_asn1_header *header;
+    VALUE ret;
+    int result;
+
+    result = krypt_asn1_next_header(in, &header);
+    if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR) return result;
+
+    ret = int_rb_template_new_initial(klass, in, header, decode_flags);
+    if (NIL_P(ret)) {
+	krypt_asn1_header_free(header);
+	return KRYPT_ERR;
+    }
+    *out = ret;
+    return KRYPT_OK;
+}
+
+/* Field names may be given with or without the leading '@' */
+static ID
+int_field_id(VALUE name)
+{
+    const char *str = rb_id2name(SYM2ID(rb_to_symbol(name)));
+
+    return str[0] == '@' ? rb_intern(str) : rb_intern_str(rb_sprintf("@%s", str));
+}
+
+/*
+ * Marks the fields below +def+ that are in +names+ with true, and the
+ * TEMPLATE fields leading to them with :path. Returns whether any were
+ * found.
+ */
+static int
+int_projection_collect(krypt_asn1_definition *def, VALUE names, VALUE fields, int depth)
+{
+    krypt_asn1_definition *inner_def, *type_def;
+    VALUE name;
+    long i;
+    int found = 0;
+
+    if (depth > INT_KRYPT_FIRST_MAX_DEPTH) return 0;
+    if (def->codec != sKrypt_ID_SEQUENCE && def->codec != sKrypt_ID_SET && def->codec != sKrypt_ID_CHOICE) return 0;
+
+    for (i=0; i < def->layout_size; ++i) {
+	inner_def = def->layout[i];
+	name = inner_def->name && inner_def->name != sKrypt_IV_VALUE ? ID2SYM(inner_def->name) : Qnil;
+	if (!NIL_P(name) && RTEST(rb_hash_lookup(names, name))) {
+	    rb_hash_aset(fields, name, Qtrue);
+	    found = 1;
+	    continue;
+	}
+	if (inner_def->codec != sKrypt_ID_TEMPLATE) continue;
+	if (!(type_def = int_definition_type_def(inner_def))) {
+	    krypt_error_clear();
+	    continue;
+	}
+	if (int_projection_collect(type_def, names, fields, depth + 1)) {
+	    found = 1;
+	    if (!NIL_P(name) && NIL_P(rb_hash_lookup(fields, name)))
+		rb_hash_aset(fields, name, ID2SYM(sKrypt_ID_PATH));
+	}
+    }
+    return found;
+}
+
+/* Returns the frozen Hash of fields to parse for +only+ on +klass+ */
+static VALUE
+int_projection_fields(VALUE klass, VALUE only)
+{
+    VALUE names, fields, dummy, name;
+    krypt_asn1_definition *root;
+    long i;
+
+    if (rb_obj_is_kind_of(only, cKryptASN1TemplateProjection)) {
+	if (rb_ivar_get(only, sKrypt_IV_PROJECTION_TEMPLATE) != klass) {
+	    krypt_error_add("Projection belongs to %s", rb_class2name(rb_ivar_get(only, sKrypt_IV_PROJECTION_TEMPLATE)));
+	    return Qnil;
+	}
+	return rb_ivar_get(only, sKrypt_IV_PROJECTION_FIELDS);
+    }
+
+    if (!(root = krypt_definition_compiled_for(klass, &dummy))) return Qnil;
+    only = rb_Array(only);
+    names = rb_hash_new();
+    for (i=0; i < RARRAY_LEN(only); ++i)
+	rb_hash_aset(names, ID2SYM(int_field_id(rb_ary_entry(only, i))), Qtrue);
+
+    fields = rb_hash_new();
+    int_projection_collect(root, names, fields, 0);
+    for (i=0; i < RARRAY_LEN(only); ++i) {
+	name = ID2SYM(int_field_id(rb_ary_entry(only, i)));
+	if (rb_hash_lookup(fields, name) != Qtrue) {
+	    krypt_error_add("Unknown field %s", rb_id2name(SYM2ID(name)));
+	    return Qnil;
+	}
+    }
+    return rb_obj_freeze(fields);
+}
+
+/*
+ * call-seq:
+ *    Template.projection(*names) -> Template::Projection
+ *
+ * Prepares parsing only the fields +names+, at any depth, of values of
+ * this template. Fields that are not requested, or that do not lead to
+ * a requested field, are skipped over without being decoded and read as
+ * nil. Projected values can be encoded again as long as they are not
+ * modified.
+ *
+ * == Example
+ *   fields = Certificate.projection(:serial_number, :not_after, :subject)
+ *   cert = fields.parse_der(der) # or Certificate.parse_der(der, only: fields)
+ */
+static VALUE
+krypt_asn1_template_projection(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE fields, ret;
+
+    if (NIL_P((fields = int_projection_fields(klass, rb_ary_new4(argc, argv)))))
+	krypt_error_raise(eKryptASN1Error, "Invalid projection");
+    ret = rb_obj_alloc(cKryptASN1TemplateProjection);
+    rb_ivar_set(ret, sKrypt_IV_PROJECTION_TEMPLATE, klass);
+    rb_ivar_set(ret, sKrypt_IV_PROJECTION_FIELDS, fields);
+    return rb_obj_freeze(ret);
+}
+
+/*
+ * call-seq:
+ *    projection.parse_der(der, [opts]) -> Template
+ *
+ * Same as Template.parse_der with +:only+ set to +projection+.
+ */
+static VALUE
+krypt_asn1_template_projection_parse_der(int argc, VALUE *argv, VALUE self)
+{
+    VALUE der, opts = Qnil, args[2];
+
+    rb_scan_args(argc, argv, "11", &der, &opts);
+    opts = NIL_P(opts) ? rb_hash_new() : rb_hash_dup(opts);
+    rb_hash_aset(opts, ID2SYM(sKrypt_ID_ONLY), self);
+    args[0] = der;
+    args[1] = opts;
+    return krypt_asn1_template_parse_der(2, args, rb_ivar_get(self, sKrypt_IV_PROJECTION_TEMPLATE));
+}
+
+/*
+ * call-seq:
+ *    Template.parse_der(der, [opts]) -> Template
+ *
+ * * +der+: A DER-encoded +String+, an IO or any object that responds to
+ *          +to_der+.
+ * * +opts+: Decoding options, they are inherited by all fields. See
+ *           Krypt::ASN1.decode for the available options. In addition:
+ *   * +:lazy_collections+: if true, SEQUENCE OF and SET OF fields are
+ *     returned as Template::Collection, whose elements are only decoded
+ *     when they are accessed
+ *   * +:cache_elements+: if false, a Template::Collection decodes its
+ *     elements again on each access instead of keeping them
+ *   * +:plain_elements+: if true, SEQUENCE OF and SET OF fields of a
+ *     primitive type such as INTEGER, OBJECT IDENTIFIER or OCTET STRING
+ *     are returned as a frozen Array of their frozen Ruby values instead
+ *     of ASN1Data instances
+ *   * +:only+: an Array of field names or a Template::Projection, see
+ *     Template::Parser#projection
+ */
+VALUE
+krypt_asn1_template_parse_der(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE der, opts = Qnil, only = Qnil;
+    VALUE ret = Qnil;
+    int result;
+    binyo_instream *in;
+    krypt_asn1_template *template;
+
+    rb_scan_args(argc, argv, "11", &der, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+	if (!NIL_P((only = rb_hash_aref(opts, ID2SYM(sKrypt_ID_ONLY)))) &&
+	    NIL_P((only = int_projection_fields(klass, only))))
+	    krypt_error_raise(eKryptASN1Error, "Invalid projection");
+    }
+    in = krypt_instream_new_value_der(der);
+    result = krypt_asn1_template_parse_stream(in, klass, krypt_asn1_decode_flags_for(opts), &ret);
+    binyo_instream_free(in);
+    if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Parsing the value failed"); 
+    if (!NIL_P(only)) {
+	krypt_asn1_template_get(ret, template);
+	template->only = only;
+    }
+    return ret;
+}
+
+/* Validation
+ *
+ * Template.valid_der? walks the compiled definition along the encoding
+ * without creating any objects: headers are read right from the bytes and
+ * values are checked instead of decoded. Error messages are only collected
+ * when they are going to be raised. */
+
+#define INT_KRYPT_VIEW_MAX_DEPTH	64
+#define INT_KRYPT_VIEW_TAG_LIMIT	(INT_MAX >> CHAR_BIT_MINUS_ONE)
+#define INT_KRYPT_VIEW_LENGTH_LIMIT	(SIZE_MAX >> CHAR_BIT)
+
+typedef struct krypt_asn1_view_st {
+    int tag;
+    int tag_class;
+    int is_constructed;
+    int is_infinite;
+    uint8_t *value;
+    size_t value_len;	/* without the END OF CONTENTS of infinite length values */
+    size_t total;	/* header, value and END OF CONTENTS */
+} krypt_asn1_view;
+
+typedef struct krypt_asn1_view_ctx_st {
+    uint8_t *base;
+    int report;
+} krypt_asn1_view_ctx;
+
+static int
+int_view_error(krypt_asn1_view_ctx *ctx, uint8_t *p, const char *message, ID name)
+{
+    if (!ctx->report) return KRYPT_ERR;
+    if (name && name != sKrypt_IV_VALUE)
+	krypt_error_add("%s: %s at offset %ld", message, rb_id2name(name), (long) (p - ctx->base));
+    else
+	krypt_error_add("%s at offset %ld", message, (long) (p - ctx->base));
+    return KRYPT_ERR;
+}
+
+static int int_view_next(krypt_asn1_view_ctx *ctx, uint8_t *p, size_t len, krypt_asn1_view *v, int depth);
+
+/* Determines the length of an infinite length value by skipping its
+ * contents up to the closing END OF CONTENTS */
+static int
+int_view_skip_infinite(krypt_asn1_view_ctx *ctx, krypt_asn1_view *v, size_t len, int depth)
+{
+    krypt_asn1_view cur;
+    size_t offset = 0;
+
+    for (;;) {
+	if (offset == len)
+	    return int_view_error(ctx, v->value + offset, "No closing END OF CONTENTS found", 0);
+	if (len - offset >= 2 && v->value[offset] == 0 && v->value[offset + 1] == 0) {
+	    v->value_len = offset;
+	    v->total += offset + 2;
+	    return KRYPT_OK;
+	}
+	if (int_view_next(ctx, v->value + offset, len - offset, &cur, depth + 1) == KRYPT_ERR) return KRYPT_ERR;
+	offset += cur.total;
+    }
+}
+
+/* Reads the header of the value at +p+, which must lie within +len+ bytes */
+static int
+int_view_next(krypt_asn1_view_ctx *ctx, uint8_t *p, size_t len, krypt_asn1_view *v, int depth)
+{
+    size_t i = 0, length = 0, num_bytes;
+    int tag = 0;
+    uint8_t b;
+
+    if (depth > INT_KRYPT_VIEW_MAX_DEPTH) return int_view_error(ctx, p, "Values nested too deeply", 0);
+    if (len == 0) return int_view_error(ctx, p, "Premature EOF detected", 0);
+
+    b = p[i++];
+    v->tag_class = b & TAG_CLASS_PRIVATE;
+    v->is_constructed = (b & CONSTRUCTED_MASK) == CONSTRUCTED_MASK;
+    if ((b & COMPLEX_TAG_MASK) == COMPLEX_TAG_MASK) {
+	do {
+	    if (i == len) return int_view_error(ctx, p, "Premature EOF detected", 0);
+	    if (tag > INT_KRYPT_VIEW_TAG_LIMIT) return int_view_error(ctx, p, "Complex tag too large", 0);
+	    b = p[i++];
+	    if (i == 2 && b == INFINITE_LENGTH_MASK)
+		return int_view_error(ctx, p, "Bits 7 to 1 of the first subsequent octet shall not be 0 for complex tag encoding", 0);
+	    tag = (tag << CHAR_BIT_MINUS_ONE) | (b & 0x7f);
+	} while ((b & INFINITE_LENGTH_MASK) == INFINITE_LENGTH_MASK);
+    }
+    else {
+	tag = b & COMPLEX_TAG_MASK;
+    }
+    v->tag = tag;
+
+    if (i == len) return int_view_error(ctx, p, "Premature EOF detected", 0);
+    b = p[i++];
+    v->is_infinite = (b == INFINITE_LENGTH_MASK);
+    if (b == 0xff) return int_view_error(ctx, p, "Initial octet of complex definite length shall not be 0xFF", 0);
+    if (!v->is_infinite && (b & INFINITE_LENGTH_MASK) == INFINITE_LENGTH_MASK) {
+	num_bytes = b & 0x7f;
+	if (num_bytes > len - i) return int_view_error(ctx, p, "Premature EOF detected", 0);
+	while (num_bytes--) {
+	    if (length > INT_KRYPT_VIEW_LENGTH_LIMIT) return int_view_error(ctx, p, "Complex length too long", 0);
+	    length = (length << CHAR_BIT) | p[i++];
+	}
+    }
+    else if (!v->is_infinite) {
+	length = b;
+    }
+
+    v->value = p + i;
+    v->total = i;
+    if (v->is_infinite) {
+	if (!v->is_constructed) return int_view_error(ctx, p, "Infinite length values must be constructed", 0);
+	return int_view_skip_infinite(ctx, v, len - i, depth);
+    }
+    if (length > len - i) return int_view_error(ctx, p, "Premature EOF detected", 0);
+    v->value_len = length;
+    v->total += length;
+    return KRYPT_OK;
+}
+
+/* With KRYPT_ASN1_DECODE_PLAIN, the elements of a SEQUENCE OF or SET OF
+ * with a primitive universal type are decoded to a frozen Array of their
+ * frozen Ruby values instead of ASN1Data instances. The headers are read
+ * right from the bytes and the Array is allocated for the number of
+ * elements up front. Sets *out to Qnil if an element is not a primitive
+ * of the expected tag, these are left to the general decoding. */
+static int
+int_decode_plain_elements(VALUE self, krypt_asn1_definition *def, int decode_flags, uint8_t *p, size_t len, VALUE *out)
+{
+    krypt_asn1_view_ctx ctx;
+    krypt_asn1_view cur;
+    krypt_asn1_codec *codec;
+    uint8_t *q;
+    size_t left;
+    long num = 0;
+    VALUE ary, value;
+
+    if (!(codec = krypt_asn1_codec_for(TAG_CLASS_UNIVERSAL, def->element_tag))) {
+	*out = Qnil;
+	return KRYPT_OK;
+    }
+    ctx.base = p;
+    ctx.report = 1;
+    for (q = p, left = len; left > 0; q += cur.total, left -= cur.total) {
+	if (int_view_next(&ctx, q, left, &cur, 0) == KRYPT_ERR) return KRYPT_ERR;
+	if (cur.tag != def->element_tag || cur.tag_class != TAG_CLASS_UNIVERSAL || cur.is_constructed) {
+	    *out = Qnil;
+	    return KRYPT_OK;
+	}
+	num++;
+    }
+
+    ary = rb_ary_new2(num);
+    for (q = p, left = len; left > 0; q += cur.total, left -= cur.total) {
+	(void) int_view_next(&ctx, q, left, &cur, 0);
+	if (krypt_asn1_codec_decode(codec, self, cur.value, cur.value_len, decode_flags, &value) == KRYPT_ERR) {
+	    krypt_error_add("Could not decode element %ld of %s", RARRAY_LEN(ary), rb_id2name(def->name));
+	    return KRYPT_ERR;
+	}
+	rb_ary_push(ary, rb_obj_freeze(value));
+    }
+    *out = rb_obj_freeze(ary);
+    return KRYPT_OK;
+}
+
+/* The counterpart of the matchers, untagged CHOICEs are resolved to the
+ * alternative the value belongs to */
+static int
+int_view_matches(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v, int depth)
+{
+    krypt_asn1_definition *target;
+    long i;
+
+    if (depth > INT_KRYPT_VIEW_MAX_DEPTH) {
+	int_view_error(ctx, v->value, "Values nested too deeply", 0);
+	return INT_KRYPT_MATCH_ERR;
+    }
+    if (!(target = int_first_target(def))) return INT_KRYPT_MATCH_ERR;
+    if (target->codec == sKrypt_ID_CHOICE && target->expected_tag == -1) {
+	for (i=0; i < target->layout_size; ++i) {
+	    int match = int_view_matches(ctx, target->layout[i], v, depth + 1);
+	    if (match != INT_KRYPT_NO_MATCH) return match;
+	}
+	return INT_KRYPT_NO_MATCH;
+    }
+    if (int_first_is_any(target)) return INT_KRYPT_MATCH;
+    if (v->tag == target->expected_tag && v->tag_class == target->expected_tag_class)
+	return INT_KRYPT_MATCH;
+    return INT_KRYPT_NO_MATCH;
+}
+
+/* Cheap checks for contents that the codecs would reject */
+static int
+int_view_validate_contents(krypt_asn1_view_ctx *ctx, int tag, krypt_asn1_view *v, ID name)
+{
+    uint8_t *p = v->value;
+    size_t len = v->value_len;
+
+    switch (tag) {
+	case TAGS_BOOLEAN:
+	    if (len != 1) return int_view_error(ctx, p, "Boolean value with length != 1 found", name);
+	    break;
+	case TAGS_NULL:
+	    if (len != 0) return int_view_error(ctx, p, "Invalid encoding for NULL value found", name);
+	    break;
+	case TAGS_INTEGER:
+	case TAGS_ENUMERATED:
+	    if (len == 0) return int_view_error(ctx, p, "Invalid zero length value for INTEGER found", name);
+	    break;
+	case TAGS_OBJECT_ID:
+	    if (len == 0 || (p[len - 1] & 0x80))
+		return int_view_error(ctx, p, "Invalid OBJECT IDENTIFIER encoding", name);
+	    break;
+	case TAGS_BIT_STRING:
+	    if (len == 0 || p[0] > 7 || (len == 1 && p[0] != 0))
+		return int_view_error(ctx, p, "Invalid BIT STRING encoding", name);
+	    break;
+	default:
+	    break;
+    }
+    return KRYPT_OK;
+}
+
+static int
+int_view_validate_prim(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v)
+{
+    krypt_asn1_view inner;
+    uint8_t *p = v->value;
+    size_t len = v->value_len;
+
+    if (v->is_infinite) return KRYPT_OK; /* chunked values are only checked for well-formedness */
+    if (v->is_constructed) return int_view_error(ctx, v->value, "Constructed bit set", def->name);
+    if (int_view_validate_contents(ctx, def->default_tag, v, def->name) == KRYPT_ERR) return KRYPT_ERR;
+
+    /* BIT STRING and OCTET STRING values may hold DER themselves */
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_ENCAPSULATED)) {
+	if (def->default_tag == TAGS_BIT_STRING) {
+	    if (p[0] != 0) return int_view_error(ctx, p, "BIT STRING with unused bits cannot encapsulate a value", def->name);
+	    p++;
+	    len--;
+	}
+	if (int_view_next(ctx, p, len, &inner, 0) == KRYPT_ERR) return KRYPT_ERR;
+	if (inner.total != len) return int_view_error(ctx, p + inner.total, "Data left that could not be parsed", def->name);
+    }
+    return KRYPT_OK;
+}
+
+static int int_view_validate(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v, int depth);
+
+static int
+int_view_validate_cons(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v, int depth)
+{
+    krypt_asn1_view cur;
+    uint8_t *p = v->value;
+    size_t left = v->value_len;
+    long i, num_parsed = 0;
+    int has_cur = 0, match;
+
+    if (!v->is_constructed) return int_view_error(ctx, v->value, "Constructed bit not set", def->name);
+
+    for (i=0; i < def->layout_size; ++i) {
+	krypt_asn1_definition *inner_def = def->layout[i];
+	int optional = krypt_definition_has_flag(inner_def, KRYPT_DEFINITION_F_OPTIONAL);
+
+	if (!has_cur) {
+	    if (left == 0) {
+		if (!optional) return int_view_error(ctx, p, "Mandatory value not found", inner_def->name);
+		continue;
+	    }
+	    if (int_view_next(ctx, p, left, &cur, 0) == KRYPT_ERR) return KRYPT_ERR;
+	    has_cur = 1;
+	}
+	if ((match = int_view_matches(ctx, inner_def, &cur, depth + 1)) == INT_KRYPT_MATCH_ERR) return KRYPT_ERR;
+	if (match == INT_KRYPT_NO_MATCH) {
+	    if (optional) continue;
+	    return int_view_error(ctx, p, "Tag mismatch for mandatory value", inner_def->name);
+	}
+	if (int_view_validate(ctx, inner_def, &cur, depth + 1) == KRYPT_ERR) return KRYPT_ERR;
+	p += cur.total;
+	left -= cur.total;
+	has_cur = 0;
+	num_parsed++;
+    }
+
+    if (left > 0) return int_view_error(ctx, p, "Data left that could not be parsed", def->name);
+    if (num_parsed < def->min_size) return int_view_error(ctx, v->value, "Too few values found", def->name);
+    return KRYPT_OK;
+}
+
+/* The counterpart of int_parse_set, values are matched to their fields in
+ * any order with the same FIRST lookup as in int_match_set_index */
+static int
+int_view_validate_set(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v, int depth)
+{
+    krypt_asn1_view cur;
+    krypt_asn1_definition *target;
+    uint8_t *p = v->value;
+    size_t left = v->value_len;
+    char *seen;
+    long pos, i, matched, duplicate;
+    int match, result = KRYPT_ERR;
+
+    if (!v->is_constructed) return int_view_error(ctx, v->value, "Constructed bit not set", def->name);
+    if (int_definition_first_compute(def, 0) == KRYPT_ERR) return KRYPT_ERR;
+
+    seen = ALLOC_N(char, def->layout_size + 1);
+    memset(seen, 0, def->layout_size + 1);
+
+    while (left > 0) {
+	if (int_view_next(ctx, p, left, &cur, 0) == KRYPT_ERR) goto cleanup;
+	matched = -1;
+	duplicate = -1;
+	for (pos = int_first_lookup(def, cur.tag, cur.tag_class);
+	     matched == -1 && pos < def->first_size && 
+	     def->first[pos].tag == cur.tag && def->first[pos].tag_class == cur.tag_class;
+	     ++pos) {
+	    i = def->first[pos].index;
+	    if (seen[i]) {
+		duplicate = i;
+		continue;
+	    }
+	    if ((match = int_view_matches(ctx, def->layout[i], &cur, depth + 1)) == INT_KRYPT_MATCH_ERR) goto cleanup;
+	    if (match == INT_KRYPT_MATCH) matched = i;
+	}
+	if (matched == -1 && (def->first_wildcard != -1 || def->first_any != -1)) {
+	    for (i=0; matched == -1 && i < def->layout_size; ++i) {
+		if (seen[i] || !(target = int_first_target(def->layout[i])) || !int_first_is_any(target)) continue;
+		if ((match = int_view_matches(ctx, def->layout[i], &cur, depth + 1)) == INT_KRYPT_MATCH_ERR) goto cleanup;
+		if (match == INT_KRYPT_MATCH) matched = i;
+	    }
+	}
+	if (matched == -1) {
+	    if (duplicate != -1)
+		int_view_error(ctx, p, "Duplicate value in SET", def->layout[duplicate]->name);
+	    else
+		int_view_error(ctx, p, "No value of the SET has this tag", def->name);
+	    goto cleanup;
+	}
+	if (int_view_validate(ctx, def->layout[matched], &cur, depth + 1) == KRYPT_ERR) goto cleanup;
+	seen[matched] = 1;
+	p += cur.total;
+	left -= cur.total;
+    }
+
+    for (i=0; i < def->layout_size; ++i) {
+	if (!seen[i] && !krypt_definition_has_flag(def->layout[i], KRYPT_DEFINITION_F_OPTIONAL)) {
+	    int_view_error(ctx, v->value, "Mandatory value not found", def->layout[i]->name);
+	    goto cleanup;
+	}
+    }
+    result = KRYPT_OK;
+
+cleanup:
+    xfree(seen);
+    return result;
+}
+
+static int
+int_view_validate_cons_of(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v, int depth)
+{
+    VALUE type, vcompiled, klass;
+    krypt_asn1_compiled_definition *compiled = NULL;
+    krypt_asn1_view cur;
+    uint8_t *p = v->value;
+    size_t left = v->value_len;
+    long num = 0;
+    int match;
+
+    if (!v->is_constructed) return int_view_error(ctx, v->value, "Constructed bit not set", def->name);
+    if (NIL_P((type = krypt_definition_get_type(def)))) {
+	krypt_error_add("'type' missing in ASN.1 definition");
+	return KRYPT_ERR;
+    }
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_TEMPLATE_TYPE)) {
+	if (NIL_P((vcompiled = int_compiled_definition_for(type)))) return KRYPT_ERR;
+	Data_Get_Struct(vcompiled, krypt_asn1_compiled_definition, compiled);
+    }
+
+    while (left > 0) {
+	if (int_view_next(ctx, p, left, &cur, 0) == KRYPT_ERR) return KRYPT_ERR;
+	if (compiled) {
+	    if ((match = int_view_matches(ctx, compiled->match_root, &cur, depth + 1)) == INT_KRYPT_MATCH_ERR) return KRYPT_ERR;
+	    if (match == INT_KRYPT_NO_MATCH) return int_view_error(ctx, p, "Unexpected element in", def->name);
+	    if (int_view_validate(ctx, compiled->root, &cur, depth + 1) == KRYPT_ERR) return KRYPT_ERR;
+	}
+	else {
+	    /* elements must decode to instances of +type+ */
+	    if (cur.tag_class == TAG_CLASS_UNIVERSAL && cur.tag > 30)
+		return int_view_error(ctx, p, "Universal tag too large in", def->name);
+	    klass = krypt_asn1_class_for(cur.tag, cur.tag_class, cur.is_constructed);
+	    if (klass != type && !RTEST(rb_class_inherited_p(klass, type)))
+		return int_view_error(ctx, p, "Unexpected element in", def->name);
+	    if (cur.tag_class == TAG_CLASS_UNIVERSAL && !cur.is_constructed &&
+		int_view_validate_contents(ctx, cur.tag, &cur, def->name) == KRYPT_ERR) return KRYPT_ERR;
+	}
+	p += cur.total;
+	left -= cur.total;
+	num++;
+    }
+
+    if (num == 0 && !krypt_definition_has_flag(def, KRYPT_DEFINITION_F_OPTIONAL))
+	return int_view_error(ctx, v->value, "Sequence is empty", def->name);
+    return KRYPT_OK;
+}
+
+static int
+int_view_validate_choice(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v, int depth)
+{
+    long i;
+
+    for (i=0; i < def->layout_size; ++i) {
+	int match = int_view_matches(ctx, def->layout[i], v, depth + 1);
+	if (match == INT_KRYPT_MATCH_ERR) return KRYPT_ERR;
+	if (match == INT_KRYPT_MATCH) return int_view_validate(ctx, def->layout[i], v, depth + 1);
+    }
+    return int_view_error(ctx, v->value, "Matching CHOICE value not found", def->name);
+}
+
+/* Validates +v+, which is known to match +def+ */
+static int
+int_view_validate(krypt_asn1_view_ctx *ctx, krypt_asn1_definition *def, krypt_asn1_view *v, int depth)
+{
+    krypt_asn1_view inner;
+    krypt_asn1_definition *type_def;
+    ID codec = def->codec;
+    int explicit = krypt_definition_has_flag(def, KRYPT_DEFINITION_F_EXPLICIT);
+
+    if (depth > INT_KRYPT_VIEW_MAX_DEPTH) return int_view_error(ctx, v->value, "Values nested too deeply", 0);
+    if (explicit) {
+	if (!v->is_constructed)
+	    return int_view_error(ctx, v->value, "Constructive bit not set for explicitly tagged value", def->name);
+	if (int_view_next(ctx, v->value, v->value_len, &inner, 0) == KRYPT_ERR) return KRYPT_ERR;
+	if (inner.total != v->value_len)
+	    return int_view_error(ctx, v->value + inner.total, "Data left that could not be parsed", def->name);
+	v = &inner;
+	/* inside the explicit tag, values keep their own universal tag */
+	if ((codec == sKrypt_ID_PRIMITIVE || codec == sKrypt_ID_SEQUENCE || codec == sKrypt_ID_SET ||
+	     codec == sKrypt_ID_SEQUENCE_OF || codec == sKrypt_ID_SET_OF) &&
+	    (v->tag != def->default_tag || v->tag_class != TAG_CLASS_UNIVERSAL))
+	    return int_view_error(ctx, v->value, "Tag mismatch for explicitly tagged value", def->name);
+    }
+
+    if (codec == sKrypt_ID_PRIMITIVE)
+	return int_view_validate_prim(ctx, def, v);
+    if (codec == sKrypt_ID_SEQUENCE)
+	return int_view_validate_cons(ctx, def, v, depth);
+    if (codec == sKrypt_ID_SET)
+	return int_view_validate_set(ctx, def, v, depth);
+    if (codec == sKrypt_ID_SEQUENCE_OF || codec == sKrypt_ID_SET_OF)
+	return int_view_validate_cons_of(ctx, def, v, depth);
+    if (codec == sKrypt_ID_CHOICE)
+	return int_view_validate_choice(ctx, def, v, depth);
+    if (codec == sKrypt_ID_TEMPLATE) {
+	if (!(type_def = int_definition_type_def(def))) return KRYPT_ERR;
+	if (explicit) {
+	    int match = int_view_matches(ctx, type_def, v, depth + 1);
+	    if (match == INT_KRYPT_MATCH_ERR) return KRYPT_ERR;
+	    if (match == INT_KRYPT_NO_MATCH)
+		return int_view_error(ctx, v->value, "Tag mismatch for explicitly tagged value", def->name);
+	}
+	return int_view_validate(ctx, type_def, v, depth + 1);
+    }
+    return KRYPT_OK; /* ANY: the value is well-formed */
+}
+
+static int
+int_template_validate(VALUE klass, VALUE der, int report)
+{
+    VALUE vcompiled;
+    krypt_asn1_compiled_definition *compiled;
+    krypt_asn1_view_ctx ctx;
+    krypt_asn1_view v;
+    int match, result = KRYPT_ERR;
+
+    if (NIL_P((vcompiled = int_compiled_definition_for(klass))))
+	krypt_error_raise(eKryptASN1Error, "Could not access the ASN.1 definition");
+    Data_Get_Struct(vcompiled, krypt_asn1_compiled_definition, compiled);
+    der = krypt_to_der_if_possible(der);
+    StringValue(der);
+
+    ctx.base = (uint8_t *) RSTRING_PTR(der);
+    ctx.report = report;
+    if (int_view_next(&ctx, ctx.base, RSTRING_LEN(der), &v, 0) == KRYPT_ERR) goto out;
+    if ((match = int_view_matches(&ctx, compiled->match_root, &v, 0)) == INT_KRYPT_MATCH_ERR) goto out;
+    if (match == INT_KRYPT_NO_MATCH) {
+	int_view_error(&ctx, ctx.base, "Tag mismatch for value of type", 0);
+	goto out;
+    }
+    if (int_view_validate(&ctx, compiled->root, &v, 0) == KRYPT_ERR) goto out;
+    if (v.total != (size_t) RSTRING_LEN(der)) {
+	int_view_error(&ctx, ctx.base + v.total, "Data left that could not be parsed", 0);
+	goto out;
+    }
+    result = KRYPT_OK;
+
+out:
+    RB_GC_GUARD(der);
+    RB_GC_GUARD(vcompiled);
+    return result;
+}
+
+/*
+ * call-seq:
+ *    Template.valid_der?(der) -> true or false
+ *
+ * * +der+: A DER-encoded +String+ or any object that responds to +to_der+.
+ *
+ * Checks whether +der+ can be parsed as a value of the template, without
+ * creating any objects: headers, tags, lengths, mandatory fields and the
+ * constraints of the definition are verified, but values are not decoded.
+ */
+static VALUE
+krypt_asn1_template_is_valid_der(VALUE klass, VALUE der)
+{
+    if (int_template_validate(klass, der, 0) == KRYPT_OK) return Qtrue;
+    krypt_error_clear();
+    return Qfalse;
+}
+
+/*
+ * call-seq:
+ *    Template.validate!(der) -> true
+ *
+ * Same as Template.valid_der?, but raises a ParseError naming the
+ * offending field and offset if +der+ is not valid.
+ */
+static VALUE
+krypt_asn1_template_validate(VALUE klass, VALUE der)
+{
+    if (int_template_validate(klass, der, 1) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1ParseError, "Invalid value for %s", rb_class2name(klass));
+    return Qtrue;
+}
+
+#define INT_KRYPT_STREAM_MAX_DEPTH	8
+
+#define INT_KRYPT_STREAM_ELEMENTS	0
+#define INT_KRYPT_STREAM_DONE		1
+#define INT_KRYPT_STREAM_FAILED		2
+
+/* A SEQUENCE on the path to the streamed field, or the streamed field itself */
+typedef struct krypt_template_stream_level_st {
+    VALUE self; /* template instance the fields are assigned to */
+    krypt_asn1_definition *def;
+    krypt_asn1_definition *stop; /* field that continues the path */
+    binyo_instream *explicit_in; /* contents of an explicit tag, if any */
+    binyo_instream *in; /* contents of the value */
+    krypt_asn1_header *explicit_header;
+    krypt_asn1_header *header;
+    krypt_asn1_header *next; /* header of the next field, value not read yet */
+    krypt_asn1_object *cur; /* next field, if its value was already read */
+    krypt_asn1_object *buffered; /* the value was read before it was reached */
+    binyo_instream *buffered_in;
+    int is_infinite; /* the contents end with an END OF CONTENTS */
+    int explicit_is_infinite;
+    long index;
+    long num_parsed;
+} krypt_template_stream_level;
+
+typedef struct krypt_template_stream_st {
+    VALUE source; /* keeps the String or IO alive */
+    VALUE value;
+    VALUE type;
+    binyo_instream *in;
+    krypt_template_stream_level levels[INT_KRYPT_STREAM_MAX_DEPTH + 1];
+    int depth; /* levels[depth] holds the elements */
+    int template_type;
+    int decode_flags;
+    int state;
+} krypt_template_stream;
+
+static void
+int_stream_level_close(krypt_template_stream_level *l)
+{
+    if (l->in) binyo_instream_free(l->in);
+    if (l->explicit_in) binyo_instream_free(l->explicit_in);
+    if (l->buffered_in) binyo_instream_free(l->buffered_in);
+    if (l->header) krypt_asn1_header_free(l->header);
+    if (l->explicit_header) krypt_asn1_header_free(l->explicit_header);
+    if (l->next) krypt_asn1_header_free(l->next);
+    if (l->cur) krypt_asn1_object_free(l->cur);
+    if (l->buffered) krypt_asn1_object_free(l->buffered);
+    l->in = l->explicit_in = l->buffered_in = NULL;
+    l->header = l->explicit_header = l->next = NULL;
+    l->cur = l->buffered = NULL;
+}
 
-    if (!(unpacked = int_skip_explicit_choice_header(tagging, object, &new_object))) return KRYPT_ERR;
-    
-    codec = SYM2ID(krypt_hash_get_codec(matched_def));
-    parser = int_get_parse_ctx_for_codec(codec);
-    if (parser->parse(self, unpacked, &inner_def, &inner_dont_free) == KRYPT_ERR) return KRYPT_ERR;
+static void
+int_stream_close(krypt_template_stream *s)
+{
+    int i;
 
-    rb_ivar_set(self, sKrypt_IV_TYPE, type);
-    rb_ivar_set(self, sKrypt_IV_TAG, INT2NUM(unpacked->header->tag));
-    
-    /* complicated cleanup */
-    if (!inner_dont_free) {
-	if (new_object)
-	    krypt_asn1_object_free(unpacked); /* free the unpacked object also, since bytes were copied in inner processing */
-	*dont_free = 0; /* free the argument object in any case */
-    } else {
-	if (new_object)
-	    *dont_free = 0; /* we unpacked the explicit tag, so free the argument object */
-	else
-	    *dont_free = 1; /* the original object was consumed as is within, so don't free it */
+    for (i=s->depth; i >= 0; --i)
+	int_stream_level_close(&s->levels[i]);
+    if (s->in) {
+	binyo_instream_free(s->in);
+	s->in = NULL;
     }
+}
 
-    return KRYPT_OK;
+static void
+int_stream_mark(krypt_template_stream *s)
+{
+    int i;
+
+    if (!s) return;
+    rb_gc_mark(s->source);
+    rb_gc_mark(s->value);
+    rb_gc_mark(s->type);
+    for (i=0; i <= s->depth; ++i)
+	rb_gc_mark(s->levels[i].self);
 }
 
-static int
-int_template_parse(VALUE self, krypt_asn1_template *t)
+static void
+int_stream_free(krypt_template_stream *s)
 {
-    ID codec;
-    VALUE definition;
-    krypt_asn1_definition def;
-    struct krypt_asn1_template_parse_ctx *parser;
-    int dont_free = 0;
+    if (!s) return;
+    int_stream_close(s);
+    xfree(s);
+}
 
-    definition = krypt_asn1_template_get_definition(t);
-    krypt_definition_init(&def, definition, krypt_asn1_template_get_options(t));
-    codec = SYM2ID(krypt_hash_get_codec(definition));
-    parser = int_get_parse_ctx_for_codec(codec);
+/*
+ * Opens the contents of the value of +l+ that starts with +header+ in
+ * +parent+, or that was already read into +l->buffered+. An explicit tag
+ * is unwrapped first, the value within has to carry +inner_tag+.
+ */
+static int
+int_stream_level_open(krypt_template_stream_level *l, binyo_instream *parent, krypt_asn1_header *header, krypt_asn1_definition *def, int inner_tag)
+{
+    if (l->buffered) {
+	l->buffered_in = binyo_instream_new_bytes(l->buffered->bytes, l->buffered->bytes_len);
+	header = l->buffered->header;
+    }
 
-    if (parser->parse(self, t->object, &def, &dont_free) == KRYPT_ERR) return KRYPT_ERR;
-    krypt_asn1_template_set_parsed(t, 1);
-    krypt_asn1_template_set_decoded(t, 1);
+    if (krypt_definition_has_flag(def, KRYPT_DEFINITION_F_EXPLICIT)) {
+	l->explicit_is_infinite = header->is_infinite;
+	l->explicit_header = l->buffered ? NULL : header;
+	l->explicit_in = l->buffered ? l->buffered_in : krypt_asn1_get_value_stream(parent, header, 0);
+	if (l->buffered) l->buffered_in = NULL;
+	if (krypt_asn1_next_header(l->explicit_in, &header) != KRYPT_OK) {
+	    krypt_error_add("Could not read explicitly tagged value");
+	    return KRYPT_ERR;
+	}
+	l->header = header;
+	if (header->tag != inner_tag || header->tag_class != TAG_CLASS_UNIVERSAL) {
+	    krypt_error_add("Tag mismatch. Expected: %d Got: %d", inner_tag, header->tag);
+	    return KRYPT_ERR;
+	}
+	parent = l->explicit_in;
+    }
+    else if (l->buffered) {
+	if (!header->is_constructed) {
+	    krypt_error_add("Constructive bit not set");
+	    return KRYPT_ERR;
+	}
+	l->is_infinite = header->is_infinite;
+	l->in = l->buffered_in;
+	l->buffered_in = NULL;
+	return KRYPT_OK;
+    }
+    else {
+	l->header = header;
+    }
 
-    /* Invalidate the cached template encoding */
-    /* If dont_free is 0 this means that the encoding bytes were copied and
-     * processed further inside -> we can free the template's object */
-    if (!dont_free) {
-        krypt_asn1_object_free(t->object);
+    if (!header->is_constructed) {
+	krypt_error_add("Constructive bit not set");
+	return KRYPT_ERR;
     }
-    t->object = NULL;
+    l->is_infinite = header->is_infinite;
+    l->in = krypt_asn1_get_value_stream(parent, header, 0);
     return KRYPT_OK;
 }
 
+/* Reads the header of the next field of +l+, sets l->next to NULL at the
+ * end. The END OF CONTENTS of infinite length contents is consumed. */
 static int
-int_value_decode(VALUE self, krypt_asn1_template *t)
+int_stream_level_peek(krypt_template_stream_level *l)
 {
-    ID codec;
-    VALUE definition, value;
-    krypt_asn1_definition def;
-    struct krypt_asn1_template_parse_ctx *parser;
-    
-    definition = krypt_asn1_template_get_definition(t);
-    krypt_definition_init(&def, definition, krypt_asn1_template_get_options(t));
-    codec = SYM2ID(krypt_hash_get_codec(definition));
-    parser = int_get_parse_ctx_for_codec(codec);
-    if (!parser->decode) return KRYPT_OK;
-    if (parser->decode(self, t->object, &def, &value) == KRYPT_ERR) return KRYPT_ERR;
-    krypt_asn1_template_set_decoded(t, 1);
-    krypt_asn1_template_set_value(t, value);
+    int result;
+
+    l->next = NULL;
+    result = krypt_asn1_next_header(l->in, &l->next);
+    if (result == KRYPT_ERR) return KRYPT_ERR;
+    if (result == KRYPT_ASN1_EOF) {
+	l->next = NULL;
+    }
+    else if (l->is_infinite && int_header_is_eoc(l->next)) {
+	krypt_asn1_header_free(l->next);
+	l->next = NULL;
+    }
     return KRYPT_OK;
 }
 
+/* Nothing but the END OF CONTENTS of an infinite length explicit tag may
+ * follow the value within */
 static int
-int_get_inner_value(VALUE self, ID ivname, VALUE *out)
+int_stream_level_check_explicit(krypt_template_stream_level *l)
 {
-    krypt_asn1_template *template;
+    if (!l->explicit_in) return KRYPT_OK;
+    if (l->explicit_is_infinite && int_parse_eoc(l->explicit_in) == KRYPT_ERR) {
+	krypt_error_add("No closing END OF CONTENTS found");
+	return KRYPT_ERR;
+    }
+    return int_ensure_stream_is_consumed(l->explicit_in);
+}
 
-    krypt_asn1_template_get(self, template);
-    if (!(krypt_asn1_template_is_parsed(template))) {
-	if (int_template_parse(self, template) == KRYPT_ERR) return KRYPT_ERR;
+static int
+int_stream_level_check_consumed(krypt_template_stream_level *l)
+{
+    if (l->next || l->cur) {
+	krypt_error_add("Data left that could not be parsed");
+	return KRYPT_ERR;
     }
+    return int_stream_level_check_explicit(l);
+}
 
-    *out = rb_ivar_get(self, ivname);
-    return KRYPT_OK;
+/*
+ * Parses the fields of +l+ from l->index on, just like int_parse_cons.
+ * Stops with *stopped set to 1 at l->stop if it is present, otherwise
+ * parses the rest of the fields and checks that nothing is left.
+ */
+static int
+int_stream_level_parse(krypt_template_stream_level *l, int *stopped)
+{
+    krypt_asn1_definition *def = l->def;
+    krypt_asn1_header *header;
+
+    *stopped = 0;
+    for (; l->index < def->layout_size; ++l->index) {
+	int result, dont_free;
+	krypt_asn1_definition *inner_def = def->layout[l->index];
+	struct krypt_asn1_template_parse_ctx *parser = inner_def->parser;
+	struct krypt_asn1_template_match_ctx ctx;
+
+	if (!l->next && !l->cur) {
+	    if (int_ensure_rest_is_optional(l->self, def, l->index) == KRYPT_ERR) return KRYPT_ERR;
+	    l->index = def->layout_size;
+	    break;
+	}
+	header = l->cur ? l->cur->header : l->next;
+
+	if (inner_def == l->stop) {
+	    if (int_definition_may_start_with(inner_def, header)) {
+		*stopped = 1;
+		return KRYPT_OK;
+	    }
+	    if (!krypt_definition_has_flag(inner_def, KRYPT_DEFINITION_F_OPTIONAL)) {
+		krypt_error_add("Mandatory value %s is missing", rb_id2name(inner_def->name));
+		return KRYPT_ERR;
+	    }
+	    continue;
+	}
+	if (krypt_definition_has_flag(inner_def, KRYPT_DEFINITION_F_OPTIONAL) &&
+	    !int_definition_may_start_with(inner_def, header)) {
+	    int_skip_optional(l->self, inner_def);
+	    continue;
+	}
+
+	if (!l->cur) {
+	    uint8_t *value = NULL;
+	    size_t value_len;
+	    if (krypt_asn1_get_value(l->in, l->next, &value, &value_len) == KRYPT_ERR) return KRYPT_ERR;
+	    l->cur = krypt_asn1_object_new_value(l->next, value, value_len);
+	    l->next = NULL;
+	}
+
+	krypt_error_clear();
+	int_match_ctx_init(&ctx, l->cur);
+	if ((result = parser->match(l->self, &ctx, inner_def)) == INT_KRYPT_MATCH_ERR) return KRYPT_ERR;
+	if (result == INT_KRYPT_MATCH) {
+	    if (parser->parse(l->self, l->cur, inner_def, &dont_free) == KRYPT_ERR) return KRYPT_ERR;
+	    if (!dont_free) krypt_asn1_object_free(l->cur);
+	    l->cur = NULL;
+	    l->num_parsed++;
+	    if (int_stream_level_peek(l) == KRYPT_ERR) return KRYPT_ERR;
+	}
+    }
+
+    if (l->num_parsed < def->min_size) {
+	krypt_error_add("Expected %ld..%ld values. Got: %ld", def->min_size, def->layout_size, l->num_parsed);
+	return KRYPT_ERR;
+    }
+    return int_stream_level_check_consumed(l);
 }
 
-int
-krypt_asn1_template_get_cb_value(VALUE self, ID ivname, VALUE *out)
+/* Creates the template instance for the TEMPLATE field +def+ of +parent+,
+ * its fields are assigned while streaming */
+static VALUE
+int_stream_template_new(VALUE parent, krypt_asn1_definition *def)
 {
-    krypt_asn1_template *value_template;
-    VALUE value = Qnil;
-    
-    if (int_get_inner_value(self, ivname, &value) == KRYPT_ERR) return KRYPT_ERR;
-    if (NIL_P(value)) {
-	*out = Qnil;
-	return KRYPT_OK;
+    VALUE instance;
+    krypt_asn1_definition *type_def = krypt_definition_type_def(def);
+    krypt_asn1_template *parent_template, *value_template;
+    krypt_asn1_field *field;
+
+    value_template = int_inner_template_new(parent, NULL, 0, def, type_def);
+    krypt_asn1_template_set_parsed(value_template, 1);
+    krypt_asn1_template_set_decoded(value_template, 1);
+    krypt_asn1_template_set(krypt_definition_get_type(def), instance, value_template);
+
+    krypt_asn1_template_get(parent, parent_template);
+    field = krypt_asn1_template_get_field(parent_template, def);
+    krypt_asn1_field_clear(field);
+    field->value = instance;
+    field->def = def;
+    field->flags = KRYPT_TEMPLATE_PARSED | KRYPT_TEMPLATE_DECODED;
+    return instance;
+}
+
+/* Moves from the stop field of +parent+ into the next level */
+static int
+int_stream_descend(krypt_template_stream *s, int depth)
+{
+    krypt_template_stream_level *parent = &s->levels[depth - 1], *l = &s->levels[depth];
+    krypt_asn1_definition *field = parent->stop;
+    krypt_asn1_header *header = NULL;
+    int inner_tag;
+
+    if (parent->cur) {
+	l->buffered = parent->cur;
+	parent->cur = NULL;
+    }
+    else {
+	header = parent->next;
+	parent->next = NULL;
     }
-    
-    krypt_asn1_template_get(value, value_template);
 
-    if (!krypt_asn1_template_is_decoded(value_template)) {
-	if (int_value_decode(value, value_template) == KRYPT_ERR) return KRYPT_ERR;
+    if (field->codec == sKrypt_ID_TEMPLATE) {
+	l->self = int_stream_template_new(parent->self, field);
+	inner_tag = TAGS_SEQUENCE;
     }
+    else {
+	inner_tag = field->default_tag;
+    }
+    return int_stream_level_open(l, parent->in, header, field, inner_tag);
+}
 
-    *out = krypt_asn1_template_get_value(value_template);
+/* Parses the fields following the streamed field on each level */
+static int
+int_stream_finish(krypt_template_stream *s)
+{
+    int i, stopped;
+    krypt_template_stream_level *l;
+
+    if (int_ensure_stream_is_consumed(s->levels[s->depth].in) == KRYPT_ERR) return KRYPT_ERR;
+    if (int_stream_level_check_explicit(&s->levels[s->depth]) == KRYPT_ERR) return KRYPT_ERR;
+    int_stream_level_close(&s->levels[s->depth]);
+
+    for (i=s->depth - 1; i >= 0; --i) {
+	l = &s->levels[i];
+	l->index++;
+	l->num_parsed++;
+	l->stop = NULL;
+	if (int_stream_level_peek(l) == KRYPT_ERR) return KRYPT_ERR;
+	if (int_stream_level_parse(l, &stopped) == KRYPT_ERR) return KRYPT_ERR;
+	int_stream_level_close(l);
+    }
     return KRYPT_OK;
 }
 
-void
-krypt_asn1_template_set_cb_value(VALUE self, ID ivname, VALUE value)
+/* Reads the next element, returns KRYPT_ASN1_EOF after the last one */
+static int
+int_stream_next_element(krypt_template_stream *s, VALUE *out)
 {
-    VALUE container;
-    krypt_asn1_template *template, *value_template;
+    krypt_template_stream_level *l = &s->levels[s->depth];
+    krypt_asn1_header *header;
+    VALUE ret;
+    int result;
 
-    container = rb_ivar_get(self, ivname);
-    krypt_asn1_template_get(self, template);
+    result = int_next_element_header(l->in, l->is_infinite, &header);
+    if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR) return result;
 
-    if (NIL_P(container)) {
-	VALUE obj;
-	value_template = krypt_asn1_template_new_value(value);
-	krypt_asn1_template_set(cKryptASN1TemplateValue, obj, value_template);
-	rb_ivar_set(self, ivname, obj); 
-    } else {
-	krypt_asn1_template_get(container, value_template);
+    if (s->template_type) {
+	ret = int_rb_template_new_initial(s->type, l->in, header, s->decode_flags);
+	if (NIL_P(ret)) {
+	    krypt_asn1_header_free(header);
+	    return KRYPT_ERR;
+	}
+    }
+    else {
+	if (krypt_asn1_decode_header_flags(l->in, header, s->decode_flags, &ret) == KRYPT_ERR) return KRYPT_ERR;
+	if (!rb_obj_is_kind_of(ret, s->type)) {
+	    krypt_error_add("Expected %s but got %s instead", rb_class2name(s->type), rb_class2name(CLASS_OF(ret)));
+	    return KRYPT_ERR;
+	}
+    }
+    *out = ret;
+    return KRYPT_OK;
+}
+
+static krypt_asn1_definition *
+int_stream_field(krypt_asn1_definition *def, VALUE name)
+{
+    ID id = int_field_id(name);
+    long i;
+
+    for (i=0; i < def->layout_size; ++i) {
+	if (def->layout[i]->name == id) return def->layout[i];
     }
+    krypt_error_add("Unknown field %s", rb_id2name(id));
+    return NULL;
+}
+
+/* Resolves +path+ to the stop fields of each level */
+static int
+int_stream_resolve_path(krypt_template_stream *s, krypt_asn1_definition *root, VALUE path)
+{
+    krypt_asn1_definition *cur = root, *field = NULL;
+    long i, len;
 
-    krypt_asn1_template_set_modified(template, 1);
-    krypt_asn1_template_set_value(value_template, value);
+    path = rb_Array(path);
+    len = RARRAY_LEN(path);
+    if (len == 0 || len > INT_KRYPT_STREAM_MAX_DEPTH) {
+	krypt_error_add("Path must name 1..%d fields", INT_KRYPT_STREAM_MAX_DEPTH);
+	return KRYPT_ERR;
+    }
+    for (i=0; i < len; ++i) {
+	if (cur->codec != sKrypt_ID_SEQUENCE) {
+	    krypt_error_add("Only SEQUENCE values can be streamed");
+	    return KRYPT_ERR;
+	}
+	if (!(field = int_stream_field(cur, rb_ary_entry(path, i)))) return KRYPT_ERR;
+	s->levels[i].def = cur;
+	s->levels[i].stop = field;
+	if (i < len - 1) {
+	    if (field->codec != sKrypt_ID_TEMPLATE) {
+		krypt_error_add("%s is not a template value", rb_id2name(field->name));
+		return KRYPT_ERR;
+	    }
+	    if (!(cur = int_definition_type_def(field))) return KRYPT_ERR;
+	}
+	else if (field->codec != sKrypt_ID_SEQUENCE_OF && field->codec != sKrypt_ID_SET_OF) {
+	    krypt_error_add("%s is not a SEQUENCE OF or SET OF value", rb_id2name(field->name));
+	    return KRYPT_ERR;
+	}
+    }
+    s->depth = (int) len;
+    s->levels[len].def = field;
+    s->type = krypt_definition_get_type(field);
+    s->template_type = krypt_definition_has_flag(field, KRYPT_DEFINITION_F_TEMPLATE_TYPE);
+    return KRYPT_OK;
 }
 
-static VALUE
-int_rb_template_new_initial(VALUE klass, binyo_instream *in, krypt_asn1_header *header)
+/* Parses up to the first element of the streamed field */
+static int
+int_stream_start(krypt_template_stream *s, VALUE klass, krypt_asn1_compiled_definition *compiled, VALUE vcompiled)
 {
-    ID codec;
-    VALUE obj;
-    VALUE definition;
+    krypt_asn1_header *header;
     krypt_asn1_template *template;
-    krypt_asn1_definition def;
-    struct krypt_asn1_template_match_ctx ctx;
-    struct krypt_asn1_template_parse_ctx *parser; 
+    krypt_template_stream_level *l;
+    int i, stopped;
 
-    if (NIL_P((definition = krypt_definition_get(klass)))) {
-        krypt_error_add("%s has no ASN.1 definition", rb_class2name(klass));
-        return Qnil;
+    if (krypt_asn1_next_header(s->in, &header) != KRYPT_OK) {
+	krypt_error_add("Could not read the value");
+	return KRYPT_ERR;
+    }
+    l = &s->levels[0];
+    l->header = header;
+    if (!int_definition_may_start_with(compiled->match_root, header) || !header->is_constructed) {
+	krypt_error_add("Type mismatch");
+	return KRYPT_ERR;
     }
 
-    if (!(template = krypt_asn1_template_new_from_stream(in, header, definition, krypt_hash_get_options(definition)))) {
-        krypt_error_add("Error while reading data");
-        return Qnil;
+    template = krypt_asn1_template_new(NULL, compiled->definition, krypt_hash_get_options(compiled->definition));
+    template->decode_flags = s->decode_flags;
+    template->def = compiled->root;
+    template->compiled = vcompiled;
+    krypt_asn1_template_set_parsed(template, 1);
+    krypt_asn1_template_set_decoded(template, 1);
+    krypt_asn1_template_set(klass, s->value, template);
+    l->self = s->value;
+    l->is_infinite = header->is_infinite;
+    l->in = krypt_asn1_get_value_stream(s->in, header, 0);
+
+    for (i=0; i < s->depth; ++i) {
+	l = &s->levels[i];
+	if (int_stream_level_peek(l) == KRYPT_ERR) return KRYPT_ERR;
+	if (int_stream_level_parse(l, &stopped) == KRYPT_ERR) return KRYPT_ERR;
+	if (!stopped) {
+	    /* the optional streamed value is absent */
+	    int_stream_close(s);
+	    s->state = INT_KRYPT_STREAM_DONE;
+	    return KRYPT_OK;
+	}
+	if (int_stream_descend(s, i + 1) == KRYPT_ERR) return KRYPT_ERR;
     }
+    s->state = INT_KRYPT_STREAM_ELEMENTS;
+    return KRYPT_OK;
+}
 
-    /* ensure it matches */
-    krypt_definition_init(&def, definition, Qnil); /* top-level definition has no options */
-    codec = SYM2ID(krypt_hash_get_codec(definition));
-    parser = int_get_parse_ctx_for_codec(codec);
-    int_match_ctx_init(&ctx, template->object);
-    obj = rb_obj_alloc(klass);
-    if (parser->match(obj, &ctx, &def) != INT_KRYPT_MATCH) {
-	krypt_error_add("Type mismatch");
-	return Qnil;
+/*
+ * call-seq:
+ *    Template.parse_der_stream(io, path, [opts]) -> Template::Stream
+ *
+ * * +io+: An IO or a DER-encoded +String+
+ * * +path+: The names of the fields leading to the SEQUENCE OF or SET OF
+ *           value to be streamed, e.g. [:tbs_cert_list, :revoked_certificates].
+ *           Each but the last name a TEMPLATE field whose type is a SEQUENCE.
+ * * +opts+: Decoding options, see parse_der.
+ *
+ * Parses the value up to the first element of the streamed field. The
+ * elements are then read one at a time by Stream#each, the fields following
+ * the streamed field are parsed once the last element has been read.
+ * Only one element is held in memory at any time, the elements are not
+ * assigned to the streamed field of the template.
+ */
+static VALUE
+krypt_asn1_template_parse_der_stream(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE source, path, opts = Qnil, ret, vcompiled;
+    krypt_asn1_compiled_definition *compiled;
+    krypt_template_stream *s;
+
+    rb_scan_args(argc, argv, "21", &source, &path, &opts);
+    if (NIL_P((vcompiled = int_compiled_definition_for(klass))))
+	krypt_error_raise(eKryptASN1Error, "Parsing the value failed");
+    Data_Get_Struct(vcompiled, krypt_asn1_compiled_definition, compiled);
+
+    s = ALLOC(krypt_template_stream);
+    memset(s, 0, sizeof(krypt_template_stream));
+    s->source = s->value = s->type = Qnil;
+    s->state = INT_KRYPT_STREAM_FAILED;
+    s->decode_flags = krypt_asn1_decode_flags_for(opts);
+    ret = Data_Wrap_Struct(cKryptASN1TemplateStream, int_stream_mark, int_stream_free, s);
+
+    if (!(s->in = binyo_instream_new_value(source))) {
+	source = krypt_to_der_if_possible(source);
+	StringValue(source);
+	s->in = binyo_instream_new_bytes((uint8_t *) RSTRING_PTR(source), RSTRING_LEN(source));
     }
+    s->source = source;
 
-    krypt_asn1_template_set(klass, obj, template);
-    return obj;
+    if (int_stream_resolve_path(s, compiled->root, path) == KRYPT_ERR ||
+	int_stream_start(s, klass, compiled, vcompiled) == KRYPT_ERR) {
+	int_stream_close(s);
+	krypt_error_raise(eKryptASN1Error, "Parsing the value failed");
+    }
+    return ret;
 }
 
-static int
-krypt_asn1_template_parse_stream(binyo_instream *in, VALUE klass, VALUE *out)
+/*
+ * call-seq:
+ *    stream.value -> Template
+ *
+ * The template instance. The fields following the streamed field are only
+ * set once #each has read all elements.
+ */
+static VALUE
+krypt_asn1_template_stream_value(VALUE self)
 {
-    krypt_asn1_header *header;
-    VALUE ret;
+    krypt_template_stream *s;
+
+    Data_Get_Struct(self, krypt_template_stream, s);
+    return s->value;
+}
+
+/*
+ * call-seq:
+ *    stream.finished? -> true or false
+ *
+ * Whether all elements have been read and the value was parsed completely.
+ */
+static VALUE
+krypt_asn1_template_stream_is_finished(VALUE self)
+{
+    krypt_template_stream *s;
+
+    Data_Get_Struct(self, krypt_template_stream, s);
+    return s->state == INT_KRYPT_STREAM_DONE ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    stream.each { |element| block } -> stream
+ *
+ * Reads the remaining elements from the stream and yields them one after
+ * the other. Leaving the block early and calling #each again continues
+ * with the next element. If no block is given, an enumerator is returned
+ * instead.
+ */
+static VALUE
+krypt_asn1_template_stream_each(VALUE self)
+{
+    krypt_template_stream *s;
+    VALUE cur = Qnil;
     int result;
 
-    result = krypt_asn1_next_header(in, &header);
-    if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR) return result;
+    KRYPT_RETURN_ENUMERATOR(self, sKrypt_ID_EACH);
 
-    ret = int_rb_template_new_initial(klass, in, header);
-    if (NIL_P(ret)) {
-	krypt_asn1_header_free(header);
-	return KRYPT_ERR;
+    Data_Get_Struct(self, krypt_template_stream, s);
+    if (s->state == INT_KRYPT_STREAM_FAILED)
+	rb_raise(eKryptASN1Error, "The stream can no longer be read");
+
+    while (s->state == INT_KRYPT_STREAM_ELEMENTS) {
+	result = int_stream_next_element(s, &cur);
+	if (result == KRYPT_ASN1_EOF) {
+	    result = int_stream_finish(s);
+	    int_stream_close(s);
+	    s->state = result == KRYPT_OK ? INT_KRYPT_STREAM_DONE : INT_KRYPT_STREAM_FAILED;
+	}
+	else if (result == KRYPT_OK) {
+	    rb_yield(cur);
+	    continue;
+	}
+	else {
+	    s->state = INT_KRYPT_STREAM_FAILED;
+	}
+	if (s->state == INT_KRYPT_STREAM_FAILED) {
+	    int_stream_close(s);
+	    krypt_error_raise(eKryptASN1Error, "Error while streaming %s", rb_id2name(s->levels[s->depth].def->name));
+	}
     }
-    *out = ret;
-    return KRYPT_OK;
+    return self;
 }
 
-VALUE
-krypt_asn1_template_parse_der(VALUE klass, VALUE der)
+/*
+ * call-seq:
+ *    collection.size -> Integer
+ *
+ * The number of elements, known without decoding any of them.
+ */
+static VALUE
+krypt_asn1_collection_size(VALUE self)
+{
+    krypt_asn1_collection *c;
+
+    krypt_asn1_collection_get(self, c);
+    return LONG2NUM(c->size);
+}
+
+/*
+ * call-seq:
+ *    collection.empty? -> true or false
+ */
+static VALUE
+krypt_asn1_collection_is_empty(VALUE self)
+{
+    krypt_asn1_collection *c;
+
+    krypt_asn1_collection_get(self, c);
+    return c->size == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    collection[index] -> element or nil
+ *
+ * Decodes the element at +index+, negative values count from the end.
+ * Raises ASN1Error if the element can't be decoded.
+ */
+static VALUE
+krypt_asn1_collection_aref(VALUE self, VALUE vindex)
 {
+    krypt_asn1_collection *c;
+    long i = NUM2LONG(vindex);
     VALUE ret = Qnil;
-    int result;
-    binyo_instream *in = krypt_instream_new_value_der(der);
 
-    result = krypt_asn1_template_parse_stream(in, klass, &ret);
-    binyo_instream_free(in);
-    if (result == KRYPT_ASN1_EOF || result == KRYPT_ERR)
-	krypt_error_raise(eKryptASN1Error, "Parsing the value failed"); 
+    krypt_asn1_collection_get(self, c);
+    if (i < 0) i += c->size;
+    if (i < 0 || i >= c->size) return Qnil;
+    if (int_collection_element(c, i, &ret) == KRYPT_ERR)
+	krypt_error_raise(eKryptASN1Error, "Error while accessing element");
+    return ret;
+}
+
+/*
+ * call-seq:
+ *    collection.each { |element| block } -> collection
+ *
+ * Decodes the elements one after the other and yields them. If no block
+ * is given, an enumerator is returned instead.
+ */
+static VALUE
+krypt_asn1_collection_each(VALUE self)
+{
+    krypt_asn1_collection *c;
+    VALUE cur = Qnil;
+    long i;
+
+    KRYPT_RETURN_ENUMERATOR(self, sKrypt_ID_EACH);
+
+    krypt_asn1_collection_get(self, c);
+    for (i=0; i < c->size; ++i) {
+	if (int_collection_element(c, i, &cur) == KRYPT_ERR)
+	    krypt_error_raise(eKryptASN1Error, "Error while accessing element");
+	rb_yield(cur);
+    }
+    return self;
+}
+
+/*
+ * call-seq:
+ *    collection.to_a -> Array
+ *
+ * Decodes all elements. Modifying the Array does not modify the template,
+ * assign it to the field for that.
+ */
+VALUE
+krypt_asn1_collection_to_a(VALUE self)
+{
+    krypt_asn1_collection *c;
+    VALUE ret, cur = Qnil;
+    long i;
+
+    krypt_asn1_collection_get(self, c);
+    ret = rb_ary_new2(c->size);
+    for (i=0; i < c->size; ++i) {
+	if (int_collection_element(c, i, &cur) == KRYPT_ERR)
+	    krypt_error_raise(eKryptASN1Error, "Error while accessing element");
+	rb_ary_push(ret, cur);
+    }
     return ret;
 }
 
@@ -1170,7 +3465,58 @@ void
 Init_krypt_asn1_template_parser(void)
 {
     VALUE mParser = rb_define_module_under(mKryptASN1Template, "Parser");
-    rb_define_method(mParser, "parse_der", krypt_asn1_template_parse_der, 1);
+    rb_define_method(mParser, "parse_der", krypt_asn1_template_parse_der, -1);
     rb_define_alias(mParser, "decode_der", "parse_der");
+    rb_define_method(mParser, "parse_der_stream", krypt_asn1_template_parse_der_stream, -1);
+    rb_define_method(mParser, "projection", krypt_asn1_template_projection, -1);
+    rb_define_method(mParser, "valid_der?", krypt_asn1_template_is_valid_der, 1);
+    rb_define_method(mParser, "validate!", krypt_asn1_template_validate, 1);
+
+    sKrypt_ID_ONLY = rb_intern("only");
+    sKrypt_ID_PATH = rb_intern("path");
+    sKrypt_IV_PROJECTION_TEMPLATE = rb_intern("__template__");
+    sKrypt_IV_PROJECTION_FIELDS = rb_intern("__fields__");
+
+    /*
+     * Document-class: Krypt::ASN1::Template::Projection
+     *
+     * The fields of a template to parse, created by Template.projection.
+     */
+    cKryptASN1TemplateProjection = rb_define_class_under(mKryptASN1Template, "Projection", rb_cObject);
+    rb_undef_method(CLASS_OF(cKryptASN1TemplateProjection), "new");
+    rb_define_method(cKryptASN1TemplateProjection, "parse_der", krypt_asn1_template_projection_parse_der, -1);
+
+    /*
+     * Document-class: Krypt::ASN1::Template::Stream
+     *
+     * Returned by Template.parse_der_stream, reads the elements of one
+     * SEQUENCE OF or SET OF value of a template from an IO one at a time.
+     */
+    cKryptASN1TemplateStream = rb_define_class_under(mKryptASN1Template, "Stream", rb_cObject);
+    rb_include_module(cKryptASN1TemplateStream, rb_mEnumerable);
+    rb_undef_alloc_func(cKryptASN1TemplateStream);
+    rb_define_method(cKryptASN1TemplateStream, "value", krypt_asn1_template_stream_value, 0);
+    rb_define_method(cKryptASN1TemplateStream, "finished?", krypt_asn1_template_stream_is_finished, 0);
+    rb_define_method(cKryptASN1TemplateStream, "each", krypt_asn1_template_stream_each, 0);
+
+    /*
+     * Document-class: Krypt::ASN1::Template::Collection
+     *
+     * The value of SEQUENCE OF and SET OF fields of templates parsed with
+     * the +:lazy_collections+ option. Only the positions of the elements
+     * are determined when the field is accessed, the elements themselves
+     * are decoded when they are requested. Decoded elements are kept unless
+     * +:cache_elements+ was set to false. Elements are checked against the
+     * field's type when they are decoded, not up front.
+     */
+    cKryptASN1TemplateCollection = rb_define_class_under(mKryptASN1Template, "Collection", rb_cObject);
+    rb_include_module(cKryptASN1TemplateCollection, rb_mEnumerable);
+    rb_undef_alloc_func(cKryptASN1TemplateCollection);
+    rb_define_method(cKryptASN1TemplateCollection, "size", krypt_asn1_collection_size, 0);
+    rb_define_alias(cKryptASN1TemplateCollection, "length", "size");
+    rb_define_method(cKryptASN1TemplateCollection, "empty?", krypt_asn1_collection_is_empty, 0);
+    rb_define_method(cKryptASN1TemplateCollection, "[]", krypt_asn1_collection_aref, 1);
+    rb_define_method(cKryptASN1TemplateCollection, "each", krypt_asn1_collection_each, 0);
+    rb_define_method(cKryptASN1TemplateCollection, "to_a", krypt_asn1_collection_to_a, 0);
 }
 
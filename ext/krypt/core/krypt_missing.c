@@ -41,6 +41,37 @@ rb_str_encode(VALUE str, VALUE to, int ecflags, VALUE ecopts)
 }
 #endif
 
+#ifndef HAVE_RB_TIME_TIMESPEC_NEW
+/* Only supports UTC (INT_MAX - 1) and local time (INT_MAX) offsets */
+VALUE
+krypt_time_timespec_new(const struct timespec *ts, int offset)
+{
+    VALUE time = rb_time_nano_new(ts->tv_sec, ts->tv_nsec);
+    if (offset == INT_MAX - 1)
+	return rb_funcall(time, rb_intern("utc"), 0);
+    return time;
+}
+#endif
+
+#ifndef HAVE_RB_STR_TO_INTERNED_STR
+/* String#-@ deduplicates frozen strings since Ruby 2.5 */
+VALUE
+krypt_str_to_interned_str(VALUE str)
+{
+    return rb_funcall(rb_str_new_frozen(str), rb_intern("-@"), 0);
+}
+#endif
+
+#ifndef HAVE_RB_ENC_INTERNED_STR
+VALUE
+krypt_enc_interned_str(const char *ptr, long len, rb_encoding *enc)
+{
+    VALUE str = rb_str_new(ptr, len);
+    rb_enc_associate(str, enc);
+    return rb_str_to_interned_str(str);
+}
+#endif
+
 #ifndef HAVE_GMTIME_R
 struct tm *
 krypt_gmtime_r(const time_t *tp, struct tm *result)
@@ -51,7 +82,29 @@ krypt_gmtime_r(const time_t *tp, struct tm *result)
 }
 #endif
 
-#ifdef HAVE_RB_BIG_PACK
+#if defined(HAVE_RB_INTEGER_PACK)
+int
+krypt_asn1_encode_bignum(VALUE bignum, uint8_t **out, size_t *outlen)
+{
+    int nlz_bits;
+    size_t len;
+    uint8_t *bytes;
+
+    len = rb_absint_size(bignum, &nlz_bits);
+    /* An additional byte is needed if the most significant bit is set,
+     * unless a negative number is exactly -2^(8 * len - 1) */
+    if (nlz_bits == 0 &&
+	!(RBIGNUM_NEGATIVE_P(bignum) && rb_absint_singlebit_p(bignum)))
+	len++;
+
+    bytes = ALLOC_N(uint8_t, len);
+    rb_integer_pack(bignum, bytes, len, 1, 0,
+		    INTEGER_PACK_BIG_ENDIAN | INTEGER_PACK_2COMP);
+    *out = bytes;
+    *outlen = len;
+    return KRYPT_OK;
+}
+#elif defined(HAVE_RB_BIG_PACK)
 int
 krypt_asn1_encode_bignum(VALUE bignum, uint8_t **out, size_t *outlen)
 {
@@ -158,7 +211,15 @@ krypt_asn1_encode_bignum(VALUE bignum, uint8_t **out, size_t *outlen)
 }
 #endif
 
-#ifdef HAVE_RB_BIG_PACK
+#if defined(HAVE_RB_INTEGER_PACK)
+int
+krypt_asn1_decode_bignum(uint8_t *bytes, size_t len, VALUE *out)
+{
+    *out = rb_integer_unpack(bytes, len, 1, 0,
+	    		     INTEGER_PACK_BIG_ENDIAN | INTEGER_PACK_2COMP);
+    return KRYPT_OK;
+}
+#elif defined(HAVE_RB_BIG_PACK)
 int
 krypt_asn1_decode_bignum(uint8_t *bytes, size_t len, VALUE *out)
 {
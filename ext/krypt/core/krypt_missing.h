@@ -49,6 +49,26 @@ do {											\
 VALUE rb_str_encode(VALUE str, VALUE to, int ecflags, VALUE ecopts);
 #endif
 
+#ifndef HAVE_RB_TIME_TIMESPEC_NEW
+#include <time.h>
+VALUE krypt_time_timespec_new(const struct timespec *ts, int offset);
+#define rb_time_timespec_new(ts, offset)	krypt_time_timespec_new((ts), (offset))
+#endif
+
+#ifndef HAVE_RB_ENC_INTERNED_STR
+VALUE krypt_enc_interned_str(const char *ptr, long len, rb_encoding *enc);
+#define rb_enc_interned_str(ptr, len, enc)	krypt_enc_interned_str((ptr), (len), (enc))
+#endif
+
+#ifndef HAVE_RB_STR_TO_INTERNED_STR
+VALUE krypt_str_to_interned_str(VALUE str);
+#define rb_str_to_interned_str(str)		krypt_str_to_interned_str((str))
+#endif
+
+#ifndef HAVE_RB_HASH_NEW_CAPA
+#define rb_hash_new_capa(capa)			rb_hash_new()
+#endif
+
 #ifndef HAVE_GMTIME_R
 #include <time.h>
 struct tm *krypt_gmtime_r(const time_t *tp, struct tm *result);